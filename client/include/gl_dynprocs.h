@@ -32,6 +32,8 @@ struct GLDynProcs
   PFNGLBUFFERDATAPROC     glBufferData;
   PFNGLBUFFERSUBDATAPROC  glBufferSubData;
   PFNGLDELETEBUFFERSPROC  glDeleteBuffers;
+  PFNGLBUFFERSTORAGEPROC  glBufferStorage;
+  PFNGLMAPBUFFERRANGEPROC glMapBufferRange;
   PFNGLISSYNCPROC         glIsSync;
   PFNGLFENCESYNCPROC      glFenceSync;
   PFNGLCLIENTWAITSYNCPROC glClientWaitSync;
@@ -143,10 +143,12 @@ typedef struct LG_RendererOps
       const double scale, const LG_RendererRect destRect,
       LG_RendererRotate rotate);
 
-  /* called when the mouse shape has changed
+  /* called when the mouse shape has changed, shapes with the same non-zero
+   * `id` are identical and may be served from a cache
    * Context: cursorThread */
   bool (*onMouseShape)(LG_Renderer * renderer, const LG_RendererCursor cursor,
-      const int width, const int height, const int pitch, const uint8_t * data);
+      const int width, const int height, const int pitch, const uint32_t id,
+      const uint8_t * data);
 
   /* called when the mouse has moved or changed visibillity
    * Context: cursorThread */
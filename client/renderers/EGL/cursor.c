@@ -37,9 +37,12 @@
 #include "cursor_rgb.frag.h"
 #include "cursor_mono.frag.h"
 
+// the number of uploaded shapes kept for reuse
+#define CURSOR_CACHE_SIZE 8
+
 struct CursorTex
 {
-  struct EGL_Texture * texture;
+  struct EGL_Texture * texture; // owned by the current cache entry
   struct EGL_Shader  * shader;
   GLuint uMousePos;
   GLuint uScale;
@@ -57,6 +60,14 @@ struct CursorSize
   float w, h;
 };
 
+struct CursorCache
+{
+  uint32_t             id; // the shape ID, zero if it can not be reused
+  uint64_t             lastUse;
+  struct EGL_Texture * norm;
+  struct EGL_Texture * mono;
+};
+
 struct EGL_Cursor
 {
   LG_Lock           lock;
@@ -64,10 +75,14 @@ struct EGL_Cursor
   int               width;
   int               height;
   int               stride;
+  uint32_t          id;
   uint8_t *         data;
   size_t            dataSize;
   bool              update;
 
+  struct CursorCache cache[CURSOR_CACHE_SIZE];
+  uint64_t           cacheUse;
+
   // cursor state
   bool              visible;
   LG_RendererRotate rotate;
@@ -87,12 +102,6 @@ static bool cursorTexInit(struct CursorTex * t,
     const char * vertex_code  , size_t vertex_size,
     const char * fragment_code, size_t fragment_size)
 {
-  if (!egl_textureInit(&t->texture, NULL, EGL_TEXTYPE_BUFFER))
-  {
-    DEBUG_ERROR("Failed to initialize the cursor texture");
-    return false;
-  }
-
   if (!egl_shaderInit(&t->shader))
   {
     DEBUG_ERROR("Failed to initialize the cursor shader");
@@ -126,10 +135,45 @@ static inline void setCursorTexUniforms(EGL_Cursor * cursor,
 
 static void cursorTexFree(struct CursorTex * t)
 {
-  egl_textureFree(&t->texture);
-  egl_shaderFree (&t->shader );
+  egl_shaderFree(&t->shader);
 };
 
+static struct CursorCache * cursorCacheFind(EGL_Cursor * cursor, uint32_t id)
+{
+  if (!id)
+    return NULL;
+
+  for(int i = 0; i < CURSOR_CACHE_SIZE; ++i)
+    if (cursor->cache[i].id == id)
+      return cursor->cache + i;
+
+  return NULL;
+}
+
+// returns the least recently used entry with its textures initialized
+static struct CursorCache * cursorCacheEvict(EGL_Cursor * cursor)
+{
+  struct CursorCache * entry = cursor->cache;
+  for(int i = 1; i < CURSOR_CACHE_SIZE; ++i)
+    if (cursor->cache[i].lastUse < entry->lastUse)
+      entry = cursor->cache + i;
+
+  entry->id = 0;
+  if (!entry->norm && !egl_textureInit(&entry->norm, NULL, EGL_TEXTYPE_BUFFER))
+  {
+    DEBUG_ERROR("Failed to initialize the cursor texture");
+    return NULL;
+  }
+
+  if (!entry->mono && !egl_textureInit(&entry->mono, NULL, EGL_TEXTYPE_BUFFER))
+  {
+    DEBUG_ERROR("Failed to initialize the cursor texture");
+    return NULL;
+  }
+
+  return entry;
+}
+
 bool egl_cursorInit(EGL_Cursor ** cursor)
 {
   *cursor = malloc(sizeof(**cursor));
@@ -184,6 +228,11 @@ void egl_cursorFree(EGL_Cursor ** cursor)
 
   cursorTexFree(&(*cursor)->norm);
   cursorTexFree(&(*cursor)->mono);
+  for(int i = 0; i < CURSOR_CACHE_SIZE; ++i)
+  {
+    egl_textureFree(&(*cursor)->cache[i].norm);
+    egl_textureFree(&(*cursor)->cache[i].mono);
+  }
   egl_modelFree(&(*cursor)->model);
 
   free(*cursor);
@@ -191,7 +240,8 @@ void egl_cursorFree(EGL_Cursor ** cursor)
 }
 
 bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
-    const int width, const int height, const int stride, const uint8_t * data)
+    const int width, const int height, const int stride, const uint32_t id,
+    const uint8_t * data)
 {
   LG_LOCK(cursor->lock);
 
@@ -199,6 +249,16 @@ bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
   cursor->width  = width;
   cursor->height = (type == LG_CURSOR_MONOCHROME ? height / 2 : height);
   cursor->stride = stride;
+  cursor->id     = id;
+  cursor->update = true;
+
+  // the shape is already uploaded, entries are only evicted by the render
+  // thread while holding the lock for the pending shape
+  if (cursorCacheFind(cursor, id))
+  {
+    LG_UNLOCK(cursor->lock);
+    return true;
+  }
 
   const size_t size = height * stride;
   if (size > cursor->dataSize)
@@ -210,6 +270,9 @@ bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
     if (!cursor->data)
     {
       DEBUG_ERROR("Failed to malloc buffer for cursor shape");
+      cursor->dataSize = 0;
+      cursor->update   = false;
+      LG_UNLOCK(cursor->lock);
       return false;
     }
 
@@ -217,7 +280,6 @@ bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
   }
 
   memcpy(cursor->data, data, size);
-  cursor->update = true;
 
   LG_UNLOCK(cursor->lock);
   return true;
@@ -244,6 +306,74 @@ void egl_cursorSetState(EGL_Cursor * cursor, const bool visible,
   atomic_store(&cursor->hs , hs);
 }
 
+static void cursorUpload(EGL_Cursor * cursor)
+{
+  uint8_t * data = cursor->data;
+
+  switch(cursor->type)
+  {
+    case LG_CURSOR_MASKED_COLOR:
+    {
+      uint32_t xor[cursor->height][cursor->width];
+      for(int y = 0; y < cursor->height; ++y)
+        for(int x = 0; x < cursor->width; ++x)
+        {
+          uint32_t * src = (uint32_t *)(data + (cursor->stride * y) + x * 4);
+          const bool masked = (*src & 0xFF000000) != 0;
+          if (masked)
+            *src = xor[y][x] = *src & 0x00FFFFFF;
+          else
+          {
+            xor[y][x]  = 0xFF000000;
+            *src      |= 0xFF000000;
+          }
+        }
+
+      egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
+          cursor->width, cursor->height, cursor->width, sizeof(xor[0]));
+      egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
+    }
+    // fall through
+
+    case LG_CURSOR_COLOR:
+    {
+      egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
+          cursor->width, cursor->height, cursor->width, cursor->stride);
+      egl_textureUpdate(cursor->norm.texture, data, true);
+      break;
+    }
+
+    case LG_CURSOR_MONOCHROME:
+    {
+      uint32_t and[cursor->height][cursor->width];
+      uint32_t xor[cursor->height][cursor->width];
+
+      for(int y = 0; y < cursor->height; ++y)
+      {
+        for(int x = 0; x < cursor->width; ++x)
+        {
+          const uint8_t  * srcAnd  = data + (cursor->stride * y) + (x / 8);
+          const uint8_t  * srcXor  = srcAnd + cursor->stride * cursor->height;
+          const uint8_t    mask    = 0x80 >> (x % 8);
+          const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
+          const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
+
+          and[y][x] = andMask;
+          xor[y][x] = xorMask;
+        }
+      }
+
+      egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
+          cursor->width, cursor->height, cursor->width, sizeof(and[0]));
+      egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
+          cursor->width, cursor->height, cursor->width, sizeof(xor[0]));
+      egl_textureUpdate(cursor->norm.texture, (uint8_t *)and, true);
+      egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
+      break;
+    }
+  }
+}
+
 struct CursorState egl_cursorRender(EGL_Cursor * cursor,
     LG_RendererRotate rotate, int width, int height)
 {
@@ -255,70 +385,25 @@ struct CursorState egl_cursorRender(EGL_Cursor * cursor,
     LG_LOCK(cursor->lock);
     cursor->update = false;
 
-    uint8_t * data = cursor->data;
+    // reuse the textures of cached shapes instead of uploading them again
+    struct CursorCache * entry = cursorCacheFind(cursor, cursor->id);
+    const bool upload = !entry;
+    if (upload)
+      entry = cursorCacheEvict(cursor);
 
-    switch(cursor->type)
+    if (!entry)
     {
-      case LG_CURSOR_MASKED_COLOR:
-      {
-        uint32_t xor[cursor->height][cursor->width];
-        for(int y = 0; y < cursor->height; ++y)
-          for(int x = 0; x < cursor->width; ++x)
-          {
-            uint32_t * src = (uint32_t *)(data + (cursor->stride * y) + x * 4);
-            const bool masked = (*src & 0xFF000000) != 0;
-            if (masked)
-              *src = xor[y][x] = *src & 0x00FFFFFF;
-            else
-            {
-              xor[y][x]  = 0xFF000000;
-              *src      |= 0xFF000000;
-            }
-          }
-
-        egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, cursor->width, sizeof(xor[0]));
-        egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
-      }
-      // fall through
-
-      case LG_CURSOR_COLOR:
-      {
-        egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, cursor->width, cursor->stride);
-        egl_textureUpdate(cursor->norm.texture, data, true);
-        break;
-      }
-
-      case LG_CURSOR_MONOCHROME:
-      {
-        uint32_t and[cursor->height][cursor->width];
-        uint32_t xor[cursor->height][cursor->width];
+      LG_UNLOCK(cursor->lock);
+      return (struct CursorState) { .visible = false };
+    }
 
-        for(int y = 0; y < cursor->height; ++y)
-        {
-          for(int x = 0; x < cursor->width; ++x)
-          {
-            const uint8_t  * srcAnd  = data + (cursor->stride * y) + (x / 8);
-            const uint8_t  * srcXor  = srcAnd + cursor->stride * cursor->height;
-            const uint8_t    mask    = 0x80 >> (x % 8);
-            const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
-            const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
-
-            and[y][x] = andMask;
-            xor[y][x] = xorMask;
-          }
-        }
+    entry->id            = cursor->id;
+    entry->lastUse       = ++cursor->cacheUse;
+    cursor->norm.texture = entry->norm;
+    cursor->mono.texture = entry->mono;
 
-        egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, cursor->width, sizeof(and[0]));
-        egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, cursor->width, sizeof(xor[0]));
-        egl_textureUpdate(cursor->norm.texture, (uint8_t *)and, true);
-        egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
-        break;
-      }
-    }
+    if (upload)
+      cursorUpload(cursor);
     LG_UNLOCK(cursor->lock);
   }
 
@@ -41,6 +41,7 @@ bool egl_cursorSetShape(
     const int width,
     const int height,
     const int stride,
+    const uint32_t id,
     const uint8_t * data);
 
 void egl_cursorSetSize(EGL_Cursor * cursor, const float x, const float y);
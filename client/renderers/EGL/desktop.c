@@ -23,6 +23,8 @@
 #include "common/option.h"
 #include "common/locking.h"
 #include "common/array.h"
+#include "common/KVMFR.h"
+#include "common/rects.h"
 
 #include "app.h"
 #include "texture.h"
@@ -30,6 +32,7 @@
 #include "desktop_rects.h"
 #include "cimgui.h"
 
+#include <alloca.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -87,7 +90,12 @@ struct EGL_Desktop
   int cbMode;
 
   bool useDMA;
-  LG_RendererFormat format;
+  LG_RendererFormat    format;
+  enum EGL_PixelFormat pixFmt;
+
+  /* frames without a DMA buffer (ie, decompressed) are uploaded to this
+   * texture while DMABUF imports are in use, it is created on first use */
+  EGL_Texture * cpuTexture;
 
   // map HDR content to SDR
   bool  mapHDRtoSDR;
@@ -95,9 +103,20 @@ struct EGL_Desktop
   int   maxCLL;
 
   EGL_PostProcess * pp;
-  _Atomic(bool) processFrame;
+
+  /* set with the damage since the last post-process run and the texture that
+   * holds the frame by the frame thread, all are consumed together by the
+   * render thread. Only the frame thread changes the texture. */
+  LG_Lock              processLock;
+  bool                 processFrame;
+  struct DamageRects * processDamage;
+  EGL_Texture        * processTexture;
 };
 
+/* the damage kept for the post-process, a new set is appended before it is
+ * coalesced so twice this many rects are stored */
+#define MAX_PROCESS_DAMAGE KVMFR_MAX_DAMAGE_RECTS
+
 // forwards
 void toggleNV(int key, void * opaque);
 
@@ -146,12 +165,23 @@ bool egl_desktopInit(EGL * egl, EGL_Desktop ** desktop_, EGLDisplay * display,
   desktop->egl     = egl;
   desktop->display = display;
 
+  LG_LOCK_INIT(desktop->processLock);
+  desktop->processDamage = malloc(sizeof(*desktop->processDamage) +
+      MAX_PROCESS_DAMAGE * 2 * sizeof(*desktop->processDamage->rects));
+  if (!desktop->processDamage)
+  {
+    DEBUG_ERROR("Failed to malloc the post-process damage");
+    return false;
+  }
+  desktop->processDamage->count = -1;
+
   if (!egl_textureInit(&desktop->texture, display,
         useDMA ? EGL_TEXTYPE_DMABUF : EGL_TEXTYPE_FRAMEBUFFER))
   {
     DEBUG_ERROR("Failed to initialize the desktop texture");
     return false;
   }
+  desktop->processTexture = desktop->texture;
 
   if (!egl_desktopRectsInit(&desktop->mesh, maxRects))
   {
@@ -243,6 +273,7 @@ void egl_desktopFree(EGL_Desktop ** desktop)
     return;
 
   egl_textureFree    (&(*desktop)->texture         );
+  egl_textureFree    (&(*desktop)->cpuTexture      );
   egl_textureFree    (&(*desktop)->spiceTexture    );
   egl_shaderFree     (&(*desktop)->shader   .shader);
   egl_shaderFree     (&(*desktop)->dmaShader.shader);
@@ -251,6 +282,7 @@ void egl_desktopFree(EGL_Desktop ** desktop)
 
   egl_postProcessFree(&(*desktop)->pp);
 
+  free((*desktop)->processDamage);
   free(*desktop);
   *desktop = NULL;
 }
@@ -317,10 +349,69 @@ void egl_desktopConfigUI(EGL_Desktop * desktop)
   }
 }
 
+/* request a post-process run over the damaged rects of the frame in
+ * `texture`, NULL rects or a count of zero damages the whole frame. A NULL
+ * texture keeps the current one, changing it damages the whole frame. */
+static void requestProcess(EGL_Desktop * desktop, EGL_Texture * texture,
+    const FrameDamageRect * rects, int count)
+{
+  FrameDamageRect coalesced[count > MAX_PROCESS_DAMAGE ? count : 1];
+  if (rects && count > MAX_PROCESS_DAMAGE)
+  {
+    memcpy(coalesced, rects, count * sizeof(*rects));
+    count = rectsCoalesce(coalesced, count, MAX_PROCESS_DAMAGE);
+    rects = coalesced;
+  }
+
+  INTERLOCKED_SECTION(desktop->processLock,
+  {
+    struct DamageRects * damage = desktop->processDamage;
+    desktop->processFrame = true;
+
+    if (texture && texture != desktop->processTexture)
+    {
+      desktop->processTexture = texture;
+      damage->count = -1;
+    }
+
+    if (!rects || count <= 0)
+      damage->count = -1;
+    else if (damage->count >= 0)
+    {
+      memcpy(damage->rects + damage->count, rects, count * sizeof(*rects));
+      damage->count += count;
+      if (damage->count > MAX_PROCESS_DAMAGE)
+        damage->count = rectsCoalesce(damage->rects, damage->count,
+            MAX_PROCESS_DAMAGE);
+    }
+  });
+}
+
+static bool setupTexture(EGL_Desktop * desktop, EGL_Texture * texture)
+{
+  if (!egl_textureSetup(
+    texture,
+    desktop->pixFmt,
+    desktop->format.dataWidth,
+    desktop->format.dataHeight,
+    desktop->format.stride,
+    desktop->format.pitch
+  ))
+  {
+    DEBUG_ERROR("Failed to setup the desktop texture");
+    return false;
+  }
+
+  return true;
+}
+
 bool egl_desktopSetup(EGL_Desktop * desktop, const LG_RendererFormat format)
 {
   memcpy(&desktop->format, &format, sizeof(LG_RendererFormat));
 
+  // nothing from the previous format can be reused
+  requestProcess(desktop, NULL, NULL, 0);
+
   enum EGL_PixelFormat pixFmt;
   switch(format.type)
   {
@@ -357,31 +448,73 @@ bool egl_desktopSetup(EGL_Desktop * desktop, const LG_RendererFormat format)
   desktop->height = format.frameHeight;
   desktop->hdr    = format.hdr;
   desktop->hdrPQ  = format.hdrPQ;
+  desktop->pixFmt = pixFmt;
 
-  if (!egl_textureSetup(
-    desktop->texture,
-    pixFmt,
-    desktop->format.dataWidth,
-    desktop->format.dataHeight,
-    desktop->format.stride,
-    desktop->format.pitch
-  ))
+  if (!setupTexture(desktop, desktop->texture))
+    return false;
+
+  if (desktop->cpuTexture && !setupTexture(desktop, desktop->cpuTexture))
+    return false;
+
+  return true;
+}
+
+// creates a texture the frames can be uploaded to by the CPU
+static bool initFrameTexture(EGL_Desktop * desktop, EGL_Texture ** texture)
+{
+  const char * gl_exts = (const char *)glGetString(GL_EXTENSIONS);
+  if (!util_hasGLExt(gl_exts, "GL_EXT_buffer_storage"))
   {
-    DEBUG_ERROR("Failed to setup the desktop texture");
+    DEBUG_ERROR("GL_EXT_buffer_storage is needed to use EGL backend");
+    return false;
+  }
+
+  if (!egl_textureInit(texture, desktop->display, EGL_TEXTYPE_FRAMEBUFFER))
+  {
+    DEBUG_ERROR("Failed to initialize the desktop texture");
     return false;
   }
 
+  return setupTexture(desktop, *texture);
+}
+
+static bool updateFromFrame(EGL_Desktop * desktop, EGL_Texture * texture,
+    const FrameBuffer * frame,
+    const FrameDamageRect * damageRects, int damageRectsCount)
+{
+  // the texture is stale if it did not hold the last frame
+  if (texture != desktop->processTexture)
+    damageRectsCount = 0;
+
+  if (unlikely(!egl_textureUpdateFromFrame(texture, frame,
+        damageRects, damageRectsCount)))
+    return false;
+
+  requestProcess(desktop, texture, damageRects, damageRectsCount);
   return true;
 }
 
 bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
     const FrameDamageRect * damageRects, int damageRectsCount)
 {
-  if (likely(desktop->useDMA && dmaFd >= 0))
+  if (likely(desktop->useDMA))
   {
+    /* frames that are not in shared memory (ie, decompressed) have no DMABUF,
+     * only these are uploaded by the CPU so imports resume with the next
+     * frame that has one */
+    if (unlikely(dmaFd < 0))
+    {
+      if (!desktop->cpuTexture &&
+          !initFrameTexture(desktop, &desktop->cpuTexture))
+        return false;
+
+      return updateFromFrame(desktop, desktop->cpuTexture, frame,
+          damageRects, damageRectsCount);
+    }
+
     if (likely(egl_textureUpdateFromDMA(desktop->texture, frame, dmaFd)))
     {
-      atomic_store(&desktop->processFrame, true);
+      requestProcess(desktop, desktop->texture, damageRects, damageRectsCount);
       return true;
     }
 
@@ -396,38 +529,28 @@ bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dma
 
     desktop->useDMA = false;
 
-    const char * gl_exts = (const char *)glGetString(GL_EXTENSIONS);
-    if (!util_hasGLExt(gl_exts, "GL_EXT_buffer_storage"))
-    {
-      DEBUG_ERROR("GL_EXT_buffer_storage is needed to use EGL backend");
-      return false;
-    }
-
     egl_textureFree(&desktop->texture);
-    if (!egl_textureInit(&desktop->texture, desktop->display,
-          EGL_TEXTYPE_FRAMEBUFFER))
+    if (desktop->cpuTexture)
     {
-      DEBUG_ERROR("Failed to initialize the desktop texture");
-      return false;
+      desktop->texture    = desktop->cpuTexture;
+      desktop->cpuTexture = NULL;
     }
-
-    if (!egl_desktopSetup(desktop, desktop->format))
+    else if (!initFrameTexture(desktop, &desktop->texture))
       return false;
   }
 
-  if (likely(egl_textureUpdateFromFrame(desktop->texture, frame,
-        damageRects, damageRectsCount)))
-  {
-    atomic_store(&desktop->processFrame, true);
-    return true;
-  }
-
-  return false;
+  return updateFromFrame(desktop, desktop->texture, frame,
+      damageRects, damageRectsCount);
 }
 
 void egl_desktopResize(EGL_Desktop * desktop, int width, int height)
 {
-  atomic_store(&desktop->processFrame, true);
+  requestProcess(desktop, NULL, NULL, 0);
+}
+
+unsigned int egl_desktopDamageGrowth(EGL_Desktop * desktop)
+{
+  return egl_postProcessDamageGrowth(desktop->pp);
 }
 
 bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
@@ -435,6 +558,25 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
     const float scaleX, const float scaleY, enum EGL_DesktopScaleType scaleType,
     LG_RendererRotate rotate, const struct DamageRects * rects)
 {
+  /* take the damage and texture with the flag, a frame that arrives after
+   * this is seen by the next render along with its damage */
+  struct DamageRects * damage = alloca(sizeof(*damage) +
+      MAX_PROCESS_DAMAGE * sizeof(*damage->rects));
+  EGL_Texture * frameTex;
+  bool process;
+  INTERLOCKED_SECTION(desktop->processLock,
+  {
+    process  = desktop->processFrame;
+    frameTex = desktop->processTexture;
+    desktop->processFrame = false;
+
+    damage->count = desktop->processDamage->count;
+    if (damage->count > 0)
+      memcpy(damage->rects, desktop->processDamage->rects,
+          damage->count * sizeof(*damage->rects));
+    desktop->processDamage->count = 0;
+  });
+
   EGL_Texture * tex;
   int width, height;
   bool dma;
@@ -448,10 +590,10 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
   }
   else
   {
-    tex    = desktop->texture;
+    tex    = frameTex;
     width  = desktop->width;
     height = desktop->height;
-    dma    = desktop->useDMA;
+    dma    = desktop->useDMA && tex == desktop->texture;
   }
 
   if (unlikely(outputWidth == 0 && outputHeight == 0))
@@ -470,9 +612,8 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
       width, height, x, y, scaleX, scaleY, rotate);
   egl_desktopRectsUpdate(desktop->mesh, rects, width, height);
 
-  if (atomic_exchange(&desktop->processFrame, false) ||
-      egl_postProcessConfigModified(desktop->pp))
-    egl_postProcessRun(desktop->pp, tex, desktop->mesh,
+  if (process || egl_postProcessConfigModified(desktop->pp))
+    egl_postProcessRun(desktop->pp, tex, damage,
         width, height, outputWidth, outputHeight, dma);
 
   unsigned int finalSizeX, finalSizeY;
@@ -613,7 +754,7 @@ void egl_desktopSpiceDrawFill(EGL_Desktop * desktop, int x, int y, int width,
     egl_textureUpdateRect(desktop->spiceTexture,
         x, y + dy, width, 1, width, sizeof(line), (uint8_t *)line, false);
 
-  atomic_store(&desktop->processFrame, true);
+  requestProcess(desktop, NULL, NULL, 0);
 }
 
 void egl_desktopSpiceDrawBitmap(EGL_Desktop * desktop, int x, int y, int width,
@@ -621,11 +762,11 @@ void egl_desktopSpiceDrawBitmap(EGL_Desktop * desktop, int x, int y, int width,
 {
   egl_textureUpdateRect(desktop->spiceTexture,
       x, y, width, height, width, stride, data, topDown);
-  atomic_store(&desktop->processFrame, true);
+  requestProcess(desktop, NULL, NULL, 0);
 }
 
 void egl_desktopSpiceShow(EGL_Desktop * desktop, bool show)
 {
   desktop->useSpice = show;
-  atomic_store(&desktop->processFrame, true);
+  requestProcess(desktop, NULL, NULL, 0);
 }
@@ -46,6 +46,10 @@ bool egl_desktopSetup (EGL_Desktop * desktop, const LG_RendererFormat format);
 bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
     const FrameDamageRect * damageRects, int damageRectsCount);
 void egl_desktopResize(EGL_Desktop * desktop, int width, int height);
+/* returns how far the post-processing filters spread the damage in desktop
+ * pixels */
+unsigned int egl_desktopDamageGrowth(EGL_Desktop * desktop);
+
 bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
     unsigned int outputHeight, const float x, const float y,
     const float scaleX, const float scaleY, enum EGL_DesktopScaleType scaleType,
@@ -28,6 +28,8 @@
 #include "common/rects.h"
 #include "common/time.h"
 #include "common/locking.h"
+#include "common/paths.h"
+#include "common/stringutils.h"
 #include "app.h"
 #include "util.h"
 
@@ -224,6 +226,13 @@ static struct Option egl_options[] =
     .type         = OPTION_TYPE_INT,
     .value.x_int  = 10000,
   },
+  {
+    .module       = "egl",
+    .name         = "shaderCache",
+    .description  = "Cache the compiled shaders on disk to speed up startup",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
 
   {0}
 };
@@ -302,6 +311,7 @@ static void egl_deinitialize(LG_Renderer * renderer)
   egl_desktopFree(&this->desktop);
   egl_cursorFree (&this->cursor);
   egl_damageFree (&this->damage);
+  egl_shaderCacheFree();
 
   LG_LOCK_FREE(this->lock);
   LG_LOCK_FREE(this->desktopDamageLock);
@@ -544,11 +554,11 @@ static void egl_onResize(LG_Renderer * renderer, const int width, const int heig
 
 static bool egl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
     const int width, const int height,
-    const int pitch, const uint8_t * data)
+    const int pitch, const uint32_t id, const uint8_t * data)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
-  if (!egl_cursorSetShape(this->cursor, cursor, width, height, pitch, data))
+  if (!egl_cursorSetShape(this->cursor, cursor, width, height, pitch, id, data))
   {
     DEBUG_ERROR("Failed to update the cursor shape");
     return false;
@@ -632,6 +642,17 @@ static bool egl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int d
   }
   ringbuffer_push(this->importTimings, &(float){ (nanotime() - start) * 1e-6f });
 
+  /* large damage sets from the extended damage record are reduced to a few
+   * larger rects for rendering, this is still cheaper than a full redraw */
+  FrameDamageRect coalesced[max(damageRectsCount, 1)];
+  if (unlikely(damageRectsCount > KVMFR_MAX_DAMAGE_RECTS / 2))
+  {
+    memcpy(coalesced, damageRects, damageRectsCount * sizeof(*damageRects));
+    damageRectsCount = rectsCoalesce(coalesced, damageRectsCount,
+        KVMFR_MAX_DAMAGE_RECTS / 2);
+    damageRects = coalesced;
+  }
+
   INTERLOCKED_SECTION(this->desktopDamageLock, {
     struct DesktopDamage * damage = this->desktopDamage + this->desktopDamageIdx;
     if (unlikely(
@@ -959,6 +980,21 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
 
   eglSwapInterval(this->display, this->opt.vsync ? 1 : 0);
 
+  if (option_get_bool("egl", "shaderCache"))
+  {
+    char * dir, * driver;
+    alloc_sprintf(&dir, "%s/shadercache", lgConfigDir());
+    alloc_sprintf(&driver, "%s\n%s\n%s", vendor,
+        (const char *)glGetString(GL_RENDERER),
+        (const char *)glGetString(GL_VERSION ));
+
+    if (dir && driver)
+      egl_shaderCacheInit(dir, driver);
+
+    free(dir);
+    free(driver);
+  }
+
   if (!egl_desktopInit(this, &this->desktop, this->display, useDMA, MAX_ACCUMULATED_DAMAGE))
   {
     DEBUG_ERROR("Failed to initialize the desktop");
@@ -1062,6 +1098,11 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
   );
   accumulated->count = 0;
 
+  /* the post-processing filters change the output beyond the damage by the
+   * size of their kernels */
+  const int growth = egl_desktopDamageGrowth(this->desktop);
+  const int grow   = 1 + growth;
+
   INTERLOCKED_SECTION(this->desktopDamageLock, {
     if (likely(!renderAll))
     {
@@ -1079,12 +1120,14 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
         for (int j = 0; j < damage->count; ++j)
         {
           struct FrameDamageRect * rect = damage->rects + j;
-          int x = rect->x > 0 ? rect->x - 1 : 0;
-          int y = rect->y > 0 ? rect->y - 1 : 0;
+          int x = max((int)rect->x - grow, 0);
+          int y = max((int)rect->y - grow, 0);
           accumulated->rects[accumulated->count++] = (struct FrameDamageRect) {
             .x = x, .y = y,
-            .width  = min(this->format.frameWidth  - x, rect->width  + 2),
-            .height = min(this->format.frameHeight - y, rect->height + 2),
+            .width  = min((int)this->format.frameWidth  - x,
+                (int)(rect->x + rect->width ) + grow - x),
+            .height = min((int)this->format.frameHeight - y,
+                (int)(rect->y + rect->height) + grow - y),
           };
         }
       }
@@ -1193,7 +1236,21 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
           this->width, this->height);
 
       for (int i = 0; i < desktopDamage->count; ++i)
-        damage[damageIdx++] = egl_desktopToScreen(matrix, desktopDamage->rects + i);
+      {
+        struct FrameDamageRect rect = desktopDamage->rects[i];
+        if (growth > 0)
+        {
+          int x = max((int)rect.x - growth, 0);
+          int y = max((int)rect.y - growth, 0);
+          rect.width  = min((int)this->format.frameWidth  - x,
+              (int)(rect.x + rect.width ) + growth - x);
+          rect.height = min((int)this->format.frameHeight - y,
+              (int)(rect.y + rect.height) + growth - y);
+          rect.x = x;
+          rect.y = y;
+        }
+        damage[damageIdx++] = egl_desktopToScreen(matrix, &rect);
+      }
     }
   }
   else
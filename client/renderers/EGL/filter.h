@@ -88,6 +88,12 @@ typedef struct EGL_FilterOps
    * A filter can return false to bypass it */
   bool (*prepare)(EGL_Filter * filter);
 
+  /* returns how far a change in the input can spread in the output, as the
+   * kernel radius in input pixels and in output pixels for a second pass.
+   * this is optional, filters that don't provide it are always fully redrawn */
+  void (*getFootprint)(EGL_Filter * filter,
+      unsigned int * input, unsigned int * output);
+
   /* runs the filter on the provided texture
    * returns the processed texture as the output */
   EGL_Texture * (*run)(EGL_Filter * filter, EGL_FilterRects * rects,
@@ -102,6 +108,16 @@ EGL_FilterOps;
 typedef struct EGL_Filter
 {
   EGL_FilterOps ops;
+
+  /* the output of the last run, kept by the post processor so that only the
+   * damaged regions need to be redrawn while the output is still intact */
+  struct
+  {
+    unsigned int  run;
+    EGL_Texture * output;
+    unsigned int  generation;
+  }
+  last;
 }
 EGL_Filter;
 
@@ -172,6 +188,16 @@ static inline bool egl_filterPrepare(EGL_Filter * filter)
   return filter->ops.prepare(filter);
 }
 
+static inline bool egl_filterGetFootprint(EGL_Filter * filter,
+    unsigned int * input, unsigned int * output)
+{
+  if (!filter->ops.getFootprint)
+    return false;
+
+  filter->ops.getFootprint(filter, input, output);
+  return true;
+}
+
 static inline EGL_Texture * egl_filterRun(EGL_Filter * filter,
     EGL_FilterRects * rects, EGL_Texture * texture)
 {
@@ -181,7 +207,10 @@ static inline EGL_Texture * egl_filterRun(EGL_Filter * filter,
 static inline void egl_filterRelease(EGL_Filter * filter)
 {
   if (filter->ops.release)
+  {
     filter->ops.release(filter);
+    filter->last.output = NULL;
+  }
 }
 
 void egl_filterRectsRender(EGL_Shader * shader, EGL_FilterRects * rects);
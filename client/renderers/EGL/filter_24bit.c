@@ -185,6 +185,14 @@ static bool egl_filter24bitPrepare(EGL_Filter * filter)
   return true;
 }
 
+static void egl_filter24bitGetFootprint(EGL_Filter * filter,
+    unsigned int * input, unsigned int * output)
+{
+  // each output pixel is spread over two input texels
+  *input  = 1;
+  *output = 0;
+}
+
 static EGL_Texture * egl_filter24bitRun(EGL_Filter * filter,
     EGL_FilterRects * rects, EGL_Texture * texture)
 {
@@ -217,5 +225,6 @@ EGL_FilterOps egl_filter24bitOps =
   .setup        = egl_filter24bitSetup,
   .getOutputRes = egl_filter24bitGetOutputRes,
   .prepare      = egl_filter24bitPrepare,
+  .getFootprint = egl_filter24bitGetFootprint,
   .run          = egl_filter24bitRun
 };
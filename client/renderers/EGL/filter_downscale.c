@@ -402,6 +402,31 @@ static bool egl_filterDownscalePrepare(EGL_Filter * filter)
   return true;
 }
 
+static void egl_filterDownscaleGetFootprint(EGL_Filter * filter,
+    unsigned int * input, unsigned int * output)
+{
+  EGL_FilterDownscale * this = UPCAST(EGL_FilterDownscale, filter);
+
+  switch (this->filter)
+  {
+    case DOWNSCALE_NEAREST:
+      *input = 0;
+      break;
+
+    case DOWNSCALE_LINEAR:
+      *input = 1;
+      break;
+
+    case DOWNSCALE_LANCZOS2:
+      *input = 2;
+      break;
+
+    default:
+      DEBUG_UNREACHABLE();
+  }
+  *output = 0;
+}
+
 static EGL_Texture * egl_filterDownscaleRun(EGL_Filter * filter,
     EGL_FilterRects * rects, EGL_Texture * texture)
 {
@@ -455,5 +480,6 @@ EGL_FilterOps egl_filterDownscaleOps =
   .setup        = egl_filterDownscaleSetup,
   .getOutputRes = egl_filterDownscaleGetOutputRes,
   .prepare      = egl_filterDownscalePrepare,
+  .getFootprint = egl_filterDownscaleGetFootprint,
   .run          = egl_filterDownscaleRun
 };
@@ -274,6 +274,14 @@ static bool egl_filterFFXCASPrepare(EGL_Filter * filter)
   return true;
 }
 
+static void egl_filterFFXCASGetFootprint(EGL_Filter * filter,
+    unsigned int * input, unsigned int * output)
+{
+  // 3x3 neighbourhood
+  *input  = 1;
+  *output = 0;
+}
+
 static EGL_Texture * egl_filterFFXCASRun(EGL_Filter * filter,
     EGL_FilterRects * rects, EGL_Texture * texture)
 {
@@ -305,5 +313,6 @@ EGL_FilterOps egl_filterFFXCASOps =
   .setup        = egl_filterFFXCASSetup,
   .getOutputRes = egl_filterFFXCASGetOutputRes,
   .prepare      = egl_filterFFXCASPrepare,
+  .getFootprint = egl_filterFFXCASGetFootprint,
   .run          = egl_filterFFXCASRun
 };
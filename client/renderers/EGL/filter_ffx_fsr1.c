@@ -408,6 +408,14 @@ static bool egl_filterFFXFSR1Prepare(EGL_Filter * filter)
   return true;
 }
 
+static void egl_filterFFXFSR1GetFootprint(EGL_Filter * filter,
+    unsigned int * input, unsigned int * output)
+{
+  // the 12 tap EASU kernel, followed by the 3x3 RCAS pass on its output
+  *input  = 2;
+  *output = 1;
+}
+
 static EGL_Texture * egl_filterFFXFSR1Run(EGL_Filter * filter,
     EGL_FilterRects * rects, EGL_Texture * texture)
 {
@@ -449,5 +457,6 @@ EGL_FilterOps egl_filterFFXFSR1Ops =
   .setOutputResHint = egl_filterFFXFSR1SetOutputResHint,
   .getOutputRes     = egl_filterFFXFSR1GetOutputRes,
   .prepare          = egl_filterFFXFSR1Prepare,
+  .getFootprint     = egl_filterFFXFSR1GetFootprint,
   .run              = egl_filterFFXFSR1Run
 };
@@ -24,21 +24,28 @@
 #include "app.h"
 #include "cimgui.h"
 
+#include <alloca.h>
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <unistd.h>
 #include <stdatomic.h>
 #include <sys/stat.h>
 
 #include "common/debug.h"
 #include "common/array.h"
+#include "common/KVMFR.h"
 #include "common/option.h"
 #include "common/paths.h"
 #include "common/stringlist.h"
 #include "common/stringutils.h"
+#include "common/rects.h"
 #include "common/vector.h"
 
+// the damage is reduced to this many rects before it is drawn
+#define MAX_DAMAGE_RECTS KVMFR_MAX_DAMAGE_RECTS
+
 static const EGL_FilterOps * EGL_Filters[] =
 {
   &egl_filterDownscaleOps,
@@ -54,6 +61,8 @@ struct EGL_PostProcess
   _Atomic(bool) modified;
 
   EGL_DesktopRects * rects;
+  unsigned int       runCount;
+  unsigned int       damageGrowth;
 
   StringList presets;
   char * presetDir;
@@ -562,7 +571,7 @@ bool egl_postProcessInit(EGL_PostProcess ** pp)
     goto error_filters;
   }
 
-  if (!egl_desktopRectsInit(&this->rects, 1))
+  if (!egl_desktopRectsInit(&this->rects, MAX_DAMAGE_RECTS))
   {
     DEBUG_ERROR("Failed to initialize the desktop rects");
     goto error_internal;
@@ -630,8 +639,31 @@ bool egl_postProcessConfigModified(EGL_PostProcess * this)
   return atomic_load(&this->modified);
 }
 
+static void growDamage(struct DamageRects * damage, int growX, int growY,
+    int width, int height)
+{
+  for (int i = 0; i < damage->count; ++i)
+  {
+    FrameDamageRect * rect = damage->rects + i;
+    const int x1 = max((int)rect->x - growX, 0);
+    const int y1 = max((int)rect->y - growY, 0);
+    const int x2 = min((int)(rect->x + rect->width ) + growX, width );
+    const int y2 = min((int)(rect->y + rect->height) + growY, height);
+
+    rect->x      = x1;
+    rect->y      = y1;
+    rect->width  = x2 - x1;
+    rect->height = y2 - y1;
+  }
+
+  damage->count = rectsMergeOverlapping(damage->rects, damage->count);
+  if (damage->count > MAX_DAMAGE_RECTS)
+    damage->count = rectsCoalesce(damage->rects, damage->count,
+        MAX_DAMAGE_RECTS);
+}
+
 bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
-    EGL_DesktopRects * rects, int desktopWidth, int desktopHeight,
+    const struct DamageRects * damage, int desktopWidth, int desktopHeight,
     unsigned int targetX, unsigned int targetY, bool useDMA)
 {
   if (targetX == 0 && targetY == 0)
@@ -647,18 +679,32 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
         &sizeX, &sizeY, &pixFmt) != EGL_TEX_STATUS_OK)
     return false;
 
-  if (atomic_exchange(&this->modified, false))
+  /* the damage grows as it passes through each filter, a count of -1 means
+   * everything from this filter on needs to be redrawn */
+  const int maxRects = damage && damage->count > MAX_DAMAGE_RECTS ?
+    damage->count : MAX_DAMAGE_RECTS;
+  struct DamageRects * rects = alloca(
+      sizeof(*rects) + maxRects * sizeof(*rects->rects));
+
+  // a configuration change invalidates the output of every filter
+  if (atomic_exchange(&this->modified, false) || !damage || damage->count < 0)
+    rects->count = -1;
+  else
   {
-    rects = this->rects;
-    egl_desktopRectsUpdate(rects, NULL, desktopWidth, desktopHeight);
+    rects->count = damage->count;
+    memcpy(rects->rects, damage->rects, damage->count * sizeof(*rects->rects));
+    growDamage(rects, 0, 0, desktopWidth, desktopHeight);
   }
 
+  ++this->runCount;
+  this->damageGrowth = 0;
+
   GLfloat matrix[6];
   egl_desktopRectsMatrix(matrix, desktopWidth, desktopHeight, 0.0f, 0.0f,
       1.0f, 1.0f, LG_ROTATE_0);
 
   EGL_FilterRects filterRects = {
-    .rects  = rects,
+    .rects  = this->rects,
     .matrix = matrix,
     .width  = desktopWidth,
     .height = desktopHeight,
@@ -684,8 +730,42 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
           !egl_filterPrepare(filter))
         continue;
 
+      unsigned int outX, outY;
+      egl_filterGetOutputRes(filter, &outX, &outY, &pixFmt);
+
+      /* the previous output can only be partially redrawn if the filter ran
+       * last time and its framebuffer has not been set up again since */
+      unsigned int input, output;
+      const EGL_Texture * last = filter->last.output;
+      if (filter->last.run != this->runCount - 1 || !last ||
+          last->generation != filter->last.generation ||
+          !egl_filterGetFootprint(filter, &input, &output))
+        rects->count = -1;
+      else
+      {
+        // convert the kernel footprint to desktop pixels
+        const int growX = ceilf(
+            (input  + 0.5f) * desktopWidth  / sizeX +
+            (output + 0.5f) * desktopWidth  / outX);
+        const int growY = ceilf(
+            (input  + 0.5f) * desktopHeight / sizeY +
+            (output + 0.5f) * desktopHeight / outY);
+        this->damageGrowth += max(growX, growY);
+
+        if (rects->count > 0)
+          growDamage(rects, growX, growY, desktopWidth, desktopHeight);
+      }
+
+      egl_desktopRectsUpdate(this->rects, rects->count < 0 ? NULL : rects,
+          desktopWidth, desktopHeight);
+
       texture = egl_filterRun(filter, &filterRects, texture);
-      egl_filterGetOutputRes(filter, &sizeX, &sizeY, &pixFmt);
+      sizeX   = outX;
+      sizeY   = outY;
+
+      filter->last.run        = this->runCount;
+      filter->last.output     = texture;
+      filter->last.generation = texture->generation;
 
       if (lastFilter)
         egl_filterRelease(lastFilter);
@@ -702,6 +782,11 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
   return true;
 }
 
+unsigned int egl_postProcessDamageGrowth(EGL_PostProcess * this)
+{
+  return this->damageGrowth;
+}
+
 EGL_Texture * egl_postProcessGetOutput(EGL_PostProcess * this,
     unsigned int * outputX, unsigned int * outputY)
 {
@@ -37,11 +37,16 @@ bool egl_postProcessAdd(EGL_PostProcess * this, const EGL_FilterOps * ops);
 /* returns true if the configuration was modified since the last run */
 bool egl_postProcessConfigModified(EGL_PostProcess * this);
 
-/* apply the filters to the supplied texture
+/* apply the filters to the damaged regions of the supplied texture, NULL
+ * damage processes the whole texture.
  * targetX/Y is the final target output dimension hint if scalers are present */
 bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
-    EGL_DesktopRects * rects, int desktopWidth, int desktopHeight,
+    const struct DamageRects * damage, int desktopWidth, int desktopHeight,
     unsigned int targetX, unsigned int targetY, bool useDMA);
 
+/* returns how many desktop pixels the damage grew by in the last run, the
+ * output changes this far beyond the input damage */
+unsigned int egl_postProcessDamageGrowth(EGL_PostProcess * this);
+
 EGL_Texture * egl_postProcessGetOutput(EGL_PostProcess * this,
     unsigned int * outputX, unsigned int * outputY);
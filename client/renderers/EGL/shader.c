@@ -26,6 +26,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "LGSC"
+
+struct CacheHeader
+{
+  char     magic[4];
+  uint32_t format;
+  uint64_t key;
+};
+
+static struct
+{
+  bool     enabled;
+  char   * dir;
+  uint64_t seed;
+}
+cache = { 0 };
 
 struct EGL_Shader
 {
@@ -37,6 +59,179 @@ struct EGL_Shader
   int           uniformUsed;
 };
 
+// 64-bit FNV-1a
+static uint64_t hashData(uint64_t hash, const void * data, size_t size)
+{
+  const uint8_t * p = data;
+  for(size_t i = 0; i < size; ++i)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool egl_shaderCacheInit(const char * dir, const char * driver)
+{
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats < 1)
+  {
+    DEBUG_INFO("Program binaries are not supported, shader cache disabled");
+    return false;
+  }
+
+  if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST)
+  {
+    DEBUG_ERROR("Failed to create the shader cache directory: %s", dir);
+    return false;
+  }
+
+  cache.dir = strdup(dir);
+  if (!cache.dir)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  cache.seed    = hashData(0xcbf29ce484222325ULL, driver, strlen(driver));
+  cache.enabled = true;
+  DEBUG_INFO("Shader cache: %s", dir);
+  return true;
+}
+
+void egl_shaderCacheFree(void)
+{
+  free(cache.dir);
+  cache.dir     = NULL;
+  cache.enabled = false;
+}
+
+static uint64_t cacheKey(const char * vertex_code, size_t vertex_size,
+    const char * fragment_code, size_t fragment_size)
+{
+  uint64_t key = hashData(cache.seed, vertex_code, vertex_size);
+  key = hashData(key, &vertex_size, sizeof(vertex_size));
+  return hashData(key, fragment_code, fragment_size);
+}
+
+static char * cachePath(uint64_t key)
+{
+  char * path;
+  if (alloc_sprintf(&path, "%s/%016" PRIx64 ".bin", cache.dir, key) < 0)
+    return NULL;
+  return path;
+}
+
+static bool cacheLoad(EGL_Shader * this, uint64_t key)
+{
+  char * path = cachePath(key);
+  if (!path)
+    return false;
+
+  bool    ret  = false;
+  uint8_t * data = NULL;
+  FILE * fp = fopen(path, "rb");
+  if (!fp)
+    goto exit;
+
+  struct CacheHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.key != key)
+    goto invalid;
+
+  if (fseek(fp, 0, SEEK_END) != 0)
+    goto invalid;
+
+  const long size = ftell(fp) - (long)sizeof(header);
+  if (size <= 0 || fseek(fp, sizeof(header), SEEK_SET) != 0)
+    goto invalid;
+
+  data = malloc(size);
+  if (!data)
+  {
+    DEBUG_ERROR("out of memory");
+    goto exit;
+  }
+
+  if (fread(data, size, 1, fp) != 1)
+    goto invalid;
+
+  this->shader = glCreateProgram();
+  glProgramBinary(this->shader, header.format, data, size);
+
+  GLint result = GL_FALSE;
+  glGetProgramiv(this->shader, GL_LINK_STATUS, &result);
+  if (result == GL_FALSE)
+  {
+    // the driver rejected the binary, it will be rebuilt from source
+    glDeleteProgram(this->shader);
+    goto invalid;
+  }
+
+  this->hasShader = true;
+  ret = true;
+  goto exit;
+
+invalid:
+  unlink(path);
+
+exit:
+  if (fp)
+    fclose(fp);
+  free(data);
+  free(path);
+  return ret;
+}
+
+static void cacheStore(EGL_Shader * this, uint64_t key)
+{
+  GLint length = 0;
+  glGetProgramiv(this->shader, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  char    * path = cachePath(key);
+  char    * tmp  = NULL;
+  uint8_t * data = malloc(length);
+  FILE    * fp   = NULL;
+  if (!path || !data || alloc_sprintf(&tmp, "%s.tmp", path) < 0)
+  {
+    DEBUG_ERROR("out of memory");
+    goto exit;
+  }
+
+  struct CacheHeader header = { .magic = CACHE_MAGIC, .key = key };
+  GLenum format;
+  glGetProgramBinary(this->shader, length, &length, &format, data);
+  header.format = format;
+
+  // write to a temporary file so a partial binary is never loaded
+  fp = fopen(tmp, "wb");
+  if (!fp)
+  {
+    DEBUG_WARN("Failed to create %s", tmp);
+    goto exit;
+  }
+
+  const bool ok =
+    fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(data, length, 1, fp) == 1;
+
+  fclose(fp);
+  if (!ok || rename(tmp, path) != 0)
+  {
+    DEBUG_WARN("Failed to write %s", path);
+    unlink(tmp);
+  }
+
+exit:
+  free(tmp);
+  free(data);
+  free(path);
+}
+
 bool egl_shaderInit(EGL_Shader ** this)
 {
   *this = calloc(1, sizeof(EGL_Shader));
@@ -107,6 +302,14 @@ static bool shaderCompile(EGL_Shader * this, const char * vertex_code,
     this->hasShader = false;
   }
 
+  uint64_t key = 0;
+  if (cache.enabled)
+  {
+    key = cacheKey(vertex_code, vertex_size, fragment_code, fragment_size);
+    if (cacheLoad(this, key))
+      return true;
+  }
+
   GLint  length;
   GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
 
@@ -175,6 +378,9 @@ static bool shaderCompile(EGL_Shader * this, const char * vertex_code,
   this->shader = glCreateProgram();
   glAttachShader(this->shader, vertexShader  );
   glAttachShader(this->shader, fragmentShader);
+  if (cache.enabled)
+    glProgramParameteri(this->shader, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+        GL_TRUE);
   glLinkProgram(this->shader);
 
   glGetProgramiv(this->shader, GL_LINK_STATUS, &result);
@@ -206,6 +412,9 @@ static bool shaderCompile(EGL_Shader * this, const char * vertex_code,
   glDeleteShader(fragmentShader);
   glDeleteShader(vertexShader  );
 
+  if (cache.enabled)
+    cacheStore(this, key);
+
   this->hasShader = true;
   return true;
 }
@@ -100,6 +100,14 @@ typedef struct EGL_ShaderDefine
 }
 EGL_ShaderDefine;
 
+/**
+ * Enable the on disk program binary cache in `dir`. `driver` identifies the
+ * GL implementation so that binaries are only ever loaded by the driver that
+ * created them.
+ */
+bool egl_shaderCacheInit(const char * dir, const char * driver);
+void egl_shaderCacheFree(void);
+
 bool egl_shaderInit(EGL_Shader ** shader);
 void egl_shaderFree(EGL_Shader ** shader);
 
@@ -108,6 +108,7 @@ bool egl_textureSetup(EGL_Texture * this, enum EGL_PixelFormat pixFmt,
   if (!egl_texUtilGetFormat(&setup, &this->format))
     return false;
 
+  ++this->generation;
   return this->ops.setup(this, &setup);
 }
 
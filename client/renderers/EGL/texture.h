@@ -107,6 +107,9 @@ struct EGL_Texture
   GLuint sampler;
 
   EGL_TexFormat format;
+
+  // incremented each time the texture storage is set up, discarding the content
+  unsigned int generation;
 };
 
 bool egl_textureInit(EGL_Texture ** texture, EGLDisplay * display,
@@ -21,8 +21,15 @@
 #include "texture_buffer.h"
 
 #include "egldebug.h"
+#include "common/rects.h"
+#include "common/util.h"
 
 #include <string.h>
+#include <inttypes.h>
+
+// above this percentage of the texture a single full upload is cheaper than
+// many small ones
+#define PARTIAL_UPLOAD_MAX_COVERAGE 50
 
 // forwards
 extern const EGL_TextureOps EGL_TextureBuffer;
@@ -44,6 +51,35 @@ static void egl_texBuffer_cleanup(TextureBuffer * this)
   }
 }
 
+void egl_texBufferAddDamage(struct TexDamage * damage,
+    const FrameDamageRect * rects, int count)
+{
+  if (damage->count < 0)
+    return;
+
+  if (!rects || count == 0)
+  {
+    damage->count = -1;
+    return;
+  }
+
+  if (damage->count + count <= KVMFR_MAX_DAMAGE_RECTS)
+  {
+    memcpy(damage->rects + damage->count, rects,
+      count * sizeof(FrameDamageRect));
+    damage->count += count;
+    return;
+  }
+
+  // too many rects to track, reduce them to fewer larger rects
+  FrameDamageRect merged[damage->count + count];
+  memcpy(merged, damage->rects, damage->count * sizeof(FrameDamageRect));
+  memcpy(merged + damage->count, rects, count * sizeof(FrameDamageRect));
+  damage->count = rectsCoalesce(merged, damage->count + count,
+      KVMFR_MAX_DAMAGE_RECTS);
+  memcpy(damage->rects, merged, damage->count * sizeof(FrameDamageRect));
+}
+
 // common functions
 
 bool egl_texBufferInit(EGL_Texture ** texture, EGL_TexType type,
@@ -72,6 +108,13 @@ void egl_texBufferFree(EGL_Texture * texture)
 {
   TextureBuffer * this = UPCAST(TextureBuffer, texture);
 
+  if (this->stats.uploads)
+    DEBUG_INFO("Texture uploads: %" PRIu64 " (%" PRIu64 " partial), "
+        "%.2f MiB of %.2f MiB",
+        this->stats.uploads, this->stats.partialUploads,
+        this->stats.bytes     / 1048576.0,
+        this->stats.fullBytes / 1048576.0);
+
   egl_texBuffer_cleanup(this);
   LG_LOCK_FREE(this->copyLock);
 
@@ -176,6 +219,9 @@ bool egl_texBufferStreamSetup(EGL_Texture * texture, const EGL_TexSetup * setup)
     return false;
 
   TextureBuffer * this = UPCAST(TextureBuffer, texture);
+  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+    this->upload[i].count = -1;
+
   return egl_texUtilGenBuffers(&texture->format, this->buf, this->texCount);
 }
 
@@ -212,12 +258,80 @@ static bool egl_texBufferStreamUpdate(EGL_Texture * texture,
     }
   }
 
+  const FrameDamageRect rect =
+  {
+    .x      = update->x,
+    .y      = update->y,
+    .width  = update->width,
+    .height = update->height
+  };
+  egl_texBufferAddDamage(this->upload + this->bufIndex, &rect, 1);
+
   this->buf[this->bufIndex].updated = true;
   LG_UNLOCK(this->copyLock);
 
   return true;
 }
 
+static void egl_texBufferStreamUpload(TextureBuffer * this,
+    const struct TexDamage * damage)
+{
+  const EGL_TexFormat * fmt = &this->base.format;
+  const uint64_t fullBytes = (uint64_t)fmt->height * fmt->pitch;
+
+  bool partial = damage->count > 0;
+  if (partial)
+  {
+    uint64_t area = 0;
+    for (int i = 0; i < damage->count; ++i)
+      area += (uint64_t)damage->rects[i].width * damage->rects[i].height;
+
+    partial = area * 100 <=
+      (uint64_t)fmt->width * fmt->height * PARTIAL_UPLOAD_MAX_COVERAGE;
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, fmt->stride);
+
+  ++this->stats.uploads;
+  this->stats.fullBytes += fullBytes;
+
+  if (!partial)
+  {
+    glTexSubImage2D(GL_TEXTURE_2D,
+        0, 0, 0,
+        fmt->width,
+        fmt->height,
+        fmt->format,
+        fmt->dataType,
+        (const void *)0);
+    this->stats.bytes += fullBytes;
+    return;
+  }
+
+  ++this->stats.partialUploads;
+  for (int i = 0; i < damage->count; ++i)
+  {
+    const FrameDamageRect * rect = damage->rects + i;
+    if (rect->x >= fmt->width || rect->y >= fmt->height)
+      continue;
+
+    const size_t width  = min((size_t)rect->width , fmt->width  - rect->x);
+    const size_t height = min((size_t)rect->height, fmt->height - rect->y);
+    if (!width || !height)
+      continue;
+
+    glTexSubImage2D(GL_TEXTURE_2D,
+        0, rect->x, rect->y,
+        width,
+        height,
+        fmt->format,
+        fmt->dataType,
+        (const void *)((uintptr_t)rect->y * fmt->pitch +
+          (uintptr_t)rect->x * fmt->bpp));
+    this->stats.bytes += (uint64_t)height * width * fmt->bpp;
+  }
+}
+
 EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
 {
   TextureBuffer * this = UPCAST(TextureBuffer, texture);
@@ -227,6 +341,18 @@ EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
   GLuint          tex    = this->tex[this->bufIndex];
   EGL_TexBuffer * buffer = &this->buf[this->bufIndex];
 
+  struct TexDamage damage;
+  damage.count = 0;
+  if (buffer->updated)
+  {
+    struct TexDamage * upload = this->upload + this->bufIndex;
+    damage.count = upload->count;
+    if (damage.count > 0)
+      memcpy(damage.rects, upload->rects,
+          damage.count * sizeof(*damage.rects));
+    upload->count = 0;
+  }
+
   if (buffer->updated && this->sync == 0)
   {
     this->rIndex = this->bufIndex;
@@ -242,15 +368,7 @@ EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
 
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->pbo);
     glBindTexture(GL_TEXTURE_2D, tex);
-
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->format.stride);
-    glTexSubImage2D(GL_TEXTURE_2D,
-        0, 0, 0,
-        texture->format.width,
-        texture->format.height,
-        texture->format.format,
-        texture->format.dataType,
-        (const void *)0);
+    egl_texBufferStreamUpload(this, &damage);
     glBindTexture(GL_TEXTURE_2D, 0);
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
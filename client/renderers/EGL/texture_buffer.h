@@ -23,9 +23,17 @@
 #include "texture.h"
 #include "texture_util.h"
 #include "common/locking.h"
+#include "common/KVMFR.h"
 
 #define EGL_TEX_BUFFER_MAX 2
 
+// damaged regions of a buffer, a count of -1 means the whole buffer
+struct TexDamage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
 typedef struct TextureBuffer
 {
   EGL_Texture base;
@@ -39,9 +47,28 @@ typedef struct TextureBuffer
   LG_Lock       copyLock;
   int           bufIndex;
   int           rIndex;
+
+  // the regions of each buffer written since it was last uploaded
+  struct TexDamage upload[EGL_TEX_BUFFER_MAX];
+
+  struct
+  {
+    uint64_t uploads;
+    uint64_t partialUploads;
+    uint64_t bytes;
+    uint64_t fullBytes;
+  }
+  stats;
 }
 TextureBuffer;
 
+/**
+ * Add the rects to the damage, an empty set of rects damages everything.
+ * Merges the rects if there are too many to track.
+ */
+void egl_texBufferAddDamage(struct TexDamage * damage,
+    const FrameDamageRect * rects, int count);
+
 bool egl_texBufferInit(EGL_Texture ** texture_, EGL_TexType type,
     EGLDisplay * display);
 void egl_texBufferFree(EGL_Texture * texture_);
@@ -25,12 +25,6 @@
 #include "common/KVMFR.h"
 #include "common/rects.h"
 
-struct TexDamage
-{
-  int             count;
-  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
-};
-
 typedef struct TexFB
 {
   TextureBuffer base;
@@ -88,8 +82,9 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
   LG_LOCK(parent->copyLock);
 
   struct TexDamage * damage = this->damage + parent->bufIndex;
-  bool damageAll = !update->rects || update->rectCount == 0 || damage->count < 0 ||
-    damage->count + update->rectCount > KVMFR_MAX_DAMAGE_RECTS;
+  struct TexDamage * upload = parent->upload + parent->bufIndex;
+  egl_texBufferAddDamage(damage, update->rects, update->rectCount);
+  bool damageAll = damage->count < 0;
 
   if (damageAll)
   {
@@ -102,13 +97,10 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
       texture->format.bpp,
       texture->format.pitch
     );
+    upload->count = -1;
   }
-  else
+  else if (damage->count > 0)
   {
-    memcpy(damage->rects + damage->count, update->rects,
-      update->rectCount * sizeof(FrameDamageRect));
-    damage->count += update->rectCount;
-
     if (texture->format.pixFmt == EGL_PF_BGR_32)
     {
       FrameDamageRect scaledDamageRects[damage->count];
@@ -121,6 +113,7 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
         rect.width = (((originalX + rect.width) * 3 + 3) / 4) - scaledX;
         scaledDamageRects[i] = rect;
       }
+      egl_texBufferAddDamage(upload, scaledDamageRects, damage->count);
 
       rectsFramebufferToBuffer(
         scaledDamageRects,
@@ -135,6 +128,7 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
     }
     else
     {
+      egl_texBufferAddDamage(upload, damage->rects, damage->count);
       rectsFramebufferToBuffer(
         damage->rects,
         damage->count,
@@ -155,15 +149,8 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
     struct TexDamage * damage = this->damage + i;
     if (i == parent->bufIndex)
       damage->count = 0;
-    else if (update->rects && update->rectCount > 0 && damage->count >= 0 &&
-             damage->count + update->rectCount <= KVMFR_MAX_DAMAGE_RECTS)
-    {
-      memcpy(damage->rects + damage->count, update->rects,
-        update->rectCount * sizeof(FrameDamageRect));
-      damage->count += update->rectCount;
-    }
     else
-      damage->count = -1;
+      egl_texBufferAddDamage(damage, update->rects, update->rectCount);
   }
 
   LG_UNLOCK(parent->copyLock);
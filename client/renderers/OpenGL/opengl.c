@@ -35,15 +35,33 @@
 #include "common/option.h"
 #include "common/framebuffer.h"
 #include "common/locking.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
 #include "gl_dynprocs.h"
 #include "util.h"
 
-#define BUFFER_COUNT       2
+#define MAX_BUFFERS        4
+
+// above this percentage of the frame a single full upload is cheaper than
+// many small ones
+#define PARTIAL_UPLOAD_MAX_COVERAGE 50
 
 #define FPS_TEXTURE        0
-#define MOUSE_TEXTURE      1
-#define SPICE_TEXTURE      2
-#define TEXTURE_COUNT      3
+#define SPICE_TEXTURE      1
+#define TEXTURE_COUNT      2
+
+// the number of uploaded mouse shapes kept for reuse
+#define MOUSE_CACHE_SIZE   8
+
+static bool opengl_bufferCountValidate(struct Option * opt,
+    const char ** error)
+{
+  if (opt->value.x_int >= 2 && opt->value.x_int <= MAX_BUFFERS)
+    return true;
+
+  *error = "The buffer count must be between 2 and 4";
+  return false;
+}
 
 static struct Option opengl_options[] =
 {
@@ -75,6 +93,22 @@ static struct Option opengl_options[] =
     .type         = OPTION_TYPE_BOOL,
     .value.x_bool = true
   },
+  {
+    .module       = "opengl",
+    .name         = "bufferStorage",
+    .description  = "Use persistently mapped buffers (GL_ARB_buffer_storage) "
+                    "if they are available",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "opengl",
+    .name         = "bufferCount",
+    .description  = "The number of frame upload buffers (2-4)",
+    .type         = OPTION_TYPE_INT,
+    .validator    = opengl_bufferCountValidate,
+    .value.x_int  = 2
+  },
   {0}
 };
 
@@ -98,6 +132,16 @@ struct OpenGL_Options
   bool vsync;
   bool preventBuffer;
   bool amdPinnedMem;
+  bool bufferStorage;
+  int  bufferCount;
+};
+
+// the regions of a buffer that are out of date, a count of -1 means the
+// whole buffer
+struct Damage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
 };
 
 struct Inst
@@ -108,6 +152,7 @@ struct Inst
   struct OpenGL_Options opt;
 
   bool              amdPinnedMemSupport;
+  bool              bufferStorageSupport;
   bool              renderStarted;
   bool              configured;
   bool              reconfigure;
@@ -118,6 +163,8 @@ struct Inst
   _Atomic(bool)     frameUpdate;
 
   LG_Lock             formatLock;
+  LG_Lock             copyLock;
+  bool                asyncCopy;
   LG_RendererFormat   format;
   GLuint              intFormat;
   GLuint              vboFormat;
@@ -129,12 +176,16 @@ struct Inst
 
   uint64_t          drawStart;
   bool              hasBuffers;
-  GLuint            vboID[BUFFER_COUNT];
-  uint8_t         * texPixels[BUFFER_COUNT];
+  GLuint            vboID[MAX_BUFFERS];
+  uint8_t         * texPixels[MAX_BUFFERS];
+  uint8_t         * bufMap[MAX_BUFFERS];
   LG_Lock           frameLock;
+  struct Damage     damage[MAX_BUFFERS];
+  struct Damage     upload[MAX_BUFFERS];
   bool              texReady;
-  int               texWIndex, texRIndex;
+  int               texWIndex, texRIndex, texPending;
   int               texList;
+  int               mouseLists;
   int               mouseList;
   int               spiceList;
   LG_RendererRect   destRect;
@@ -142,8 +193,8 @@ struct Inst
   bool              spiceShow;
 
   bool              hasTextures, hasFrames;
-  GLuint            frames[BUFFER_COUNT];
-  GLsync            fences[BUFFER_COUNT];
+  GLuint            frames[MAX_BUFFERS];
+  GLsync            fences[MAX_BUFFERS];
   GLuint            textures[TEXTURE_COUNT];
 
   LG_Lock           mouseLock;
@@ -151,9 +202,21 @@ struct Inst
   int               mouseWidth;
   int               mouseHeight;
   int               mousePitch;
+  uint32_t          mouseID;
   uint8_t *         mouseData;
   size_t            mouseDataSize;
 
+  struct MouseShape
+  {
+    uint32_t id; // the shape ID, zero if it can not be reused
+    uint64_t lastUse;
+    GLuint   texture;
+    int      list;
+    int      w, h;
+  }
+  mouseCache[MOUSE_CACHE_SIZE];
+  uint64_t          mouseCacheUse;
+
   bool              mouseUpdate;
   bool              newShape;
   LG_RendererCursor mouseType;
@@ -174,9 +237,39 @@ enum ConfigStatus
 static void deconfigure(struct Inst * this);
 static enum ConfigStatus configure(struct Inst * this);
 static void updateMouseShape(struct Inst * this);
+static void copyFrame(struct Inst * this, const FrameBuffer * frame);
 static bool drawFrame(struct Inst * this);
 static void drawMouse(struct Inst * this);
 
+static void addDamage(struct Damage * damage, const FrameDamageRect * rects,
+    int count)
+{
+  if (damage->count < 0)
+    return;
+
+  if (!rects || count == 0)
+  {
+    damage->count = -1;
+    return;
+  }
+
+  if (damage->count + count <= KVMFR_MAX_DAMAGE_RECTS)
+  {
+    memcpy(damage->rects + damage->count, rects,
+      count * sizeof(FrameDamageRect));
+    damage->count += count;
+    return;
+  }
+
+  // too many rects to track, reduce them to fewer larger rects
+  FrameDamageRect merged[damage->count + count];
+  memcpy(merged, damage->rects, damage->count * sizeof(FrameDamageRect));
+  memcpy(merged + damage->count, rects, count * sizeof(FrameDamageRect));
+  damage->count = rectsCoalesce(merged, damage->count + count,
+      KVMFR_MAX_DAMAGE_RECTS);
+  memcpy(damage->rects, merged, damage->count * sizeof(FrameDamageRect));
+}
+
 const char * opengl_getName(void)
 {
   return "OpenGL";
@@ -204,8 +297,11 @@ bool opengl_create(LG_Renderer ** renderer, const LG_RendererParams params,
   this->opt.vsync         = option_get_bool("opengl", "vsync"        );
   this->opt.preventBuffer = option_get_bool("opengl", "preventBuffer");
   this->opt.amdPinnedMem  = option_get_bool("opengl", "amdPinnedMem" );
+  this->opt.bufferStorage = option_get_bool("opengl", "bufferStorage");
+  this->opt.bufferCount   = option_get_int ("opengl", "bufferCount"  );
 
   LG_LOCK_INIT(this->formatLock);
+  LG_LOCK_INIT(this->copyLock  );
   LG_LOCK_INIT(this->frameLock );
   LG_LOCK_INIT(this->mouseLock );
 
@@ -227,9 +323,9 @@ void opengl_deinitialize(LG_Renderer * renderer)
   {
     ImGui_ImplOpenGL2_Shutdown();
 
-    glDeleteLists(this->texList  , BUFFER_COUNT);
-    glDeleteLists(this->mouseList, 1);
-    glDeleteLists(this->spiceList, 1);
+    glDeleteLists(this->texList   , MAX_BUFFERS     );
+    glDeleteLists(this->mouseLists, MOUSE_CACHE_SIZE);
+    glDeleteLists(this->spiceList , 1);
   }
 
   deconfigure(this);
@@ -237,6 +333,8 @@ void opengl_deinitialize(LG_Renderer * renderer)
   if (this->hasTextures)
   {
     glDeleteTextures(TEXTURE_COUNT, this->textures);
+    for(int i = 0; i < MOUSE_CACHE_SIZE; ++i)
+      glDeleteTextures(1, &this->mouseCache[i].texture);
     this->hasTextures = false;
   }
 
@@ -250,6 +348,7 @@ void opengl_deinitialize(LG_Renderer * renderer)
   }
 
   LG_LOCK_FREE(this->formatLock);
+  LG_LOCK_FREE(this->copyLock  );
   LG_LOCK_FREE(this->frameLock );
   LG_LOCK_FREE(this->mouseLock );
 
@@ -319,7 +418,8 @@ void opengl_onResize(LG_Renderer * renderer, const int width, const int height,
 }
 
 bool opengl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
-    const int width, const int height, const int pitch, const uint8_t * data)
+    const int width, const int height, const int pitch, const uint32_t id,
+    const uint8_t * data)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
@@ -328,6 +428,7 @@ bool opengl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
   this->mouseWidth  = width;
   this->mouseHeight = height;
   this->mousePitch  = pitch;
+  this->mouseID     = id;
 
   const size_t size = height * pitch;
   if (size > this->mouseDataSize)
@@ -339,6 +440,8 @@ bool opengl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
     if (!this->mouseData)
     {
       DEBUG_ERROR("out of memory");
+      this->mouseDataSize = 0;
+      LG_UNLOCK(this->mouseLock);
       return false;
     }
 
@@ -376,6 +479,11 @@ bool opengl_onFrameFormat(LG_Renderer * renderer, const LG_RendererFormat format
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
+  // the buffers are for the old format until the render thread replaces them
+  LG_LOCK(this->copyLock);
+  this->asyncCopy = false;
+  LG_UNLOCK(this->copyLock);
+
   LG_LOCK(this->formatLock);
   memcpy(&this->format, &format, sizeof(LG_RendererFormat));
 
@@ -392,11 +500,26 @@ bool opengl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int dmaFd
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
+  LG_LOCK(this->copyLock);
   LG_LOCK(this->frameLock);
-  this->frame = frame;
-  atomic_store_explicit(&this->frameUpdate, true, memory_order_release);
+  for(int i = 0; i < this->opt.bufferCount; ++i)
+    addDamage(this->damage + i, damage, damageCount);
+
+  if (!this->asyncCopy)
+  {
+    // leave the copy to the render thread
+    this->frame = frame;
+    LG_UNLOCK(this->frameLock);
+    LG_UNLOCK(this->copyLock);
+    return true;
+  }
+
+  this->frame = NULL;
   LG_UNLOCK(this->frameLock);
 
+  copyFrame(this, frame);
+  LG_UNLOCK(this->copyLock);
+
   return true;
 }
 
@@ -415,9 +538,26 @@ bool opengl_renderStartup(LG_Renderer * renderer, bool useDMA)
   DEBUG_INFO("Version : %s", glGetString(GL_VERSION ));
 
   const char * exts = (const char *)glGetString(GL_EXTENSIONS);
+  GLint maj, min;
+  glGetIntegerv(GL_MAJOR_VERSION, &maj);
+  glGetIntegerv(GL_MINOR_VERSION, &min);
+
+  if ((maj > 4 || (maj == 4 && min >= 4) ||
+      util_hasGLExt(exts, "GL_ARB_buffer_storage")) &&
+      g_gl_dynProcs.glBufferStorage && g_gl_dynProcs.glMapBufferRange)
+  {
+    if (this->opt.bufferStorage)
+    {
+      this->bufferStorageSupport = true;
+      DEBUG_INFO("Using GL_ARB_buffer_storage");
+    }
+    else
+      DEBUG_INFO("GL_ARB_buffer_storage is available but not in use");
+  }
+
   if (util_hasGLExt(exts, "GL_AMD_pinned_memory"))
   {
-    if (this->opt.amdPinnedMem)
+    if (this->opt.amdPinnedMem && !this->bufferStorageSupport)
     {
       this->amdPinnedMemSupport = true;
       DEBUG_INFO("Using GL_AMD_pinned_memory");
@@ -426,10 +566,6 @@ bool opengl_renderStartup(LG_Renderer * renderer, bool useDMA)
       DEBUG_INFO("GL_AMD_pinned_memory is available but not in use");
   }
 
-  GLint maj, min;
-  glGetIntegerv(GL_MAJOR_VERSION, &maj);
-  glGetIntegerv(GL_MINOR_VERSION, &min);
-
   if ((maj < 3 || (maj == 3 && min < 2)) && !util_hasGLExt(exts, "GL_ARB_sync"))
   {
     DEBUG_ERROR("Need OpenGL 3.2+ or GL_ARB_sync for sync objects");
@@ -458,12 +594,19 @@ bool opengl_renderStartup(LG_Renderer * renderer, bool useDMA)
   glEnable(GL_MULTISAMPLE);
 
   // generate lists for drawing
-  this->texList   = glGenLists(BUFFER_COUNT);
-  this->mouseList = glGenLists(1);
-  this->spiceList = glGenLists(1);
+  this->texList    = glGenLists(MAX_BUFFERS);
+  this->mouseLists = glGenLists(MOUSE_CACHE_SIZE);
+  this->mouseList  = this->mouseLists;
+  this->spiceList  = glGenLists(1);
 
   // create the overlay textures
   glGenTextures(TEXTURE_COUNT, this->textures);
+  for(int i = 0; i < MOUSE_CACHE_SIZE; ++i)
+  {
+    glGenTextures(1, &this->mouseCache[i].texture);
+    this->mouseCache[i].list = this->mouseLists + i;
+  }
+
   if (check_gl_error("glGenTextures"))
   {
     LG_UNLOCK(this->formatLock);
@@ -759,6 +902,11 @@ static enum ConfigStatus configure(struct Inst * this)
     return CONFIG_STATUS_NOOP;
   }
 
+  // wait for any copy in progress and stop the frame thread from copying
+  LG_LOCK(this->copyLock);
+  this->asyncCopy = false;
+  LG_UNLOCK(this->copyLock);
+
   deconfigure(this);
 
   switch(this->format.type)
@@ -816,7 +964,7 @@ static enum ConfigStatus configure(struct Inst * this)
   this->texSize = this->format.dataHeight * this->format.pitch;
   this->texPos  = 0;
 
-  g_gl_dynProcs.glGenBuffers(BUFFER_COUNT, this->vboID);
+  g_gl_dynProcs.glGenBuffers(this->opt.bufferCount, this->vboID);
   if (check_gl_error("glGenBuffers"))
   {
     LG_UNLOCK(this->formatLock);
@@ -824,10 +972,37 @@ static enum ConfigStatus configure(struct Inst * this)
   }
   this->hasBuffers = true;
 
-  if (this->amdPinnedMemSupport)
+  if (this->bufferStorageSupport)
+  {
+    const GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    for(int i = 0; i < this->opt.bufferCount; ++i)
+    {
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
+      g_gl_dynProcs.glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->texSize,
+          NULL, flags);
+      if (check_gl_error("glBufferStorage"))
+      {
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+
+      this->bufMap[i] = g_gl_dynProcs.glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+          0, this->texSize, flags);
+      if (!this->bufMap[i])
+      {
+        check_gl_error("glMapBufferRange");
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+    }
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  else if (this->amdPinnedMemSupport)
   {
     const int pagesize = getpagesize();
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    for(int i = 0; i < this->opt.bufferCount; ++i)
     {
       this->texPixels[i] = aligned_alloc(pagesize,
           ALIGN_TO(this->texSize, pagesize));
@@ -838,6 +1013,7 @@ static enum ConfigStatus configure(struct Inst * this)
       }
 
       memset(this->texPixels[i], 0, this->texSize);
+      this->bufMap[i] = this->texPixels[i];
 
       g_gl_dynProcs.glBindBuffer(
           GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, this->vboID[i]);
@@ -864,7 +1040,7 @@ static enum ConfigStatus configure(struct Inst * this)
   }
   else
   {
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    for(int i = 0; i < this->opt.bufferCount; ++i)
     {
       g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
       if (check_gl_error("glBindBuffer"))
@@ -889,7 +1065,7 @@ static enum ConfigStatus configure(struct Inst * this)
   }
 
   // create the frame textures
-  glGenTextures(BUFFER_COUNT, this->frames);
+  glGenTextures(this->opt.bufferCount, this->frames);
   if (check_gl_error("glGenTextures"))
   {
     LG_UNLOCK(this->formatLock);
@@ -897,7 +1073,7 @@ static enum ConfigStatus configure(struct Inst * this)
   }
   this->hasFrames = true;
 
-  for(int i = 0; i < BUFFER_COUNT; ++i)
+  for(int i = 0; i < this->opt.bufferCount; ++i)
   {
     // bind and create the new texture
     glBindTexture(GL_TEXTURE_2D, this->frames[i]);
@@ -948,6 +1124,25 @@ static enum ConfigStatus configure(struct Inst * this)
   glBindTexture(GL_TEXTURE_2D, 0);
   g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
+  // the new buffers hold nothing yet
+  LG_LOCK(this->copyLock);
+  LG_LOCK(this->frameLock);
+  for(int i = 0; i < this->opt.bufferCount; ++i)
+  {
+    this->damage[i].count = -1;
+    this->upload[i].count = -1;
+  }
+  this->texWIndex  = 1;
+  this->texRIndex  = 0;
+  this->texPending = 0;
+  atomic_store_explicit(&this->frameUpdate, false, memory_order_relaxed);
+
+  /* the frame thread can copy straight into mapped buffers, otherwise the
+   * copy has to be done on the render thread with glBufferSubData */
+  this->asyncCopy = this->bufMap[0] != NULL;
+  LG_UNLOCK(this->frameLock);
+  LG_UNLOCK(this->copyLock);
+
   this->drawStart   = nanotime();
   this->configured  = true;
   this->reconfigure = false;
@@ -960,26 +1155,32 @@ static void deconfigure(struct Inst * this)
 {
   if (this->hasFrames)
   {
-    glDeleteTextures(BUFFER_COUNT, this->frames);
+    glDeleteTextures(this->opt.bufferCount, this->frames);
     this->hasFrames = false;
   }
 
+  for(int i = 0; i < this->opt.bufferCount; ++i)
+  {
+    if (this->fences[i])
+    {
+      g_gl_dynProcs.glDeleteSync(this->fences[i]);
+      this->fences[i] = NULL;
+    }
+
+    // deleting the buffer also releases a persistent mapping
+    this->bufMap[i] = NULL;
+  }
+
   if (this->hasBuffers)
   {
-    g_gl_dynProcs.glDeleteBuffers(BUFFER_COUNT, this->vboID);
+    g_gl_dynProcs.glDeleteBuffers(this->opt.bufferCount, this->vboID);
     this->hasBuffers = false;
   }
 
   if (this->amdPinnedMemSupport)
   {
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    for(int i = 0; i < this->opt.bufferCount; ++i)
     {
-      if (this->fences[i])
-      {
-        g_gl_dynProcs.glDeleteSync(this->fences[i]);
-        this->fences[i] = NULL;
-      }
-
       if (this->texPixels[i])
       {
         free(this->texPixels[i]);
@@ -999,6 +1200,37 @@ static void updateMouseShape(struct Inst * this)
     LG_UNLOCK(this->mouseLock);
     return;
   }
+  this->newShape = false;
+
+  // reuse the texture and list of cached shapes instead of uploading them
+  struct MouseShape * shape = NULL;
+  for(int i = 0; this->mouseID && i < MOUSE_CACHE_SIZE; ++i)
+    if (this->mouseCache[i].id == this->mouseID)
+    {
+      shape = this->mouseCache + i;
+      break;
+    }
+
+  if (shape)
+  {
+    shape->lastUse    = ++this->mouseCacheUse;
+    this->mouseType   = this->mouseCursor;
+    this->mouseList   = shape->list;
+    this->mousePos.w  = shape->w;
+    this->mousePos.h  = shape->h;
+    this->mouseUpdate = true;
+    LG_UNLOCK(this->mouseLock);
+    return;
+  }
+
+  shape = this->mouseCache;
+  for(int i = 1; i < MOUSE_CACHE_SIZE; ++i)
+    if (this->mouseCache[i].lastUse < shape->lastUse)
+      shape = this->mouseCache + i;
+
+  shape->id        = this->mouseID;
+  shape->lastUse   = ++this->mouseCacheUse;
+  this->mouseList  = shape->list;
 
   const LG_RendererCursor cursor = this->mouseCursor;
   const int               width  = this->mouseWidth;
@@ -1026,7 +1258,7 @@ static void updateMouseShape(struct Inst * this)
 
     case LG_CURSOR_COLOR:
     {
-      glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+      glBindTexture(GL_TEXTURE_2D, shape->texture);
       glPixelStorei(GL_UNPACK_ALIGNMENT , 4    );
       glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
       glTexImage2D
@@ -1047,12 +1279,12 @@ static void updateMouseShape(struct Inst * this)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
       glBindTexture(GL_TEXTURE_2D, 0);
 
-      this->mousePos.w = width;
-      this->mousePos.h = height;
+      this->mousePos.w = shape->w = width;
+      this->mousePos.h = shape->h = height;
 
       glNewList(this->mouseList, GL_COMPILE);
         glEnable(GL_BLEND);
-        glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+        glBindTexture(GL_TEXTURE_2D, shape->texture);
         glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
         glBegin(GL_TRIANGLE_STRIP);
           glTexCoord2f(0.0f, 0.0f); glVertex2i(0    , 0     );
@@ -1083,7 +1315,7 @@ static void updateMouseShape(struct Inst * this)
           d[y * width + x + width * hheight] = xorMask;
         }
 
-      glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+      glBindTexture(GL_TEXTURE_2D, shape->texture);
       glPixelStorei(GL_UNPACK_ALIGNMENT , 4    );
       glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
       glTexImage2D
@@ -1104,12 +1336,12 @@ static void updateMouseShape(struct Inst * this)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
       glBindTexture(GL_TEXTURE_2D, 0);
 
-      this->mousePos.w = width;
-      this->mousePos.h = hheight;
+      this->mousePos.w = shape->w = width;
+      this->mousePos.h = shape->h = hheight;
 
       glNewList(this->mouseList, GL_COMPILE);
         glEnable(GL_COLOR_LOGIC_OP);
-        glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+        glBindTexture(GL_TEXTURE_2D, shape->texture);
         glLogicOp(GL_AND);
         glBegin(GL_TRIANGLE_STRIP);
           glTexCoord2f(0.0f, 0.0f); glVertex2i(0    , 0      );
@@ -1135,6 +1367,8 @@ static void updateMouseShape(struct Inst * this)
   LG_UNLOCK(this->mouseLock);
 }
 
+/* called for each row of the frame, the rows are stored at the frame pitch to
+ * match the layout of the mapped buffers */
 static bool opengl_bufferFn(void * opaque, const void * data, size_t size)
 {
   struct Inst * this = (struct Inst *)opaque;
@@ -1150,89 +1384,255 @@ static bool opengl_bufferFn(void * opaque, const void * data, size_t size)
   if (check_gl_error("glBufferSubData"))
     return false;
 
-  this->texPos += size;
+  this->texPos += this->format.pitch;
   return true;
 }
 
+static bool waitFence(struct Inst * this, int index, bool block)
+{
+  GLsync * fence = this->fences + index;
+  if (!*fence)
+    return true;
+
+  switch(g_gl_dynProcs.glClientWaitSync(*fence, 0,
+        block ? GL_TIMEOUT_IGNORED : 0))
+  {
+    case GL_ALREADY_SIGNALED:
+      break;
+
+    case GL_CONDITION_SATISFIED:
+      DEBUG_WARN("Had to wait for the sync");
+      break;
+
+    case GL_TIMEOUT_EXPIRED:
+      if (!block)
+        return false;
+      DEBUG_WARN("Timeout expired, DMA transfers are too slow!");
+      break;
+
+    case GL_WAIT_FAILED:
+      DEBUG_ERROR("Wait failed %d", glGetError());
+      break;
+  }
+
+  g_gl_dynProcs.glDeleteSync(*fence);
+  *fence = NULL;
+  return true;
+}
+
+static bool damagePartial(struct Inst * this, const struct Damage * damage)
+{
+  if (damage->count < 0)
+    return false;
+
+  uint64_t area = 0;
+  for(int i = 0; i < damage->count; ++i)
+    area += (uint64_t)damage->rects[i].width * damage->rects[i].height;
+
+  return area * 100 <= (uint64_t)this->format.frameWidth *
+    this->format.frameHeight * PARTIAL_UPLOAD_MAX_COVERAGE;
+}
+
+/* copy the frame into the write buffer, this runs on the frame thread when the
+ * buffers are mapped and must be called with the copyLock held */
+static void copyFrame(struct Inst * this, const FrameBuffer * frame)
+{
+  const int bpp = this->format.bpp / 8;
+
+  /* only the regions that changed since this buffer was last written need to
+   * be copied, which requires the buffer to be mapped */
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  int rectCount = -1;
+
+  LG_LOCK(this->frameLock);
+  // the buffer is about to change, it can't be uploaded until it's done
+  atomic_store_explicit(&this->frameUpdate, false, memory_order_relaxed);
+
+  const int index = this->texWIndex;
+  struct Damage * damage = this->damage + index;
+  if (this->bufMap[index] && damagePartial(this, damage))
+  {
+    rectCount = damage->count;
+    memcpy(rects, damage->rects, rectCount * sizeof(*rects));
+  }
+  damage->count = 0;
+  LG_UNLOCK(this->frameLock);
+
+  if (rectCount >= 0)
+    rectsFramebufferToBuffer(
+      rects,
+      rectCount,
+      bpp,
+      this->bufMap[index],
+      this->format.pitch,
+      this->format.dataHeight,
+      frame,
+      this->format.pitch
+    );
+  else if (this->bufMap[index])
+    framebuffer_read(
+      frame,
+      this->bufMap[index],
+      this->format.pitch,
+      this->format.dataHeight,
+      this->format.dataWidth,
+      bpp,
+      this->format.pitch
+    );
+  else
+  {
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[index]);
+    this->texPos = 0;
+    framebuffer_read_fn(
+      frame,
+      this->format.dataHeight,
+      this->format.dataWidth,
+      bpp,
+      this->format.pitch,
+      opengl_bufferFn,
+      this
+    );
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  LG_LOCK(this->frameLock);
+  if (rectCount >= 0)
+    addDamage(this->upload + index, rects, rectCount);
+  else
+    this->upload[index].count = -1;
+  atomic_store_explicit(&this->frameUpdate, true, memory_order_release);
+  LG_UNLOCK(this->frameLock);
+}
+
 static bool drawFrame(struct Inst * this)
 {
-  if (g_gl_dynProcs.glIsSync(this->fences[this->texWIndex]))
+  const int count = this->opt.bufferCount;
+
+  // show the newest buffer that has finished uploading
+  while(this->texPending > 0)
   {
-    switch(g_gl_dynProcs.glClientWaitSync(this->fences[this->texWIndex], 0, GL_TIMEOUT_IGNORED))
-    {
-      case GL_ALREADY_SIGNALED:
-        break;
+    const int next = (this->texRIndex + 1) % count;
+    if (!waitFence(this, next, false))
+      break;
 
-      case GL_CONDITION_SATISFIED:
-        DEBUG_WARN("Had to wait for the sync");
-        break;
+    this->texRIndex = next;
+    --this->texPending;
+  }
 
-      case GL_TIMEOUT_EXPIRED:
-        DEBUG_WARN("Timeout expired, DMA transfers are too slow!");
-        break;
+  LG_LOCK(this->frameLock);
+  const bool syncCopy = this->frame != NULL;
+  LG_UNLOCK(this->frameLock);
 
-      case GL_WAIT_FAILED:
-        DEBUG_ERROR("Wait failed %d", glGetError());
-        break;
-    }
+  if (syncCopy)
+  {
+    // the frame thread could not copy this frame, do it here
+    LG_LOCK(this->copyLock);
+    LG_LOCK(this->formatLock);
+    LG_LOCK(this->frameLock);
+    const FrameBuffer * frame = this->reconfigure ? NULL : this->frame;
+    if (frame)
+      this->frame = NULL;
+    LG_UNLOCK(this->frameLock);
 
-    g_gl_dynProcs.glDeleteSync(this->fences[this->texWIndex]);
-    this->fences[this->texWIndex] = NULL;
+    if (frame)
+      copyFrame(this, frame);
 
-    this->texRIndex = this->texWIndex;
-    if (++this->texWIndex == BUFFER_COUNT)
-      this->texWIndex = 0;
+    LG_UNLOCK(this->formatLock);
+    LG_UNLOCK(this->copyLock);
+  }
+
+  // the buffers no longer match the format, wait for them to be replaced
+  LG_LOCK(this->formatLock);
+  if (this->reconfigure)
+  {
+    LG_UNLOCK(this->formatLock);
+    return true;
   }
 
   LG_LOCK(this->frameLock);
   if (!atomic_exchange_explicit(&this->frameUpdate, false, memory_order_acquire))
   {
     LG_UNLOCK(this->frameLock);
+    LG_UNLOCK(this->formatLock);
     return true;
   }
 
-  LG_LOCK(this->formatLock);
-  glBindTexture(GL_TEXTURE_2D, this->frames[this->texWIndex]);
-  g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[this->texWIndex]);
+  // every other buffer is still uploading, wait for the oldest
+  if (this->texPending == count - 1)
+  {
+    this->texRIndex = (this->texRIndex + 1) % count;
+    waitFence(this, this->texRIndex, true);
+    --this->texPending;
+  }
 
-  int bpp = this->format.bpp / 8;
-  glPixelStorei(GL_UNPACK_ALIGNMENT , bpp < 4 ? 1 : bpp);
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.frameWidth);
-
-  this->texPos = 0;
-  framebuffer_read_fn(
-    this->frame,
-    this->format.dataHeight,
-    this->format.dataWidth,
-    bpp,
-    this->format.pitch,
-    opengl_bufferFn,
-    this
-  );
+  // take the written buffer and give the frame thread the next one
+  const int index = this->texWIndex;
+  this->texWIndex = (index + 1) % count;
 
+  struct Damage * upload = this->upload + index;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  int rectCount = -1;
+  if (damagePartial(this, upload))
+  {
+    rectCount = upload->count;
+    memcpy(rects, upload->rects, rectCount * sizeof(*rects));
+  }
+  upload->count = 0;
   LG_UNLOCK(this->frameLock);
 
+  glBindTexture(GL_TEXTURE_2D, this->frames[index]);
+  g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[index]);
+
+  const int bpp = this->format.bpp / 8;
+  glPixelStorei(GL_UNPACK_ALIGNMENT , bpp < 4 ? 1 : bpp);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.pitch / bpp);
+
   // update the texture
-  glTexSubImage2D(
-    GL_TEXTURE_2D,
-    0,
-    0,
-    0,
-    this->format.frameWidth ,
-    this->format.frameHeight,
-    this->vboFormat,
-    this->dataFormat,
-    (void*)0
-  );
+  if (rectCount >= 0)
+  {
+    for(int i = 0; i < rectCount; ++i)
+    {
+      const FrameDamageRect * rect = rects + i;
+      if (rect->x >= this->format.frameWidth ||
+          rect->y >= this->format.frameHeight)
+        continue;
+
+      glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        rect->x,
+        rect->y,
+        min(rect->width , this->format.frameWidth  - rect->x),
+        min(rect->height, this->format.frameHeight - rect->y),
+        this->vboFormat,
+        this->dataFormat,
+        (void*)((uintptr_t)rect->y * this->format.pitch +
+          (uintptr_t)rect->x * bpp)
+      );
+    }
+  }
+  else
+    glTexSubImage2D(
+      GL_TEXTURE_2D,
+      0,
+      0,
+      0,
+      this->format.frameWidth ,
+      this->format.frameHeight,
+      this->vboFormat,
+      this->dataFormat,
+      (void*)0
+    );
+
   if (check_gl_error("glTexSubImage2D"))
   {
     DEBUG_ERROR(
-      "texWIndex: %u, "
+      "index: %d, "
       "width: %u, "
       "height: %u, "
       "vboFormat: %x, "
       "texSize: %lu",
-      this->texWIndex,
+      index,
       this->format.frameWidth,
       this->format.frameHeight,
       this->vboFormat,
@@ -1261,7 +1661,8 @@ static bool drawFrame(struct Inst * this)
   glBindTexture(GL_TEXTURE_2D, 0);
 
   // set a fence so we don't overwrite a buffer in use
-  this->fences[this->texWIndex] =
+  ++this->texPending;
+  this->fences[index] =
     g_gl_dynProcs.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
   glFlush();
 
@@ -103,6 +103,20 @@ static struct Option options[] =
     .type          = OPTION_TYPE_BOOL,
     .value.x_bool  = true
   },
+  {
+    .module        = "app",
+    .name          = "adaptiveWait",
+    .description   = "Spin then block while waiting for frame data instead of polling",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
+  {
+    .module        = "app",
+    .name          = "streamingReads",
+    .description   = "Read frames with non-temporal streaming loads (faster on write-combined memory)",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
 
   // window options
   {
@@ -661,6 +675,8 @@ bool config_load(int argc, char * argv[])
   g_params.cursorPollInterval = option_get_int   ("app"  , "cursorPollInterval");
   g_params.framePollInterval  = option_get_int   ("app"  , "framePollInterval" );
   g_params.allowDMA           = option_get_bool  ("app"  , "allowDMA"          );
+  g_params.adaptiveWait       = option_get_bool  ("app"  , "adaptiveWait"      );
+  g_params.streamingReads     = option_get_bool  ("app"  , "streamingReads"    );
 
   g_params.windowTitle       = option_get_string("win", "title"             );
   g_params.appId             = option_get_string("win", "appId"             );
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <math.h>
 #include <stdatomic.h>
@@ -51,6 +52,9 @@
 #include "common/paths.h"
 #include "common/cpuinfo.h"
 #include "common/ll.h"
+#include "common/framebuffer.h"
+#include "common/framedamage.h"
+#include "common/framecodec.h"
 
 #include "core.h"
 #include "app.h"
@@ -310,6 +314,17 @@ static int renderThread(void * unused)
     }
     g_state.lastRenderTimeValid = true;
 
+    // capture to present latency of the newest frame
+    if (newFrame)
+    {
+      const uint64_t captureTime = atomic_load_explicit(
+          &g_state.frameCaptureTime, memory_order_relaxed);
+      const uint64_t presentTime = microtime();
+      if (captureTime && captureTime < presentTime)
+        ringbuffer_push(g_state.latencyTimings,
+            &(float) { (presentTime - captureTime) * 1e-3f });
+    }
+
     const uint64_t now = microtime();
     if (unlikely(
           !g_state.resizeDone &&
@@ -348,12 +363,70 @@ static int renderThread(void * unused)
   return 0;
 }
 
+static void cursorSetGuestPosition(int x, int y)
+{
+  bool valid = g_cursor.guest.valid;
+  g_cursor.guest.x     = x;
+  g_cursor.guest.y     = y;
+  g_cursor.guest.valid = true;
+
+  // if the state just became valid
+  if (valid != true && core_inputEnabled())
+  {
+    core_alignToGuest();
+    app_resyncMouseBasic();
+  }
+
+  // tell the DS there was an update
+  core_handleGuestMouseUpdate();
+}
+
+static void cursorRender(void)
+{
+  g_cursor.redraw = false;
+
+  RENDERER(onMouseEvent,
+    g_cursor.guest.visible && (g_cursor.draw || !g_params.useSpiceInput),
+    g_cursor.guest.x,
+    g_cursor.guest.y,
+    g_cursor.guest.hx,
+    g_cursor.guest.hy
+  );
+
+  if (g_params.mouseRedraw && g_cursor.guest.visible && !g_state.stopVideo)
+    lgSignalEvent(g_state.frameEvent);
+}
+
+/* read the host's position slot, returns false if it has not changed since
+ * `seq` or is being written */
+static bool cursorReadPos(const KVMFRCursorPos * pos, uint32_t * seq,
+    int * x, int * y)
+{
+  _Atomic(uint32_t) * s = (_Atomic(uint32_t) *)&pos->seq;
+
+  const uint32_t s1 = atomic_load_explicit(s, memory_order_acquire);
+  if (s1 == *seq || (s1 & 1))
+    return false;
+
+  *x = *(volatile const int16_t *)&pos->x;
+  *y = *(volatile const int16_t *)&pos->y;
+  atomic_thread_fence(memory_order_acquire);
+
+  if (atomic_load_explicit(s, memory_order_relaxed) != s1)
+    return false;
+
+  *seq = s1;
+  return true;
+}
+
 int main_cursorThread(void * unused)
 {
   LGMP_STATUS         status;
   LG_RendererCursor   cursorType = LG_CURSOR_COLOR;
   KVMFRCursor *       cursor     = NULL;
   int                 cursorSize = 0;
+  KVMFRCursorPos *    cursorPos  = NULL;
+  uint32_t            posSeq     = 0;
 
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
 
@@ -383,6 +456,14 @@ int main_cursorThread(void * unused)
     {
       if (status == LGMP_ERR_QUEUE_EMPTY)
       {
+        int x, y;
+        if (cursorPos && cursorReadPos(cursorPos, &posSeq, &x, &y))
+        {
+          cursorSetGuestPosition(x, y);
+          cursorRender();
+          continue;
+        }
+
         if (g_cursor.redraw && g_cursor.guest.valid)
         {
           g_cursor.redraw = false;
@@ -454,6 +535,17 @@ int main_cursorThread(void * unused)
     memcpy(cursor, msg.mem, neededSize);
     lgmpClientMessageDone(g_state.pointerQueue);
 
+    KVMFRCursorPos * pos = NULL;
+    if (cursor->posOffset &&
+        cursor->posOffset <= g_state.shm.size - sizeof(*pos))
+      pos = (KVMFRCursorPos *)((uint8_t *)g_state.shm.mem + cursor->posOffset);
+
+    if (pos != cursorPos)
+    {
+      cursorPos = pos;
+      posSeq    = 0;
+    }
+
     g_cursor.guest.visible =
       msg.udata & CURSOR_FLAG_VISIBLE;
 
@@ -478,6 +570,7 @@ int main_cursorThread(void * unused)
         cursor->width,
         cursor->height,
         cursor->pitch,
+        cursor->shapeID,
         data)
       )
       {
@@ -486,36 +579,14 @@ int main_cursorThread(void * unused)
       }
     }
 
-    if (msg.udata & CURSOR_FLAG_POSITION)
-    {
-      bool valid = g_cursor.guest.valid;
-      g_cursor.guest.x     = cursor->x;
-      g_cursor.guest.y     = cursor->y;
-      g_cursor.guest.valid = true;
-
-      // if the state just became valid
-      if (valid != true && core_inputEnabled())
-      {
-        core_alignToGuest();
-        app_resyncMouseBasic();
-      }
+    // once written the position slot is newer than any position in the queue
+    int x, y;
+    if (cursorPos && cursorReadPos(cursorPos, &posSeq, &x, &y))
+      cursorSetGuestPosition(x, y);
+    else if ((msg.udata & CURSOR_FLAG_POSITION) && (!cursorPos || !posSeq))
+      cursorSetGuestPosition(cursor->x, cursor->y);
 
-      // tell the DS there was an update
-      core_handleGuestMouseUpdate();
-    }
-
-    g_cursor.redraw = false;
-
-    RENDERER(onMouseEvent,
-      g_cursor.guest.visible && (g_cursor.draw || !g_params.useSpiceInput),
-      g_cursor.guest.x,
-      g_cursor.guest.y,
-      g_cursor.guest.hx,
-      g_cursor.guest.hy
-    );
-
-    if (g_params.mouseRedraw && g_cursor.guest.visible && !g_state.stopVideo)
-      lgSignalEvent(g_state.frameEvent);
+    cursorRender();
   }
 
   LG_LOCK(g_state.pointerQueueLock);
@@ -548,7 +619,23 @@ int main_frameThread(void * unused)
   size_t            dataSize    = 0;
   LG_RendererFormat lgrFormat;
 
-  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN] = {0};
+  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_BUFFERS_MAX] = {0};
+
+  // compressed frames are decoded into this buffer for the renderer
+  FrameBuffer * decodeBuffer = NULL;
+  size_t        decodeSize   = 0;
+
+  // too large for the stack, only this thread uses it
+  static FrameDamageRect damageRects[FRAMEDAMAGE_MAX_RECTS];
+
+  struct
+  {
+    uint64_t frames;
+    uint64_t receiveUs;
+    uint64_t uploadUs;
+  }
+  latency = { 0 };
+
   if (g_state.useDMA)
     DEBUG_INFO("Using DMA buffer support");
 
@@ -612,6 +699,7 @@ int main_frameThread(void * unused)
     }
 
     KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
+    const uint64_t receiveTime = microtime();
 
     // ignore any repeated frames, this happens when a new client connects to
     // the same host application.
@@ -622,6 +710,16 @@ int main_frameThread(void * unused)
     }
     frameSerial = frame->frameSerial;
 
+    if (frame->postTime)
+      clockSync_sample(&g_state.hostClock, frame->postTime, receiveTime);
+
+    const KVMFRStats * hostStats = NULL;
+    if (frame->statsOffset &&
+        frame->statsOffset <= g_state.shm.size - sizeof(*hostStats))
+      hostStats = (const KVMFRStats *)
+        ((uint8_t *)g_state.shm.mem + frame->statsOffset);
+    atomic_store_explicit(&g_state.hostStats, hostStats, memory_order_relaxed);
+
     struct DMAFrameInfo *dma = NULL;
 
     if (!g_state.formatValid || frame->formatVer != formatVer)
@@ -735,7 +833,8 @@ int main_frameThread(void * unused)
       core_updatePositionInfo();
     }
 
-    if (g_state.useDMA)
+    const bool compressed = frame->flags & FRAME_FLAG_COMPRESSED;
+    if (g_state.useDMA && !compressed)
     {
       /* find the existing dma buffer if it exists */
       for(int i = 0; i < ARRAY_LENGTH(dmaInfo); ++i)
@@ -791,8 +890,43 @@ int main_frameThread(void * unused)
     }
 
     FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    if (!RENDERER(onFrame, fb, g_state.useDMA ? dma->fd : -1,
-          frame->damageRects, frame->damageRectsCount))
+    if (compressed)
+    {
+      if (decodeSize < dataSize)
+      {
+        free(decodeBuffer);
+        decodeBuffer = malloc(sizeof(*decodeBuffer) + dataSize);
+        if (!decodeBuffer)
+        {
+          DEBUG_ERROR("Out of memory");
+          lgmpClientMessageDone(queue);
+          g_state.state = APP_STATE_SHUTDOWN;
+          break;
+        }
+        decodeSize = dataSize;
+      }
+
+      // decode the bands as the host writes them
+      const size_t maxSize = g_state.shm.size - sizeof(*fb) -
+        ((uint8_t *)fb - (uint8_t *)g_state.shm.mem);
+      unsigned int rows;
+      if (!frameCodec_decode(fb, maxSize, framebuffer_get_data(decodeBuffer),
+            lgrFormat.pitch, lgrFormat.dataHeight, &rows))
+      {
+        DEBUG_WARN("Failed to decode the compressed frame");
+        lgmpClientMessageDone(queue);
+        continue;
+      }
+
+      framebuffer_set_write_ptr(decodeBuffer, dataSize);
+      fb = decodeBuffer;
+    }
+
+    const unsigned int damageRectsCount = frameDamage_decode(frame,
+        damageRects, ARRAY_LENGTH(damageRects));
+
+    if (!RENDERER(onFrame, fb, dma ? dma->fd : -1,
+          damageRects, damageRectsCount))
     {
       lgmpClientMessageDone(queue);
       DEBUG_ERROR("renderer on frame returned failure");
@@ -802,6 +936,19 @@ int main_frameThread(void * unused)
 
     overlaySplash_show(false);
 
+    if (frame->captureTime && g_state.hostClock.valid)
+    {
+      const uint64_t captureTime =
+        clockSync_toLocal(&g_state.hostClock, frame->captureTime);
+
+      ++latency.frames;
+      if (captureTime < receiveTime)
+        latency.receiveUs += receiveTime - captureTime;
+      latency.uploadUs  += microtime() - receiveTime;
+      atomic_store_explicit(&g_state.frameCaptureTime, captureTime,
+          memory_order_relaxed);
+    }
+
     if (frame->flags & FRAME_FLAG_REQUEST_ACTIVATION &&
         g_params.requestActivation)
       g_state.ds->requestActivation();
@@ -842,6 +989,25 @@ int main_frameThread(void * unused)
 
   lgmpClientUnsubscribe(&queue);
 
+  FrameBufferWaitStats waitStats;
+  framebuffer_get_wait_stats(&waitStats);
+  if (waitStats.waits)
+    DEBUG_INFO("Frame waits: %" PRIu64 " (spin: %" PRIu64 " %.2fms, "
+        "blocked: %" PRIu64 " %.2fms, timeouts: %" PRIu64 ")",
+        waitStats.waits,
+        waitStats.spinWaits , waitStats.spinTimeNs  * 1e-6,
+        waitStats.blockWaits, waitStats.blockTimeNs * 1e-6,
+        waitStats.timeouts);
+  framebuffer_reset_wait_stats();
+  atomic_store_explicit(&g_state.hostStats, NULL, memory_order_relaxed);
+
+  if (latency.frames)
+    DEBUG_INFO("Frame latency: capture to receive %.2fms, "
+        "receive to upload %.2fms",
+        latency.receiveUs * 1e-3 / latency.frames,
+        latency.uploadUs  * 1e-3 / latency.frames);
+  atomic_store_explicit(&g_state.frameCaptureTime, 0, memory_order_relaxed);
+
   RENDERER(onRestart);
 
   if (g_state.state != APP_STATE_SHUTDOWN)
@@ -857,6 +1023,7 @@ int main_frameThread(void * unused)
         close(dmaInfo[i].fd);
   }
 
+  free(decodeBuffer);
   return 0;
 }
 
@@ -1200,9 +1367,11 @@ static int lg_run(void)
   g_state.renderTimings  = ringbuffer_new(256, sizeof(float));
   g_state.uploadTimings  = ringbuffer_new(256, sizeof(float));
   g_state.renderDuration = ringbuffer_new(256, sizeof(float));
-  overlayGraph_register("FRAME" , g_state.renderTimings , 0.0f, 50.0f, NULL);
-  overlayGraph_register("UPLOAD", g_state.uploadTimings , 0.0f, 50.0f, NULL);
-  overlayGraph_register("RENDER", g_state.renderDuration, 0.0f, 10.0f, NULL);
+  g_state.latencyTimings = ringbuffer_new(256, sizeof(float));
+  overlayGraph_register("FRAME"  , g_state.renderTimings , 0.0f,  50.0f, NULL);
+  overlayGraph_register("UPLOAD" , g_state.uploadTimings , 0.0f,  50.0f, NULL);
+  overlayGraph_register("RENDER" , g_state.renderDuration, 0.0f,  10.0f, NULL);
+  overlayGraph_register("LATENCY", g_state.latencyTimings, 0.0f, 100.0f, NULL);
 
   initImGuiKeyMap(g_state.io->KeyMap);
 
@@ -1340,6 +1509,13 @@ static int lg_run(void)
     g_params.allowDMA &&
     ivshmemHasDMA(&g_state.shm);
 
+  framebuffer_set_wait_mode(g_params.adaptiveWait ?
+      FB_WAIT_MODE_ADAPTIVE : FB_WAIT_MODE_SLEEP);
+
+  if (g_params.streamingReads &&
+      !framebuffer_set_read_method(FB_READ_STREAM))
+    DEBUG_WARN("Streaming reads are not supported by this CPU");
+
   // initialize the window dimensions at init for renderers
   g_state.windowW  = g_params.w;
   g_state.windowH  = g_params.h;
@@ -1592,6 +1768,7 @@ restart:
   DEBUG_INFO("Version  : %s", udata->hostver);
 
   /* parse the kvmfr records from the userdata */
+  clockSync_init(&g_state.hostClock, NULL);
   udataSize -= sizeof(*udata);
   uint8_t * p = (uint8_t *)(udata + 1);
   while(udataSize >= sizeof(KVMFRRecord))
@@ -1719,6 +1896,11 @@ restart:
         break;
       }
 
+      case KVMFR_RECORD_CLOCK:
+        if (record->size >= sizeof(KVMFRRecord_Clock))
+          clockSync_init(&g_state.hostClock, (KVMFRRecord_Clock *)p);
+        break;
+
       default:
         DEBUG_WARN("Unhandled KVMFRecord type: %d", record->type);
         break;
@@ -1833,6 +2015,7 @@ static void lg_shutdown(void)
   ringbuffer_free(&g_state.renderTimings);
   ringbuffer_free(&g_state.uploadTimings);
   ringbuffer_free(&g_state.renderDuration);
+  ringbuffer_free(&g_state.latencyTimings);
 
   free(g_state.fontName);
   ImVector_ImWchar_UnInit(&g_state.fontRange);
@@ -1878,6 +2061,7 @@ int main(int argc, char * argv[])
   app_registerOverlay(&LGOverlayAlert , NULL);
   app_registerOverlay(&LGOverlayFPS   , NULL);
   app_registerOverlay(&LGOverlayGraphs, NULL);
+  app_registerOverlay(&LGOverlayHostStats, NULL);
   app_registerOverlay(&LGOverlayHelp  , NULL);
   app_registerOverlay(&LGOverlayMsg   , NULL);
   app_registerOverlay(&LGOverlayStatus, NULL);
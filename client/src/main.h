@@ -29,6 +29,8 @@
 #include "common/thread.h"
 #include "common/types.h"
 #include "common/ivshmem.h"
+#include "common/KVMFR.h"
+#include "common/clocksync.h"
 #include "common/locking.h"
 #include "common/ringbuffer.h"
 #include "common/event.h"
@@ -140,11 +142,20 @@ struct AppState
   RingBuffer            renderTimings;
   RingBuffer            renderDuration;
   RingBuffer            uploadTimings;
+  RingBuffer            latencyTimings;
+
+  // maps the host's frame timestamps to microtime(), owned by the frame thread
+  ClockSync             hostClock;
+  // the local time the newest uploaded frame was captured, zero if unknown
+  atomic_uint_least64_t frameCaptureTime;
 
   atomic_uint_least64_t pendingCount;
   atomic_uint_least64_t renderCount, frameCount;
   _Atomic(float)        fps, ups;
 
+  // the host's performance counters in shared memory, NULL if not available
+  _Atomic(const KVMFRStats *) hostStats;
+
   uint64_t resizeTimeout;
   bool     resizeDone;
 
@@ -207,6 +218,8 @@ struct AppParams
   unsigned int         cursorPollInterval;
   unsigned int         framePollInterval;
   bool                 allowDMA;
+  bool                 adaptiveWait;
+  bool                 streamingReads;
 
   bool                 forceRenderer;
   unsigned int         forceRendererIndex;
@@ -0,0 +1,139 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/overlay.h"
+#include "cimgui.h"
+#include "overlay_utils.h"
+
+#include "common/histogram.h"
+#include "common/util.h"
+
+#include <inttypes.h>
+
+#include "../main.h"
+
+static bool showHostStats;
+
+static const char * stageNames[KVMFR_STAGE_MAX] =
+{
+  [KVMFR_STAGE_CAPTURE] = "Capture",
+  [KVMFR_STAGE_WAIT   ] = "Wait",
+  [KVMFR_STAGE_COPY   ] = "Copy",
+  [KVMFR_STAGE_QUEUE  ] = "Queue",
+  [KVMFR_STAGE_POINTER] = "Pointer"
+};
+
+static void showHostStatsKeybind(int sc, void * opaque)
+{
+  showHostStats ^= true;
+  app_invalidateWindow(false);
+}
+
+static bool hostStats_init(void ** udata, const void * params)
+{
+  app_registerKeybind(0, 'H', showHostStatsKeybind, NULL,
+      "Show host performance statistics");
+  return true;
+}
+
+static void hostStats_free(void * udata)
+{
+}
+
+static int hostStats_render(void * udata, bool interactive,
+    struct Rect * windowRects, int maxRects)
+{
+  if (!showHostStats)
+    return 0;
+
+  const KVMFRStats * stats =
+    atomic_load_explicit(&g_state.hostStats, memory_order_relaxed);
+
+  ImVec2 pos = {0.0f, 0.0f};
+  igSetNextWindowBgAlpha(0.6f);
+  igSetNextWindowPos(pos, ImGuiCond_FirstUseEver, pos);
+
+  ImGuiWindowFlags flags =
+    ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoFocusOnAppearing |
+    ImGuiWindowFlags_NoNav;
+  if (!interactive)
+    flags |= ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoDecoration;
+
+  igBegin("Host Performance", NULL, flags);
+
+  if (!stats || stats->size < sizeof(*stats))
+  {
+    igText("The host does not provide performance statistics");
+    overlayGetImGuiRect(windowRects);
+    igEnd();
+    return 1;
+  }
+
+  if (igBeginTable("Stages", 5, 0, (ImVec2) { 0.0f, 0.0f }, 0.0f))
+  {
+    igTableSetupColumn("Stage (ms)", 0, 0.0f, 0);
+    igTableSetupColumn("avg"       , 0, 0.0f, 0);
+    igTableSetupColumn("p50"       , 0, 0.0f, 0);
+    igTableSetupColumn("p99"       , 0, 0.0f, 0);
+    igTableSetupColumn("max"       , 0, 0.0f, 0);
+    igTableHeadersRow();
+
+    const unsigned int stages = min(stats->stages, KVMFR_STAGE_MAX);
+    for(unsigned int i = 0; i < stages; ++i)
+    {
+      const KVMFRHistogram * hist = &stats->stage[i];
+      const uint64_t count = hist->count;
+
+      igTableNextColumn();
+      igText("%s", stageNames[i]);
+      igTableNextColumn();
+      igText("%.3f", count ? hist->sum / 1000.0 / count : 0.0);
+      igTableNextColumn();
+      igText("%.3f", histogram_percentile(hist, 50.0) / 1000.0);
+      igTableNextColumn();
+      igText("%.3f", histogram_percentile(hist, 99.0) / 1000.0);
+      igTableNextColumn();
+      igText("%.3f", hist->max / 1000.0);
+    }
+
+    igEndTable();
+  }
+
+  const uint64_t sent  = stats->framesSent;
+  const uint64_t total = stats->pixelsTotal;
+  igText("Frames: %" PRIu64 " sent, %" PRIu64 " dropped, %" PRIu64
+      " with the queue full", sent, stats->framesDropped, stats->queueFull);
+  igText("Copied: %.2f MiB, damage %.1f%%",
+      stats->bytesCopied / 1048576.0,
+      total ? stats->pixelsDamaged * 100.0 / total : 100.0);
+
+  overlayGetImGuiRect(windowRects);
+  igEnd();
+
+  return 1;
+}
+
+struct LG_OverlayOps LGOverlayHostStats =
+{
+  .name           = "HostStats",
+  .init           = hostStats_init,
+  .free           = hostStats_free,
+  .render         = hostStats_render
+};
@@ -37,6 +37,7 @@ extern struct LG_OverlayOps LGOverlaySplash;
 extern struct LG_OverlayOps LGOverlayAlert;
 extern struct LG_OverlayOps LGOverlayFPS;
 extern struct LG_OverlayOps LGOverlayGraphs;
+extern struct LG_OverlayOps LGOverlayHostStats;
 extern struct LG_OverlayOps LGOverlayHelp;
 extern struct LG_OverlayOps LGOverlayConfig;
 extern struct LG_OverlayOps LGOverlayMsg;
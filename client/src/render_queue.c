@@ -171,7 +171,7 @@ void renderQueue_process(void)
         RENDERER(onMouseShape,
             cmd->cursorImage.monochrome ? LG_CURSOR_MONOCHROME : LG_CURSOR_COLOR,
             cmd->cursorImage.width, cmd->cursorImage.height,
-            cmd->cursorImage.pitch, cmd->cursorImage.data);
+            cmd->cursorImage.pitch, 0, cmd->cursorImage.data);
         free(cmd->cursorImage.data);
     }
     free(cmd);
@@ -28,7 +28,7 @@
 #include "types.h"
 
 #define KVMFR_MAGIC   "KVMFR---"
-#define KVMFR_VERSION 20
+#define KVMFR_VERSION 22
 
 #define KVMFR_MAX_DAMAGE_RECTS 64
 
@@ -38,6 +38,11 @@
 #define LGMP_Q_FRAME_LEN   2
 #define LGMP_Q_POINTER_LEN 20
 
+// the host may be configured to use a deeper frame queue, and keeps one more
+// frame buffer than the queue length so it can capture while the queue is full
+#define LGMP_Q_FRAME_LEN_MAX     8
+#define LGMP_Q_FRAME_BUFFERS_MAX (LGMP_Q_FRAME_LEN_MAX + 1)
+
 
 #ifdef _MSC_VER
  // don't warn on zero length arrays
@@ -89,7 +94,8 @@ KVMFRRecord;
 enum
 {
   KVMFR_RECORD_VMINFO = 1,
-  KVMFR_RECORD_OSINFO
+  KVMFR_RECORD_OSINFO,
+  KVMFR_RECORD_CLOCK
 };
 
 typedef enum
@@ -120,6 +126,16 @@ typedef struct KVMFRRecord_OSInfo
 }
 KVMFRRecord_OSInfo;
 
+/* The host's frame timestamp clock (monotonic microseconds) sampled together
+ * with its wall clock (microseconds since the unix epoch). Clients use this
+ * for an initial estimate of the offset to their own clock. */
+typedef struct KVMFRRecord_Clock
+{
+  uint64_t monotonic;
+  uint64_t realtime;
+}
+KVMFRRecord_Clock;
+
 typedef struct KVMFRCursor
 {
   int16_t    x, y;        // cursor x & y position
@@ -128,16 +144,31 @@ typedef struct KVMFRCursor
   uint32_t   width;       // width of the shape
   uint32_t   height;      // height of the shape
   uint32_t   pitch;       // row length in bytes of the shape
+  uint32_t   shapeID;     // content ID of the shape, zero if unknown
+  uint32_t   posOffset;   // offset of the KVMFRCursorPos in shared memory, zero if none
 }
 KVMFRCursor;
 
+/* The latest cursor position, the host updates it for every move and only
+ * posts pointer messages for shape and visibility changes when it is present.
+ * `seq` is odd while the position is being written, readers must retry if it
+ * is odd or changes while reading. */
+typedef struct KVMFRCursorPos
+{
+  uint32_t seq;
+  int16_t  x, y;
+}
+KVMFRCursorPos;
+
 enum
 {
   FRAME_FLAG_BLOCK_SCREENSAVER  = 0x1 ,
   FRAME_FLAG_REQUEST_ACTIVATION = 0x2 ,
   FRAME_FLAG_TRUNCATED          = 0x4 , // ivshmem was too small for the frame
   FRAME_FLAG_HDR                = 0x8 , // RGBA10 may not be HDR
-  FRAME_FLAG_HDR_PQ             = 0x10  // HDR PQ has been applied to the frame
+  FRAME_FLAG_HDR_PQ             = 0x10, // HDR PQ has been applied to the frame
+  FRAME_FLAG_DAMAGE_EXT         = 0x20, // a KVMFRDamage record follows the header
+  FRAME_FLAG_COMPRESSED         = 0x40  // the frame buffer holds a KVMFRCodec stream
 };
 
 typedef uint32_t KVMFRFrameFlags;
@@ -154,15 +185,119 @@ typedef struct KVMFRFrame
   uint32_t        frameWidth;         // the unpacked frame width
   uint32_t        frameHeight;        // the unpacked frame height
   FrameRotation   rotation;           // the frame rotation
-  uint32_t        stride;             // the row stride (zero if compressed data)
-  uint32_t        pitch;              // the row pitch  (stride in bytes or the compressed frame size)
+  uint32_t        stride;             // the row stride
+  uint32_t        pitch;              // the row pitch (stride in bytes)
   uint32_t        offset;             // offset from the start of this header to the FrameBuffer header
-  uint32_t        damageRectsCount;   // the number of damage rectangles (zero for full-frame damage)
+  uint32_t        damageRectsCount;   // the number of damage rectangles (zero for full-frame damage or FRAME_FLAG_DAMAGE_EXT)
   FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
   KVMFRFrameFlags flags;              // bit field combination of FRAME_FLAG_*
+  uint32_t        statsOffset;        // offset of the KVMFRStats in shared memory, zero if none
+  uint64_t        captureTime;        // host time the frame was captured in microseconds
+  uint64_t        postTime;           // host time the frame was posted in microseconds
 }
 KVMFRFrame;
 
+enum
+{
+  KVMFR_DAMAGE_RECTS = 1, // data is an array of KVMFRDamageRect
+  KVMFR_DAMAGE_TILES      // data is a row-major bitmap of damaged tiles
+};
+
+typedef struct KVMFRDamageRect
+{
+  uint16_t x, y, width, height;
+}
+KVMFRDamageRect;
+
+/* The extended damage record for frames that have more than
+ * KVMFR_MAX_DAMAGE_RECTS damage rects. It is placed directly after the
+ * KVMFRFrame header and must end before the FrameBuffer at `offset`. */
+typedef struct KVMFRDamage
+{
+  uint16_t type;     // KVMFR_DAMAGE_*
+  uint16_t tileSize; // the tile size in pixels (KVMFR_DAMAGE_TILES)
+  uint16_t columns;  // the number of tiles per row (KVMFR_DAMAGE_TILES)
+  uint16_t rows;     // the number of tile rows (KVMFR_DAMAGE_TILES)
+  uint32_t count;    // the number of rects (KVMFR_DAMAGE_RECTS)
+  uint8_t  data[];
+}
+KVMFRDamage;
+
+enum
+{
+  KVMFR_CODEC_RAW = 1, // the band rows are stored as is
+  KVMFR_CODEC_RUNS     // the band rows are stored as runs, see below
+};
+
+/* Frames with FRAME_FLAG_COMPRESSED set carry a KVMFRCodecHeader in the
+ * FrameBuffer followed by a sequence of KVMFRCodecBlock bands that are
+ * published as they are written, a band with zero rows ends the stream early.
+ * The frame's `stride` and `pitch` describe the decoded frame.
+ *
+ * KVMFR_CODEC_RUNS rows are a sequence of uint32_t tokens, if the top bit is
+ * set the low bits are the count of literal 32-bit words that follow,
+ * otherwise they are the count of words that are unchanged from the row
+ * above. Tokens never span rows. */
+typedef struct KVMFRCodecHeader
+{
+  uint32_t rowBytes; // the number of encoded bytes per row
+  uint32_t rows;     // the number of rows in the frame
+}
+KVMFRCodecHeader;
+
+typedef struct KVMFRCodecBlock
+{
+  uint32_t size;     // the size of the band data that follows in bytes
+  uint16_t rows;     // the number of rows in the band
+  uint16_t mode;     // KVMFR_CODEC_*
+}
+KVMFRCodecBlock;
+
+#define KVMFR_HISTOGRAM_SUB_BITS 3
+#define KVMFR_HISTOGRAM_BUCKETS  160
+
+/* A log-linear histogram of durations in microseconds. Values below
+ * (1 << KVMFR_HISTOGRAM_SUB_BITS) have a bucket each, above that every power
+ * of two is split into (1 << KVMFR_HISTOGRAM_SUB_BITS) buckets, giving a
+ * relative error of at most 12.5% up to ~4 seconds. Larger values are
+ * counted in the last bucket. See common/histogram.h */
+typedef struct KVMFRHistogram
+{
+  uint64_t count;                            // the number of values recorded
+  uint64_t sum;                              // the sum of the values recorded
+  uint32_t max;                              // the largest value recorded
+  uint32_t buckets[KVMFR_HISTOGRAM_BUCKETS];
+}
+KVMFRHistogram;
+
+enum
+{
+  KVMFR_STAGE_CAPTURE, // the capture call, waiting for the guest to present
+  KVMFR_STAGE_WAIT,    // waiting for the captured frame to become available
+  KVMFR_STAGE_COPY,    // copying the frame into shared memory
+  KVMFR_STAGE_QUEUE,   // waiting for the client to release a frame slot
+  KVMFR_STAGE_POINTER, // posting a pointer update
+
+  KVMFR_STAGE_MAX
+};
+
+/* Host performance counters, updated live by the host and never reset while
+ * the shared memory is in use. Readers must expect values to be mid update,
+ * the counters are only ever incremented. */
+typedef struct KVMFRStats
+{
+  uint32_t       size;          // sizeof(KVMFRStats) as known to the host
+  uint32_t       stages;        // the number of entries in `stage`
+  uint64_t       framesSent;    // frames posted to the client
+  uint64_t       framesDropped; // frames replaced before they were posted
+  uint64_t       queueFull;     // frames captured while the queue was full
+  uint64_t       bytesCopied;   // frame bytes written to shared memory
+  uint64_t       pixelsDamaged; // the area of the damage of every frame
+  uint64_t       pixelsTotal;   // the area of every frame
+  KVMFRHistogram stage[KVMFR_STAGE_MAX];
+}
+KVMFRStats;
+
 typedef struct KVMFRMessage
 {
   KVMFRMessageType type;
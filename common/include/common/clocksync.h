@@ -0,0 +1,60 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _LG_COMMON_CLOCKSYNC_H_
+#define _LG_COMMON_CLOCKSYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/KVMFR.h"
+
+/* Maps the host's frame timestamps onto the local microtime() clock. The
+ * estimate is seeded from the KVMFRRecord_Clock wall clock pair and refined
+ * from the frames themselves, as a frame can not be received before it was
+ * posted the smallest post to receive delay is taken as zero. */
+typedef struct ClockSync
+{
+  bool     valid;
+  int64_t  offset;     // add to a host time to get the local time
+  int64_t  windowMin;  // the smallest delay seen in the current window
+  uint64_t windowEnd;
+}
+ClockSync;
+
+/**
+ * Seed the offset from the host's clock record, `clock` may be NULL in which
+ * case the first sample is used.
+ */
+void clockSync_init(ClockSync * cs, const KVMFRRecord_Clock * clock);
+
+/**
+ * Refine the offset with the host time a frame was posted and the local time
+ * it was received.
+ */
+void clockSync_sample(ClockSync * cs, uint64_t hostTime, uint64_t localTime);
+
+static inline uint64_t clockSync_toLocal(const ClockSync * cs,
+    uint64_t hostTime)
+{
+  return hostTime + cs->offset;
+}
+
+#endif
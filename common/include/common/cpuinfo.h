@@ -38,6 +38,7 @@ typedef struct
   bool aes;
   bool xsave, osxsave;
   bool avx, avx2;
+  bool avx512f, avx512bw;
   bool bmi1, bmi2;
 }
 CPUInfoFeatures;
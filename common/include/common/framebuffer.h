@@ -28,15 +28,48 @@
 
 #define FB_CHUNK_SIZE           1048576 // 1MB
 #define FB_SPIN_LIMIT           10000   // 10ms
+#define FB_WAIT_SPIN_TIME       20      // μs to busy wait before blocking
+#define FB_WAIT_BLOCK_TIME      100     // max μs to block before re-checking
+#define FB_WAIT_TIMEOUT         10000   // 10ms
+#define FB_MAX_WRITE_THREADS    16
 #define FB_WP_TYPE              atomic_uint_least32_t
 #define FB_WP_SIZE              sizeof(FB_WP_TYPE)
 
 typedef struct stFrameBuffer
 {
-  FB_WP_TYPE wp;
-  uint8_t    data[0];
+  FB_WP_TYPE            wp;
+  atomic_uint_least32_t waiters; // readers blocked on `wp`
+  uint8_t               data[0];
 } FrameBuffer;
 
+typedef enum FrameBufferWaitMode
+{
+  FB_WAIT_MODE_SLEEP,   // poll the write pointer with short sleeps
+  FB_WAIT_MODE_ADAPTIVE // spin briefly, then block on the write pointer
+}
+FrameBufferWaitMode;
+
+typedef struct FrameBufferWaitStats
+{
+  uint64_t waits;       // number of waits that were not immediately satisfied
+  uint64_t spinWaits;   // number of waits satisfied while spinning
+  uint64_t blockWaits;  // number of waits satisfied after blocking
+  uint64_t timeouts;    // number of waits that timed out
+  uint64_t spinTimeNs;  // total time spent spinning
+  uint64_t blockTimeNs; // total time spent blocked
+}
+FrameBufferWaitStats;
+
+typedef enum FrameBufferReadMethod
+{
+  FB_READ_MEMCPY, // the default
+  FB_READ_STREAM, // the widest streaming load kernel supported by the CPU
+  FB_READ_SSE4_1,
+  FB_READ_AVX2,
+  FB_READ_AVX512
+}
+FrameBufferReadMethod;
+
 typedef bool (*FrameBufferReadFn)(void * opaque, const void * src, size_t size);
 
 /**
@@ -44,6 +77,35 @@ typedef bool (*FrameBufferReadFn)(void * opaque, const void * src, size_t size);
  */
 bool framebuffer_wait(const FrameBuffer * frame, size_t size);
 
+/**
+ * Select how readers wait for the writer, the default is to sleep
+ */
+void framebuffer_set_wait_mode(FrameBufferWaitMode mode);
+
+/**
+ * Get the wait statistics accumulated by all readers in this process
+ */
+void framebuffer_get_wait_stats(FrameBufferWaitStats * stats);
+
+/**
+ * Reset the accumulated wait statistics
+ */
+void framebuffer_reset_wait_stats(void);
+
+/**
+ * Select the copy routine used by the framebuffer_read functions, the
+ * streaming load methods are only faster on write-combined mappings.
+ * Returns false if the CPU does not support the requested method.
+ */
+bool framebuffer_set_read_method(FrameBufferReadMethod method);
+
+/**
+ * Copy data out of the framebuffer using the selected read method.
+ * For custom read routines only.
+ */
+extern void (*framebuffer_read_copy)(void * restrict dst,
+    const void * restrict src, size_t size);
+
 /**
  * Read `size` bytes from the KVMFRFrame into the dst buffer
  */
@@ -73,6 +135,13 @@ void framebuffer_prepare(FrameBuffer * frame);
 extern bool (*framebuffer_write)(FrameBuffer * frame,
     const void * restrict src, size_t size);
 
+/**
+ * Set the number of threads framebuffer_write uses to copy large frames, a
+ * value less then two selects the single threaded writer.
+ * Must not be called while a write is in progress.
+ */
+bool framebuffer_set_write_threads(unsigned int threads);
+
 /**
  * Gets the underlying data buffer of the framebuffer.
  * For custom read routines only.
@@ -0,0 +1,61 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _LG_COMMON_FRAMECODEC_H_
+#define _LG_COMMON_FRAMECODEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/framebuffer.h"
+
+// the number of rows encoded per KVMFRCodecBlock
+#define FRAMECODEC_BAND_ROWS 8
+
+/**
+ * Get the worst case encoded size of a frame, this is slightly larger than
+ * the raw frame data
+ */
+size_t frameCodec_maxSize(size_t rowBytes, unsigned int rows);
+
+/**
+ * Encode `rows` rows of `rowBytes` from `src` into the frame buffer,
+ * publishing each band as soon as it has been written so the reader can
+ * decode it while the rest of the frame is encoded.
+ *
+ * If the stream would exceed `maxSize` it is ended early, the remaining rows
+ * are not sent. Returns the number of bytes written.
+ */
+size_t frameCodec_encode(FrameBuffer * frame, size_t maxSize,
+    const uint8_t * src, size_t srcPitch, size_t rowBytes, unsigned int rows);
+
+/**
+ * Decode a stream written by frameCodec_encode into `dst`, waiting on the
+ * frame buffer for each band as it arrives. Rows that were not sent are left
+ * untouched.
+ *
+ * Returns false if the stream is invalid, does not fit `dst` or the writer
+ * stalled. `rows` is set to the number of rows decoded.
+ */
+bool frameCodec_decode(const FrameBuffer * frame, size_t maxSize,
+    uint8_t * dst, size_t dstPitch, unsigned int maxRows, unsigned int * rows);
+
+#endif
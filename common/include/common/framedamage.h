@@ -0,0 +1,54 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _LG_COMMON_FRAMEDAMAGE_H_
+#define _LG_COMMON_FRAMEDAMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common/KVMFR.h"
+#include "common/types.h"
+
+// the maximum number of damage rects the host will send for a single frame
+#define FRAMEDAMAGE_MAX_RECTS 4096
+
+/**
+ * Store the damage rects in the frame header. Sets with up to
+ * KVMFR_MAX_DAMAGE_RECTS rects are stored inline, larger sets are stored in a
+ * KVMFRDamage record after the header, first as rects and then as a tile
+ * bitmap if the rects do not fit. If neither fits the frame is marked as fully
+ * damaged.
+ *
+ * `frame->offset`, `frameWidth` and `frameHeight` must be set beforehand.
+ */
+void frameDamage_encode(KVMFRFrame * frame,
+    const FrameDamageRect * rects, unsigned int count);
+
+/**
+ * Read the damage rects from the frame header into `rects`.
+ *
+ * Returns the number of rects, or zero for full frame damage, which is also
+ * returned if more than `maxRects` rects would be needed.
+ */
+unsigned int frameDamage_decode(const KVMFRFrame * frame,
+    FrameDamageRect * rects, unsigned int maxRects);
+
+#endif
@@ -0,0 +1,41 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _LG_COMMON_HISTOGRAM_H_
+#define _LG_COMMON_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include "common/KVMFR.h"
+
+/**
+ * Record a value in microseconds. Each histogram must only have a single
+ * writer, readers may run concurrently.
+ */
+void histogram_record(KVMFRHistogram * hist, uint64_t value);
+
+/**
+ * Returns the value at or below which `percentile` (0-100) of the recorded
+ * values fall, rounded up to the top of its bucket. Safe to call while the
+ * histogram is being written to.
+ */
+uint64_t histogram_percentile(const KVMFRHistogram * hist, double percentile);
+
+#endif
@@ -42,4 +42,25 @@ void rectsFramebufferToBuffer(FrameDamageRect * rects, int count, int bpp,
 int rectsMergeOverlapping(FrameDamageRect * rects, int count);
 int rectsRejectContained(FrameDamageRect * rects, int count);
 
+/**
+ * Exact region operations, the resulting rects do not overlap.
+ *
+ * Returns the number of rects written to `out`, or -1 if more than `maxOut`
+ * rects are required or the scratch buffers could not be allocated.
+ */
+int rectsUnion(const FrameDamageRect * rects, int count,
+    FrameDamageRect * out, int maxOut);
+int rectsSubtract(const FrameDamageRect * a, int countA,
+    const FrameDamageRect * b, int countB,
+    FrameDamageRect * out, int maxOut);
+
+/**
+ * Reduce the rects to at most `maxRects` rects that cover at least the same
+ * area, merging the rects that add the least extra area first. The result may
+ * contain overlapping rects.
+ *
+ * Returns the new number of rects.
+ */
+int rectsCoalesce(FrameDamageRect * rects, int count, int maxRects);
+
 #endif
@@ -60,6 +60,22 @@ static inline uint64_t microtime(void)
 #endif
 }
 
+// the wall clock time in microseconds since the unix epoch
+static inline uint64_t wallmicrotime(void)
+{
+#if defined(_WIN32)
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  const uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  // FILETIME is in 100ns intervals since 1601-01-01
+  return t / 10LL - 11644473600000000LL;
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_REALTIME, &time);
+  return (uint64_t)time.tv_sec * 1000000LL + time.tv_nsec / 1000LL;
+#endif
+}
+
 static inline void nsleep(uint64_t ns)
 {
 #if defined(_WIN32)
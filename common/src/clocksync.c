@@ -0,0 +1,76 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/clocksync.h"
+#include "common/time.h"
+
+// how often the offset is corrected to the smallest delay seen
+#define CLOCKSYNC_WINDOW_US 5000000
+
+void clockSync_init(ClockSync * cs, const KVMFRRecord_Clock * clock)
+{
+  cs->windowMin = INT64_MAX;
+  cs->windowEnd = 0;
+
+  if (!clock)
+  {
+    cs->valid  = false;
+    cs->offset = 0;
+    return;
+  }
+
+  /* host monotonic -> wall clock -> local monotonic, this is only as good as
+   * the synchronisation of the two wall clocks */
+  const int64_t localOffset = (int64_t)(microtime() - wallmicrotime());
+  cs->offset = (int64_t)(clock->realtime - clock->monotonic) + localOffset;
+  cs->valid  = true;
+}
+
+void clockSync_sample(ClockSync * cs, uint64_t hostTime, uint64_t localTime)
+{
+  if (!cs->valid)
+  {
+    cs->offset    = (int64_t)(localTime - hostTime);
+    cs->valid     = true;
+    cs->windowEnd = localTime + CLOCKSYNC_WINDOW_US;
+  }
+
+  int64_t delay = (int64_t)(localTime - hostTime) - cs->offset;
+
+  // the frame arrived before it was sent, the offset is too large
+  if (delay < 0)
+  {
+    cs->offset += delay;
+    delay       = 0;
+  }
+
+  if (delay < cs->windowMin)
+    cs->windowMin = delay;
+
+  if (localTime < cs->windowEnd)
+    return;
+
+  // the offset is too small by at least the smallest delay in the window
+  if (cs->windowEnd)
+    cs->offset += cs->windowMin;
+
+  cs->windowMin = INT64_MAX;
+  cs->windowEnd = localTime + CLOCKSYNC_WINDOW_US;
+}
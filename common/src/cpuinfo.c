@@ -84,7 +84,9 @@ const CPUInfoFeatures * cpuInfo_getFeatures(void)
     : "a" (7), "c" (0)
   );
 
-  features.avx2 = cpuid[1] & (1 << 5);
+  features.avx2     = cpuid[1] & (1 <<  5);
+  features.avx512f  = cpuid[1] & (1 << 16);
+  features.avx512bw = cpuid[1] & (1 << 30);
   features.bmi1 = cpuid[2] & (1 << 3);
   features.bmi2 = cpuid[2] & (1 << 8);
 
@@ -104,6 +106,18 @@ const CPUInfoFeatures * cpuInfo_getFeatures(void)
       features.avx  = false;
       features.avx2 = false;
     }
+
+    // the OS must also save the opmask and upper ZMM registers
+    if ((xgetbv & 0xe0) != 0xe0)
+    {
+      features.avx512f  = false;
+      features.avx512bw = false;
+    }
+  }
+  else
+  {
+    features.avx512f  = false;
+    features.avx512bw = false;
   }
 
   return &features;
@@ -21,6 +21,10 @@
 #include "common/framebuffer.h"
 #include "common/cpuinfo.h"
 #include "common/debug.h"
+#include "common/time.h"
+#include "common/util.h"
+#include "common/event.h"
+#include "common/thread.h"
 
 //#define FB_PROFILE
 #ifdef FB_PROFILE
@@ -33,7 +37,96 @@
 #include <immintrin.h>
 #include <unistd.h>
 
-bool framebuffer_wait(const FrameBuffer * frame, size_t size)
+#if defined(__linux__)
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static FrameBufferWaitMode fbWaitMode = FB_WAIT_MODE_SLEEP;
+
+// set if the futex can not be used on the shared memory mapping
+static _Atomic(bool) fbFutexFailed = false;
+
+static struct
+{
+  _Atomic(uint64_t) waits;
+  _Atomic(uint64_t) spinWaits;
+  _Atomic(uint64_t) blockWaits;
+  _Atomic(uint64_t) timeouts;
+  _Atomic(uint64_t) spinTimeNs;
+  _Atomic(uint64_t) blockTimeNs;
+}
+fbWaitStats = { 0 };
+
+inline static void fbStatAdd(_Atomic(uint64_t) * stat, uint64_t value)
+{
+  atomic_fetch_add_explicit(stat, value, memory_order_relaxed);
+}
+
+#if defined(__linux__)
+/* the futex is not process private as the framebuffer lives in shared memory
+ * that may be mapped by both the reader and the writer. Mappings such as the
+ * kvmfr device pages can not back a shared futex, if the wait fails for any
+ * reason other than a wake, a changed value or the timeout it is disabled. */
+inline static bool fbBlock(const FrameBuffer * frame, uint32_t wp,
+    unsigned int us)
+{
+  if (atomic_load_explicit(&fbFutexFailed, memory_order_relaxed))
+    return false;
+
+  const struct timespec ts =
+  {
+    .tv_sec  = 0,
+    .tv_nsec = us * 1000L
+  };
+
+  /* the count is in the shared header so a writer in another process can see
+   * it, a writer in another VM can not wake us but the wait is bounded */
+  FrameBuffer * fb = (FrameBuffer *)frame;
+  atomic_fetch_add_explicit(&fb->waiters, 1, memory_order_seq_cst);
+  const long ret = syscall(SYS_futex, &frame->wp, FUTEX_WAIT, wp, &ts,
+      NULL, 0);
+  const int err = errno;
+  atomic_fetch_sub_explicit(&fb->waiters, 1, memory_order_relaxed);
+
+  if (ret == 0 || err == EAGAIN || err == ETIMEDOUT || err == EINTR)
+    return true;
+
+  DEBUG_WARN("Unable to block on the frame buffer (%s), "
+      "falling back to polling", strerror(err));
+  atomic_store_explicit(&fbFutexFailed, true, memory_order_relaxed);
+  return false;
+}
+
+inline static void fbWake(FrameBuffer * frame)
+{
+  // skip the syscall unless a reader on this machine is blocked
+  if (atomic_load_explicit(&frame->waiters, memory_order_seq_cst) == 0)
+    return;
+
+  syscall(SYS_futex, &frame->wp, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+inline static bool fbBlock(const FrameBuffer * frame, uint32_t wp,
+    unsigned int us)
+{
+  return false;
+}
+
+inline static void fbWake(FrameBuffer * frame)
+{
+}
+#endif
+
+inline static void fbPublish(FrameBuffer * frame, size_t wp)
+{
+  atomic_store_explicit(&frame->wp, wp, memory_order_seq_cst);
+  fbWake(frame);
+}
+
+static bool framebuffer_wait_sleep(const FrameBuffer * frame, size_t size)
 {
   while(atomic_load_explicit(&frame->wp, memory_order_acquire) < size)
   {
@@ -49,6 +142,275 @@ bool framebuffer_wait(const FrameBuffer * frame, size_t size)
   return true;
 }
 
+static bool framebuffer_wait_adaptive(const FrameBuffer * frame, size_t size)
+{
+  fbStatAdd(&fbWaitStats.waits, 1);
+
+  /* spin for a short time first, the writer is usually only a few cache lines
+   * ahead of us and a context switch costs far more than this */
+  const uint64_t start    = nanotime();
+  const uint64_t spinEnd  = start + FB_WAIT_SPIN_TIME  * 1000ULL;
+  const uint64_t deadline = start + FB_WAIT_TIMEOUT    * 1000ULL;
+  uint64_t now;
+  uint32_t wp;
+
+  do
+  {
+    for(int i = 0; i < 64; ++i)
+    {
+      if (atomic_load_explicit(&frame->wp, memory_order_acquire) >= size)
+      {
+        fbStatAdd(&fbWaitStats.spinWaits, 1);
+        fbStatAdd(&fbWaitStats.spinTimeNs, nanotime() - start);
+        return true;
+      }
+      _mm_pause();
+    }
+    now = nanotime();
+  }
+  while(now < spinEnd);
+
+  fbStatAdd(&fbWaitStats.spinTimeNs, now - start);
+
+  /* block until the writer wakes us or the block time expires, the timeout is
+   * required as the writer may be in another VM and unable to wake us */
+  const uint64_t blockStart = now;
+  while((wp = atomic_load_explicit(&frame->wp, memory_order_acquire)) < size)
+  {
+    if (now >= deadline)
+    {
+      fbStatAdd(&fbWaitStats.timeouts   , 1);
+      fbStatAdd(&fbWaitStats.blockTimeNs, now - blockStart);
+      return false;
+    }
+
+    if (!fbBlock(frame, wp, FB_WAIT_BLOCK_TIME))
+      usleep(1);
+    now = nanotime();
+  }
+
+  fbStatAdd(&fbWaitStats.blockWaits , 1);
+  fbStatAdd(&fbWaitStats.blockTimeNs, nanotime() - blockStart);
+  return true;
+}
+
+bool framebuffer_wait(const FrameBuffer * frame, size_t size)
+{
+  if (likely(atomic_load_explicit(&frame->wp, memory_order_acquire) >= size))
+    return true;
+
+  if (fbWaitMode == FB_WAIT_MODE_SLEEP)
+    return framebuffer_wait_sleep(frame, size);
+
+  return framebuffer_wait_adaptive(frame, size);
+}
+
+void framebuffer_set_wait_mode(FrameBufferWaitMode mode)
+{
+  fbWaitMode = mode;
+}
+
+void framebuffer_get_wait_stats(FrameBufferWaitStats * stats)
+{
+  stats->waits       = atomic_load_explicit(&fbWaitStats.waits      , memory_order_relaxed);
+  stats->spinWaits   = atomic_load_explicit(&fbWaitStats.spinWaits  , memory_order_relaxed);
+  stats->blockWaits  = atomic_load_explicit(&fbWaitStats.blockWaits , memory_order_relaxed);
+  stats->timeouts    = atomic_load_explicit(&fbWaitStats.timeouts   , memory_order_relaxed);
+  stats->spinTimeNs  = atomic_load_explicit(&fbWaitStats.spinTimeNs , memory_order_relaxed);
+  stats->blockTimeNs = atomic_load_explicit(&fbWaitStats.blockTimeNs, memory_order_relaxed);
+}
+
+void framebuffer_reset_wait_stats(void)
+{
+  atomic_store_explicit(&fbWaitStats.waits      , 0, memory_order_relaxed);
+  atomic_store_explicit(&fbWaitStats.spinWaits  , 0, memory_order_relaxed);
+  atomic_store_explicit(&fbWaitStats.blockWaits , 0, memory_order_relaxed);
+  atomic_store_explicit(&fbWaitStats.timeouts   , 0, memory_order_relaxed);
+  atomic_store_explicit(&fbWaitStats.spinTimeNs , 0, memory_order_relaxed);
+  atomic_store_explicit(&fbWaitStats.blockTimeNs, 0, memory_order_relaxed);
+}
+
+static void framebuffer_read_memcpy(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+/* The streaming load kernels below use (v)movntdqa which on write-combining
+ * memory, such as the ivshmem BAR, fetches a full line into a streaming load
+ * buffer instead of performing a series of uncached reads. On normal write-back
+ * memory they are no faster than memcpy, which is why memcpy is the default.
+ * The loads must be aligned so any unaligned head is copied with memcpy. */
+
+static void framebuffer_read_sse4_1(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  uint8_t       * restrict d = (uint8_t *)dst;
+  const uint8_t * restrict s = (const uint8_t *)src;
+
+  const size_t head = min((size_t)((16 - ((uintptr_t)s & 15)) & 15), size);
+  memcpy(d, s, head);
+  d    += head;
+  s    += head;
+  size -= head;
+
+  while(size > 63)
+  {
+    __m128i v1 = _mm_stream_load_si128((__m128i *)s + 0);
+    __m128i v2 = _mm_stream_load_si128((__m128i *)s + 1);
+    __m128i v3 = _mm_stream_load_si128((__m128i *)s + 2);
+    __m128i v4 = _mm_stream_load_si128((__m128i *)s + 3);
+
+    _mm_storeu_si128((__m128i *)d + 0, v1);
+    _mm_storeu_si128((__m128i *)d + 1, v2);
+    _mm_storeu_si128((__m128i *)d + 2, v3);
+    _mm_storeu_si128((__m128i *)d + 3, v4);
+
+    s    += 64;
+    d    += 64;
+    size -= 64;
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
+
+#ifdef __clang__
+  #pragma clang attribute push (__attribute__((target("avx2"))), apply_to=function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target ("avx2")
+#endif
+static void framebuffer_read_avx2(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  uint8_t       * restrict d = (uint8_t *)dst;
+  const uint8_t * restrict s = (const uint8_t *)src;
+
+  const size_t head = min((size_t)((32 - ((uintptr_t)s & 31)) & 31), size);
+  memcpy(d, s, head);
+  d    += head;
+  s    += head;
+  size -= head;
+
+  while(size > 127)
+  {
+    __m256i v1 = _mm256_stream_load_si256((__m256i *)s + 0);
+    __m256i v2 = _mm256_stream_load_si256((__m256i *)s + 1);
+    __m256i v3 = _mm256_stream_load_si256((__m256i *)s + 2);
+    __m256i v4 = _mm256_stream_load_si256((__m256i *)s + 3);
+
+    _mm256_storeu_si256((__m256i *)d + 0, v1);
+    _mm256_storeu_si256((__m256i *)d + 1, v2);
+    _mm256_storeu_si256((__m256i *)d + 2, v3);
+    _mm256_storeu_si256((__m256i *)d + 3, v4);
+
+    s    += 128;
+    d    += 128;
+    size -= 128;
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
+#ifdef __clang__
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+#ifdef __clang__
+  #pragma clang attribute push (__attribute__((target("avx512f"))), apply_to=function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target ("avx512f")
+#endif
+static void framebuffer_read_avx512(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  uint8_t       * restrict d = (uint8_t *)dst;
+  const uint8_t * restrict s = (const uint8_t *)src;
+
+  const size_t head = min((size_t)((64 - ((uintptr_t)s & 63)) & 63), size);
+  memcpy(d, s, head);
+  d    += head;
+  s    += head;
+  size -= head;
+
+  while(size > 255)
+  {
+    __m512i v1 = _mm512_stream_load_si512((void *)(s +   0));
+    __m512i v2 = _mm512_stream_load_si512((void *)(s +  64));
+    __m512i v3 = _mm512_stream_load_si512((void *)(s + 128));
+    __m512i v4 = _mm512_stream_load_si512((void *)(s + 192));
+
+    _mm512_storeu_si512((void *)(d +   0), v1);
+    _mm512_storeu_si512((void *)(d +  64), v2);
+    _mm512_storeu_si512((void *)(d + 128), v3);
+    _mm512_storeu_si512((void *)(d + 192), v4);
+
+    s    += 256;
+    d    += 256;
+    size -= 256;
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
+#ifdef __clang__
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+bool framebuffer_set_read_method(FrameBufferReadMethod method)
+{
+  const CPUInfoFeatures * features = cpuInfo_getFeatures();
+
+  if (method == FB_READ_STREAM)
+  {
+    if (features->avx512f)
+      method = FB_READ_AVX512;
+    else if (features->avx2)
+      method = FB_READ_AVX2;
+    else if (features->sse4_1)
+      method = FB_READ_SSE4_1;
+    else
+      method = FB_READ_MEMCPY;
+  }
+
+  switch(method)
+  {
+    case FB_READ_MEMCPY:
+      framebuffer_read_copy = &framebuffer_read_memcpy;
+      return true;
+
+    case FB_READ_SSE4_1:
+      if (!features->sse4_1)
+        return false;
+      framebuffer_read_copy = &framebuffer_read_sse4_1;
+      return true;
+
+    case FB_READ_AVX2:
+      if (!features->avx2)
+        return false;
+      framebuffer_read_copy = &framebuffer_read_avx2;
+      return true;
+
+    case FB_READ_AVX512:
+      if (!features->avx512f)
+        return false;
+      framebuffer_read_copy = &framebuffer_read_avx512;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+void (*framebuffer_read_copy)(void * restrict dst,
+    const void * restrict src, size_t size) = &framebuffer_read_memcpy;
+
 bool framebuffer_read_linear(const FrameBuffer * frame, void * restrict dst,
     size_t size)
 {
@@ -70,7 +432,7 @@ bool framebuffer_read_linear(const FrameBuffer * frame, void * restrict dst,
     if (!framebuffer_wait(frame, rp + copy))
       return false;
 
-    memcpy(d, frame->data + rp, copy);
+    framebuffer_read_copy(d, frame->data + rp, copy);
     size -= copy;
     rp   += copy;
     d    += copy;
@@ -109,7 +471,7 @@ bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
     if (!framebuffer_wait(frame, rp + linewidth))
       return false;
 
-    memcpy(d, frame->data + rp, dstpitch);
+    framebuffer_read_copy(d, frame->data + rp, linewidth);
     rp += pitch;
     d  += dstpitch;
   }
@@ -205,7 +567,7 @@ static bool framebuffer_write_sse4_1(FrameBuffer * frame,
     wp   += 64;
 
     if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
+      fbPublish(frame, wp);
   }
 
   if(size)
@@ -214,7 +576,7 @@ static bool framebuffer_write_sse4_1(FrameBuffer * frame,
     wp += size;
   }
 
-  atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  fbPublish(frame, wp);
 
 #ifdef FB_PROFILE
   runningavg_push(ra, microtime() - ts);
@@ -225,6 +587,33 @@ static bool framebuffer_write_sse4_1(FrameBuffer * frame,
   return true;
 }
 
+static void framebuffer_copy_sse4_1(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  __m128i * restrict s = (__m128i *)src;
+  __m128i * restrict d = (__m128i *)dst;
+
+  while(size > 63)
+  {
+    __m128i v1 = _mm_stream_load_si128(s + 0);
+    __m128i v2 = _mm_stream_load_si128(s + 1);
+    __m128i v3 = _mm_stream_load_si128(s + 2);
+    __m128i v4 = _mm_stream_load_si128(s + 3);
+
+    _mm_store_si128(d + 0, v1);
+    _mm_store_si128(d + 1, v2);
+    _mm_store_si128(d + 2, v3);
+    _mm_store_si128(d + 3, v4);
+
+    s    += 4;
+    d    += 4;
+    size -= 64;
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
+
 #ifdef __clang__
   #pragma clang attribute push (__attribute__((target("avx2"))), apply_to=function)
 #else
@@ -267,7 +656,7 @@ bool framebuffer_write_avx2(FrameBuffer * frame,
     wp   += 128;
 
     if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
+      fbPublish(frame, wp);
   }
 
   if (size > 63)
@@ -284,7 +673,7 @@ bool framebuffer_write_avx2(FrameBuffer * frame,
     wp   += 64;
 
     if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
+      fbPublish(frame, wp);
   }
 
   if (size)
@@ -293,7 +682,7 @@ bool framebuffer_write_avx2(FrameBuffer * frame,
     wp += size;
   }
 
-  atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  fbPublish(frame, wp);
 
 #ifdef FB_PROFILE
   runningavg_push(ra, microtime() - ts);
@@ -303,20 +692,290 @@ bool framebuffer_write_avx2(FrameBuffer * frame,
 
   return true;
 }
+static void framebuffer_copy_avx2(void * restrict dst,
+    const void * restrict src, size_t size)
+{
+  __m256i *restrict s = (__m256i *)src;
+  __m256i *restrict d = (__m256i *)dst;
+
+  while (size > 127)
+  {
+    __m256i v1 = _mm256_stream_load_si256(s + 0);
+    __m256i v2 = _mm256_stream_load_si256(s + 1);
+    __m256i v3 = _mm256_stream_load_si256(s + 2);
+    __m256i v4 = _mm256_stream_load_si256(s + 3);
+
+    _mm256_stream_si256(d + 0, v1);
+    _mm256_stream_si256(d + 1, v2);
+    _mm256_stream_si256(d + 2, v3);
+    _mm256_stream_si256(d + 3, v4);
+
+    s    += 4;
+    d    += 4;
+    size -= 128;
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
 #ifdef __clang__
   #pragma clang attribute pop
 #else
   #pragma GCC pop_options
 #endif
 
-static bool _framebuffer_write(FrameBuffer * frame,
-    const void * restrict src, size_t size)
+typedef bool (*FBWriteFn)(FrameBuffer * frame,
+    const void * restrict src, size_t size);
+typedef void (*FBCopyFn)(void * restrict dst,
+    const void * restrict src, size_t size);
+
+static FBWriteFn fbWriteST = NULL;
+static FBCopyFn  fbCopy    = NULL;
+
+static void framebuffer_select(void)
 {
+  if (fbWriteST)
+    return;
+
   if (cpuInfo_getFeatures()->avx2)
-    framebuffer_write = &framebuffer_write_avx2;
+  {
+    fbWriteST = &framebuffer_write_avx2;
+    fbCopy    = &framebuffer_copy_avx2;
+  }
   else
-    framebuffer_write = &framebuffer_write_sse4_1;
+  {
+    fbWriteST = &framebuffer_write_sse4_1;
+    fbCopy    = &framebuffer_copy_sse4_1;
+  }
+}
 
+/* The parallel writer splits the frame into FB_CHUNK_SIZE stripes which are
+ * claimed by the worker threads (and the caller) in order. As stripes may
+ * complete out of order the write pointer is only advanced over the
+ * contiguous run of completed stripes so that readers can still stream the
+ * frame while it is being written. */
+static struct
+{
+  unsigned int threads;
+  LGThread   * thread[FB_MAX_WRITE_THREADS];
+  LGEvent    * start [FB_MAX_WRITE_THREADS];
+  LGEvent    * done;
+  atomic_bool  stop;
+
+  FrameBuffer   * frame;
+  const uint8_t * src;
+  size_t          size;
+  size_t          chunks;
+  atomic_size_t   nextChunk;
+  atomic_size_t   published;
+  atomic_uint     pending;
+
+  atomic_bool   * chunkDone;
+  size_t          chunkDoneSize;
+}
+fbPool = { 0 };
+
+inline static void fbPublishMax(FrameBuffer * frame, uint32_t wp)
+{
+  uint32_t cur = atomic_load_explicit(&frame->wp, memory_order_relaxed);
+  while(cur < wp)
+    if (atomic_compare_exchange_weak_explicit(&frame->wp, &cur, wp,
+          memory_order_release, memory_order_relaxed))
+    {
+      fbWake(frame);
+      break;
+    }
+}
+
+static void fbPoolAdvance(void)
+{
+  size_t published = atomic_load_explicit(&fbPool.published,
+      memory_order_acquire);
+
+  while(published < fbPool.chunks &&
+      atomic_load_explicit(&fbPool.chunkDone[published], memory_order_acquire))
+  {
+    if (!atomic_compare_exchange_weak_explicit(&fbPool.published, &published,
+          published + 1, memory_order_acq_rel, memory_order_acquire))
+      continue;
+
+    ++published;
+    fbPublishMax(fbPool.frame, min(published * FB_CHUNK_SIZE, fbPool.size));
+  }
+}
+
+static void fbPoolCopyChunks(void)
+{
+  for(;;)
+  {
+    const size_t chunk = atomic_fetch_add_explicit(&fbPool.nextChunk, 1,
+        memory_order_relaxed);
+    if (chunk >= fbPool.chunks)
+      break;
+
+    const size_t offset = chunk * FB_CHUNK_SIZE;
+    fbCopy(fbPool.frame->data + offset, fbPool.src + offset,
+        min((size_t)FB_CHUNK_SIZE, fbPool.size - offset));
+
+    // make the non-temporal stores visible before the chunk is published
+    _mm_sfence();
+    atomic_store_explicit(&fbPool.chunkDone[chunk], true, memory_order_release);
+    fbPoolAdvance();
+  }
+}
+
+static int fbPoolThread(void * opaque)
+{
+  LGEvent * start = (LGEvent *)opaque;
+  for(;;)
+  {
+    lgWaitEvent(start, TIMEOUT_INFINITE);
+    if (atomic_load_explicit(&fbPool.stop, memory_order_acquire))
+      break;
+
+    fbPoolCopyChunks();
+    if (atomic_fetch_sub_explicit(&fbPool.pending, 1,
+          memory_order_acq_rel) == 1)
+      lgSignalEvent(fbPool.done);
+  }
+
+  return 0;
+}
+
+static bool framebuffer_write_mt(FrameBuffer * frame,
+    const void * restrict src, size_t size)
+{
+  const size_t chunks = (size + FB_CHUNK_SIZE - 1) / FB_CHUNK_SIZE;
+
+  // not worth waking the workers for small frames
+  if (chunks < fbPool.threads)
+    return fbWriteST(frame, src, size);
+
+  if (chunks > fbPool.chunkDoneSize)
+  {
+    atomic_bool * chunkDone = realloc(fbPool.chunkDone,
+        chunks * sizeof(*chunkDone));
+    if (!chunkDone)
+    {
+      DEBUG_ERROR("Out of memory");
+      return fbWriteST(frame, src, size);
+    }
+
+    fbPool.chunkDone     = chunkDone;
+    fbPool.chunkDoneSize = chunks;
+  }
+
+  for(size_t i = 0; i < chunks; ++i)
+    atomic_init(&fbPool.chunkDone[i], false);
+
+  fbPool.frame  = frame;
+  fbPool.src    = src;
+  fbPool.size   = size;
+  fbPool.chunks = chunks;
+  atomic_store_explicit(&fbPool.nextChunk, 0, memory_order_relaxed);
+  atomic_store_explicit(&fbPool.published, 0, memory_order_relaxed);
+  atomic_store_explicit(&fbPool.pending, fbPool.threads - 1,
+      memory_order_release);
+
+  _mm_mfence();
+
+  for(unsigned int i = 0; i < fbPool.threads - 1; ++i)
+    lgSignalEvent(fbPool.start[i]);
+
+  fbPoolCopyChunks();
+  lgWaitEvent(fbPool.done, TIMEOUT_INFINITE);
+
+  fbPublishMax(frame, size);
+  return true;
+}
+
+static void fbPoolStop(void)
+{
+  atomic_store_explicit(&fbPool.stop, true, memory_order_release);
+  for(unsigned int i = 0; i < FB_MAX_WRITE_THREADS; ++i)
+  {
+    if (fbPool.thread[i])
+    {
+      lgSignalEvent(fbPool.start[i]);
+      lgJoinThread(fbPool.thread[i], NULL);
+      fbPool.thread[i] = NULL;
+    }
+
+    if (fbPool.start[i])
+    {
+      lgFreeEvent(fbPool.start[i]);
+      fbPool.start[i] = NULL;
+    }
+  }
+
+  if (fbPool.done)
+  {
+    lgFreeEvent(fbPool.done);
+    fbPool.done = NULL;
+  }
+
+  free(fbPool.chunkDone);
+  fbPool.chunkDone     = NULL;
+  fbPool.chunkDoneSize = 0;
+  fbPool.threads       = 0;
+  atomic_store_explicit(&fbPool.stop, false, memory_order_release);
+}
+
+bool framebuffer_set_write_threads(unsigned int threads)
+{
+  framebuffer_select();
+
+  if (threads > FB_MAX_WRITE_THREADS)
+  {
+    DEBUG_WARN("Limiting the framebuffer write threads to %d",
+        FB_MAX_WRITE_THREADS);
+    threads = FB_MAX_WRITE_THREADS;
+  }
+
+  fbPoolStop();
+  if (threads < 2)
+  {
+    framebuffer_write = fbWriteST;
+    return true;
+  }
+
+  if (!(fbPool.done = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the framebuffer write event");
+    goto fail;
+  }
+
+  for(unsigned int i = 0; i < threads - 1; ++i)
+  {
+    if (!(fbPool.start[i] = lgCreateEvent(true, 0)))
+    {
+      DEBUG_ERROR("Failed to create the framebuffer write event");
+      goto fail;
+    }
+
+    if (!lgCreateThread("FBWriter", fbPoolThread, fbPool.start[i],
+          &fbPool.thread[i]))
+    {
+      DEBUG_ERROR("Failed to create the framebuffer write thread");
+      goto fail;
+    }
+  }
+
+  fbPool.threads    = threads;
+  framebuffer_write = &framebuffer_write_mt;
+  return true;
+
+fail:
+  fbPoolStop();
+  framebuffer_write = fbWriteST;
+  return false;
+}
+
+static bool _framebuffer_write(FrameBuffer * frame,
+    const void * restrict src, size_t size)
+{
+  framebuffer_select();
+  framebuffer_write = fbWriteST;
   return framebuffer_write(frame, src, size);
 }
 
@@ -335,5 +994,5 @@ uint8_t * framebuffer_get_data(FrameBuffer * frame)
 
 void framebuffer_set_write_ptr(FrameBuffer * frame, size_t size)
 {
-  atomic_store_explicit(&frame->wp, size, memory_order_release);
+  fbPublish(frame, size);
 }
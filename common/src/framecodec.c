@@ -0,0 +1,333 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/framecodec.h"
+#include "common/KVMFR.h"
+#include "common/debug.h"
+#include "common/util.h"
+
+#include <string.h>
+#include <emmintrin.h>
+
+#define TOKEN_LITERAL 0x80000000U
+
+size_t frameCodec_maxSize(size_t rowBytes, unsigned int rows)
+{
+  const size_t bands =
+    (rows + FRAMECODEC_BAND_ROWS - 1) / FRAMECODEC_BAND_ROWS;
+
+  return sizeof(KVMFRCodecHeader) +
+    (bands + 1) * sizeof(KVMFRCodecBlock) + rowBytes * rows;
+}
+
+// the number of words at the start of `a` and `b` that are equal
+static inline size_t matchLength(const uint32_t * a, const uint32_t * b,
+    size_t words)
+{
+  size_t i = 0;
+  for(; i + 4 <= words; i += 4)
+  {
+    const __m128i eq = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *)(a + i)),
+        _mm_loadu_si128((const __m128i *)(b + i)));
+
+    const unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    if (mask != 0xF)
+      return i + __builtin_ctz(~mask);
+  }
+
+  while(i < words && a[i] == b[i])
+    ++i;
+
+  return i;
+}
+
+/* the number of words at the start of `a` and `b` before the next run of
+ * equal words, single equal words are cheaper to send as literals */
+static inline size_t literalLength(const uint32_t * a, const uint32_t * b,
+    size_t words)
+{
+  size_t i = 0;
+  while(i < words)
+  {
+    if (i + 4 <= words)
+    {
+      const __m128i eq = _mm_cmpeq_epi32(
+          _mm_loadu_si128((const __m128i *)(a + i)),
+          _mm_loadu_si128((const __m128i *)(b + i)));
+
+      if (!_mm_movemask_ps(_mm_castsi128_ps(eq)))
+      {
+        i += 4;
+        continue;
+      }
+    }
+
+    if (a[i] == b[i] && (i + 1 == words || a[i + 1] == b[i + 1]))
+      break;
+
+    ++i;
+  }
+
+  return i;
+}
+
+/* encode a row against the row above, returns the encoded size in bytes or
+ * zero if it does not fit in `avail` bytes */
+static size_t encodeRow(uint32_t * out, size_t avail, const uint32_t * row,
+    const uint32_t * above, size_t words)
+{
+  const size_t left = avail / sizeof(*out);
+  if (!above)
+  {
+    if (words + 1 > left)
+      return 0;
+
+    out[0] = TOKEN_LITERAL | words;
+    memcpy(out + 1, row, words * sizeof(*row));
+    return (words + 1) * sizeof(*out);
+  }
+
+  size_t n = 0;
+  for(size_t i = 0; i < words;)
+  {
+    size_t run = matchLength(row + i, above + i, words - i);
+    if (run)
+    {
+      if (n == left)
+        return 0;
+
+      out[n++] = run;
+      i       += run;
+      if (i == words)
+        break;
+    }
+
+    run = literalLength(row + i, above + i, words - i);
+    if (n + 1 + run > left)
+      return 0;
+
+    out[n++] = TOKEN_LITERAL | run;
+    memcpy(out + n, row + i, run * sizeof(*row));
+    n += run;
+    i += run;
+  }
+
+  return n * sizeof(*out);
+}
+
+size_t frameCodec_encode(FrameBuffer * frame, size_t maxSize,
+    const uint8_t * src, size_t srcPitch, size_t rowBytes, unsigned int rows)
+{
+  DEBUG_ASSERT(maxSize >= sizeof(KVMFRCodecHeader) + sizeof(KVMFRCodecBlock));
+
+  uint8_t * data = framebuffer_get_data(frame);
+  KVMFRCodecHeader * header = (KVMFRCodecHeader *)data;
+  header->rowBytes = rowBytes;
+  header->rows     = rows;
+
+  // always leave room to end the stream early
+  const size_t end   = maxSize - sizeof(KVMFRCodecBlock);
+  const bool   runs  = rowBytes && (rowBytes & 0x3) == 0;
+  const size_t words = rowBytes / sizeof(uint32_t);
+
+  size_t       offset = sizeof(*header);
+  unsigned int y      = 0;
+  while(y < rows && rowBytes)
+  {
+    const unsigned int bandRows = min(rows - y, FRAMECODEC_BAND_ROWS);
+    const size_t       rawSize  = (size_t)bandRows * rowBytes;
+    KVMFRCodecBlock  * block    = (KVMFRCodecBlock *)(data + offset);
+    uint8_t          * out      = (uint8_t *)(block + 1);
+    const size_t       avail    = end > offset + sizeof(*block) ?
+      end - offset - sizeof(*block) : 0;
+
+    size_t size = 0;
+    if (runs)
+    {
+      // only use runs if they are smaller than the raw rows
+      const size_t limit = min(avail, rawSize);
+      for(unsigned int r = 0; r < bandRows; ++r)
+      {
+        const uint8_t * row = src + (size_t)(y + r) * srcPitch;
+        const size_t    len = encodeRow((uint32_t *)(out + size), limit - size,
+            (const uint32_t *)row,
+            y + r ? (const uint32_t *)(row - srcPitch) : NULL, words);
+
+        if (!len)
+        {
+          size = 0;
+          break;
+        }
+        size += len;
+      }
+      block->mode = KVMFR_CODEC_RUNS;
+    }
+
+    if (!size)
+    {
+      if (rawSize > avail)
+        break;
+
+      for(unsigned int r = 0; r < bandRows; ++r)
+        memcpy(out + (size_t)r * rowBytes,
+            src + (size_t)(y + r) * srcPitch, rowBytes);
+
+      size        = rawSize;
+      block->mode = KVMFR_CODEC_RAW;
+    }
+
+    block->size = size;
+    block->rows = bandRows;
+    offset     += sizeof(*block) + size;
+    y          += bandRows;
+    framebuffer_set_write_ptr(frame, offset);
+  }
+
+  if (y < rows || !rowBytes)
+  {
+    KVMFRCodecBlock * block = (KVMFRCodecBlock *)(data + offset);
+    block->size = 0;
+    block->rows = 0;
+    block->mode = KVMFR_CODEC_RAW;
+    offset += sizeof(*block);
+    framebuffer_set_write_ptr(frame, offset);
+  }
+
+  return offset;
+}
+
+static bool decodeRuns(const uint8_t * in, size_t size, uint8_t * dst,
+    size_t dstPitch, unsigned int y, unsigned int rows, size_t words)
+{
+  if (size & 0x3)
+    return false;
+
+  const uint32_t * token = (const uint32_t *)in;
+  const uint32_t * end   = token + size / sizeof(*token);
+
+  for(unsigned int r = y; r < y + rows; ++r)
+  {
+    uint32_t       * row   = (uint32_t *)(dst + (size_t)r * dstPitch);
+    const uint32_t * above = r ? (const uint32_t *)
+      ((const uint8_t *)row - dstPitch) : NULL;
+
+    for(size_t i = 0; i < words;)
+    {
+      if (token == end)
+        return false;
+
+      const uint32_t t     = *token++;
+      const size_t   count = t & ~TOKEN_LITERAL;
+      if (count == 0 || count > words - i)
+        return false;
+
+      if (t & TOKEN_LITERAL)
+      {
+        if (count > (size_t)(end - token))
+          return false;
+
+        framebuffer_read_copy(row + i, token, count * sizeof(*token));
+        token += count;
+      }
+      else
+      {
+        if (!above)
+          return false;
+
+        memcpy(row + i, above + i, count * sizeof(*row));
+      }
+
+      i += count;
+    }
+  }
+
+  return token == end;
+}
+
+bool frameCodec_decode(const FrameBuffer * frame, size_t maxSize,
+    uint8_t * dst, size_t dstPitch, unsigned int maxRows, unsigned int * rows)
+{
+  *rows = 0;
+
+  const uint8_t * data = framebuffer_get_buffer(frame);
+  if (maxSize < sizeof(KVMFRCodecHeader) ||
+      !framebuffer_wait(frame, sizeof(KVMFRCodecHeader)))
+    return false;
+
+  KVMFRCodecHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.rowBytes > dstPitch || header.rows > maxRows)
+  {
+    DEBUG_ERROR("Compressed frame (%ux%u) does not fit the buffer (%zux%u)",
+        header.rowBytes, header.rows, dstPitch, maxRows);
+    return false;
+  }
+
+  const size_t words  = header.rowBytes / sizeof(uint32_t);
+  size_t       offset = sizeof(header);
+  unsigned int y      = 0;
+  while(y < header.rows)
+  {
+    KVMFRCodecBlock block;
+    if (sizeof(block) > maxSize - offset ||
+        !framebuffer_wait(frame, offset + sizeof(block)))
+      return false;
+
+    memcpy(&block, data + offset, sizeof(block));
+    offset += sizeof(block);
+
+    // the stream was ended early
+    if (block.rows == 0)
+      break;
+
+    if (block.rows > header.rows - y ||
+        block.size > maxSize - offset ||
+        !framebuffer_wait(frame, offset + block.size))
+      return false;
+
+    const uint8_t * in = data + offset;
+    switch(block.mode)
+    {
+      case KVMFR_CODEC_RAW:
+        if (block.size != (size_t)block.rows * header.rowBytes)
+          return false;
+
+        for(unsigned int r = 0; r < block.rows; ++r)
+          framebuffer_read_copy(dst + (size_t)(y + r) * dstPitch,
+              in + (size_t)r * header.rowBytes, header.rowBytes);
+        break;
+
+      case KVMFR_CODEC_RUNS:
+        if (!decodeRuns(in, block.size, dst, dstPitch, y, block.rows, words))
+          return false;
+        break;
+
+      default:
+        return false;
+    }
+
+    offset += block.size;
+    y      += block.rows;
+    *rows   = y;
+  }
+
+  return true;
+}
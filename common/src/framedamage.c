@@ -0,0 +1,254 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/framedamage.h"
+#include "common/util.h"
+
+#include <string.h>
+
+#define TILE_MIN_SIZE 16
+#define TILE_MAX_SIZE 256
+
+static KVMFRDamage * getRecord(const KVMFRFrame * frame, size_t * avail)
+{
+  const size_t start = sizeof(*frame) + sizeof(KVMFRDamage);
+  if (frame->offset < start)
+  {
+    *avail = 0;
+    return NULL;
+  }
+
+  *avail = frame->offset - start;
+  return (KVMFRDamage *)((uint8_t *)frame + sizeof(*frame));
+}
+
+static bool encodeTiles(KVMFRDamage * damage, size_t avail,
+    const FrameDamageRect * rects, unsigned int count,
+    unsigned int width, unsigned int height)
+{
+  unsigned int tileSize = TILE_MIN_SIZE;
+  unsigned int columns, rows, rowSize;
+  for(;; tileSize <<= 1)
+  {
+    if (tileSize > TILE_MAX_SIZE)
+      return false;
+
+    columns = (width  + tileSize - 1) / tileSize;
+    rows    = (height + tileSize - 1) / tileSize;
+    rowSize = (columns + 7) / 8;
+    if ((size_t)rowSize * rows <= avail)
+      break;
+  }
+
+  damage->type     = KVMFR_DAMAGE_TILES;
+  damage->tileSize = tileSize;
+  damage->columns  = columns;
+  damage->rows     = rows;
+  damage->count    = 0;
+  memset(damage->data, 0, (size_t)rowSize * rows);
+
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * rect = rects + i;
+    if (rect->width == 0 || rect->height == 0 ||
+        rect->x >= width || rect->y >= height)
+      continue;
+
+    const unsigned int x1 = rect->x / tileSize;
+    const unsigned int y1 = rect->y / tileSize;
+    const unsigned int x2 = min(rect->x + rect->width  - 1, width  - 1) / tileSize;
+    const unsigned int y2 = min(rect->y + rect->height - 1, height - 1) / tileSize;
+
+    for(unsigned int y = y1; y <= y2; ++y)
+    {
+      uint8_t * row = damage->data + y * rowSize;
+      for(unsigned int x = x1; x <= x2; ++x)
+        row[x >> 3] |= 1 << (x & 7);
+    }
+  }
+
+  return true;
+}
+
+void frameDamage_encode(KVMFRFrame * frame,
+    const FrameDamageRect * rects, unsigned int count)
+{
+  frame->flags &= ~FRAME_FLAG_DAMAGE_EXT;
+
+  if (count <= KVMFR_MAX_DAMAGE_RECTS)
+  {
+    frame->damageRectsCount = count;
+    memcpy(frame->damageRects, rects, count * sizeof(*rects));
+    return;
+  }
+
+  // clients that do not understand the record will treat this as full damage
+  frame->damageRectsCount = 0;
+
+  size_t avail;
+  KVMFRDamage * damage = getRecord(frame, &avail);
+  if (!damage)
+    return;
+
+  if (count * sizeof(KVMFRDamageRect) <= avail &&
+      frame->frameWidth <= UINT16_MAX && frame->frameHeight <= UINT16_MAX)
+  {
+    KVMFRDamageRect * out = (KVMFRDamageRect *)damage->data;
+    for(unsigned int i = 0; i < count; ++i)
+      out[i] = (KVMFRDamageRect) {
+        .x      = rects[i].x,
+        .y      = rects[i].y,
+        .width  = rects[i].width,
+        .height = rects[i].height
+      };
+
+    damage->type     = KVMFR_DAMAGE_RECTS;
+    damage->tileSize = 0;
+    damage->columns  = 0;
+    damage->rows     = 0;
+    damage->count    = count;
+  }
+  else if (!encodeTiles(damage, avail, rects, count,
+        frame->frameWidth, frame->frameHeight))
+    return;
+
+  frame->flags |= FRAME_FLAG_DAMAGE_EXT;
+}
+
+static unsigned int decodeTiles(const KVMFRFrame * frame,
+    const KVMFRDamage * damage, size_t avail,
+    FrameDamageRect * rects, unsigned int maxRects)
+{
+  const unsigned int tileSize = damage->tileSize;
+  const unsigned int rowSize  = (damage->columns + 7) / 8;
+  if (tileSize == 0 || (size_t)rowSize * damage->rows > avail)
+    return 0;
+
+  unsigned int count     = 0;
+  unsigned int prevStart = 0;
+  unsigned int prevCount = 0;
+
+  for(unsigned int y = 0; y < damage->rows; ++y)
+  {
+    const uint8_t * row = damage->data + y * rowSize;
+    const unsigned int start = count;
+    const unsigned int ry    = y * tileSize;
+    if (ry >= frame->frameHeight)
+      break;
+
+    for(unsigned int x = 0; x < damage->columns;)
+    {
+      if (!(row[x >> 3] & (1 << (x & 7))))
+      {
+        ++x;
+        continue;
+      }
+
+      unsigned int x2 = x + 1;
+      while(x2 < damage->columns && (row[x2 >> 3] & (1 << (x2 & 7))))
+        ++x2;
+
+      const unsigned int rx = x * tileSize;
+      if (rx < frame->frameWidth)
+      {
+        if (count == maxRects)
+          return 0;
+
+        rects[count++] = (FrameDamageRect) {
+          .x      = rx,
+          .y      = ry,
+          .width  = min(x2 * tileSize, frame->frameWidth) - rx,
+          .height = min(tileSize, frame->frameHeight - ry)
+        };
+      }
+      x = x2;
+    }
+
+    // extend the runs of the previous row instead if they match
+    const unsigned int runs = count - start;
+    if (runs > 0 && runs == prevCount &&
+        rects[prevStart].y + rects[prevStart].height == ry)
+    {
+      bool same = true;
+      for(unsigned int i = 0; i < runs && same; ++i)
+        same =
+          rects[prevStart + i].x     == rects[start + i].x &&
+          rects[prevStart + i].width == rects[start + i].width;
+
+      if (same)
+      {
+        for(unsigned int i = 0; i < runs; ++i)
+          rects[prevStart + i].height += rects[start + i].height;
+        count = start;
+        continue;
+      }
+    }
+
+    prevStart = start;
+    prevCount = runs;
+  }
+
+  return count;
+}
+
+unsigned int frameDamage_decode(const KVMFRFrame * frame,
+    FrameDamageRect * rects, unsigned int maxRects)
+{
+  if (!(frame->flags & FRAME_FLAG_DAMAGE_EXT))
+  {
+    const unsigned int count = frame->damageRectsCount;
+    if (count > KVMFR_MAX_DAMAGE_RECTS || count > maxRects)
+      return 0;
+
+    memcpy(rects, frame->damageRects, count * sizeof(*rects));
+    return count;
+  }
+
+  size_t avail;
+  const KVMFRDamage * damage = getRecord(frame, &avail);
+  if (!damage)
+    return 0;
+
+  switch(damage->type)
+  {
+    case KVMFR_DAMAGE_RECTS:
+    {
+      if (damage->count > maxRects ||
+          damage->count * sizeof(KVMFRDamageRect) > avail)
+        return 0;
+
+      const KVMFRDamageRect * in = (const KVMFRDamageRect *)damage->data;
+      for(unsigned int i = 0; i < damage->count; ++i)
+        rects[i] = (FrameDamageRect) {
+          .x      = in[i].x,
+          .y      = in[i].y,
+          .width  = in[i].width,
+          .height = in[i].height
+        };
+      return damage->count;
+    }
+
+    case KVMFR_DAMAGE_TILES:
+      return decodeTiles(frame, damage, avail, rects, maxRects);
+
+    default:
+      return 0;
+  }
+}
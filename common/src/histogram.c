@@ -0,0 +1,95 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/histogram.h"
+#include "common/util.h"
+
+#define SUB_BUCKETS (1U << KVMFR_HISTOGRAM_SUB_BITS)
+
+static unsigned int bucketIndex(uint64_t value)
+{
+  if (value < SUB_BUCKETS)
+    return value;
+
+  const unsigned int exp   = 63 - __builtin_clzll(value);
+  const unsigned int shift = exp - KVMFR_HISTOGRAM_SUB_BITS;
+  const unsigned int index = (shift + 1) * SUB_BUCKETS +
+    ((value >> shift) & (SUB_BUCKETS - 1));
+
+  return min(index, KVMFR_HISTOGRAM_BUCKETS - 1);
+}
+
+// the largest value that is counted in the bucket
+static uint64_t bucketValue(unsigned int index)
+{
+  if (index < SUB_BUCKETS)
+    return index;
+
+  const unsigned int shift = index / SUB_BUCKETS - 1;
+  const uint64_t     base  = SUB_BUCKETS + index % SUB_BUCKETS;
+  return ((base + 1) << shift) - 1;
+}
+
+void histogram_record(KVMFRHistogram * hist, uint64_t value)
+{
+  ++hist->buckets[bucketIndex(value)];
+  ++hist->count;
+  hist->sum += value;
+  if (value > hist->max)
+    hist->max = min(value, (uint64_t)UINT32_MAX);
+}
+
+uint64_t histogram_percentile(const KVMFRHistogram * hist, double percentile)
+{
+  /* the writer may be mid update, so take a copy of the buckets and count
+   * from that rather than trusting `count` */
+  uint32_t buckets[KVMFR_HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  for(unsigned int i = 0; i < KVMFR_HISTOGRAM_BUCKETS; ++i)
+  {
+    buckets[i] = *(volatile const uint32_t *)&hist->buckets[i];
+    total     += buckets[i];
+  }
+
+  if (!total)
+    return 0;
+
+  const uint64_t max    = *(volatile const uint32_t *)&hist->max;
+  uint64_t       target = (uint64_t)(total * clamp(percentile, 0.0, 100.0) /
+      100.0 + 0.5);
+  if (target == 0)
+    target = 1;
+
+  uint64_t seen = 0;
+  for(unsigned int i = 0; i < KVMFR_HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += buckets[i];
+    if (seen < target)
+      continue;
+
+    // the last bucket also holds everything larger than it
+    if (i == KVMFR_HISTOGRAM_BUCKETS - 1)
+      return max;
+
+    return max ? min(bucketValue(i), max) : bucketValue(i);
+  }
+
+  return max;
+}
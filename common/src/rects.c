@@ -21,6 +21,7 @@
 #include "common/rects.h"
 #include "common/util.h"
 #include "common/cpuinfo.h"
+#include "common/debug.h"
 
 #include <stdlib.h>
 #include <immintrin.h>
@@ -38,6 +39,35 @@ struct Edge
   int delta;
 };
 
+// spans closer together than a cache line are merged into a single copy
+#define SPAN_MERGE_GAP 64
+// spans at least this wide are copied with non-temporal stores
+#define SPAN_WIDE      256
+
+#define SPANS_MAX_BANDS 256
+#define SPANS_MAX       2048
+
+struct Span
+{
+  int x1, x2; // in bytes
+};
+
+struct Band
+{
+  int y1, y2;
+  int first, count;
+};
+
+struct SpanList
+{
+  int         bands;
+  int         spans;
+  struct Band band[SPANS_MAX_BANDS];
+  struct Span span[SPANS_MAX];
+};
+
+typedef void (*RowCopyFn)(int y, void * opaque);
+
 inline static bool rectIntersects(const FrameDamageRect * r1,
     const FrameDamageRect * r2)
 {
@@ -85,12 +115,121 @@ static int cornerCompare(const void * a_, const void * b_)
   return 0;
 }
 
-inline static void rectsBufferCopy(FrameDamageRect * rects, int count, int bpp,
+static void rectCopyUnaligned_memcpy(
+    uint8_t *restrict dst, const uint8_t *restrict src,
+    int ystart, int yend, int dx, int dstPitch, int srcPitch, int width);
+
+inline static void spanCopy(uint8_t * dst, const uint8_t * src,
+    int ystart, int yend, int dx, int dstPitch, int srcPitch, int width)
+{
+  // small copies are cheaper through the cache
+  if (width >= SPAN_WIDE)
+    rectCopyUnaligned(dst, src, ystart, yend, dx, dstPitch, srcPitch, width);
+  else
+    rectCopyUnaligned_memcpy(dst, src, ystart, yend, dx, dstPitch, srcPitch,
+        width);
+}
+
+static void spansCopy(struct SpanList * list,
+  uint8_t * dst, int dstStride, const uint8_t * src, int srcStride,
+  void * opaque, RowCopyFn rowCopyStart, RowCopyFn rowCopyFinish)
+{
+  for (int i = 0; i < list->bands; ++i)
+  {
+    const struct Band * band = list->band + i;
+    const struct Span * span = list->span + band->first;
+
+    if (rowCopyStart)
+      rowCopyStart(band->y2, opaque);
+
+    if (band->count == 1 && dstStride == srcStride &&
+        dstStride - (span->x2 - span->x1) < SPAN_MERGE_GAP)
+    {
+      // the span covers the row, copy the whole band as one contiguous block
+      const int offset = band->y1 * dstStride + span->x1;
+      const int width  = (band->y2 - band->y1 - 1) * dstStride +
+        (span->x2 - span->x1);
+      spanCopy(dst, src, 0, 1, offset, 0, 0, width);
+    }
+    else
+      for (int j = 0; j < band->count; ++j, ++span)
+        spanCopy(dst, src, band->y1, band->y2, span->x1,
+            dstStride, srcStride, span->x2 - span->x1);
+
+    if (rowCopyFinish)
+      rowCopyFinish(band->y2, opaque);
+  }
+
+  list->bands = 0;
+  list->spans = 0;
+}
+
+inline static void spansBeginBand(struct SpanList * list, int y1, int y2)
+{
+  list->band[list->bands] = (struct Band) {
+    .y1 = y1, .y2 = y2, .first = list->spans, .count = 0
+  };
+}
+
+inline static void spansAdd(struct SpanList * list, int x1, int x2)
+{
+  struct Band * band = list->band + list->bands;
+  if (band->count > 0)
+  {
+    struct Span * last = list->span + list->spans - 1;
+    if (x1 - last->x2 < SPAN_MERGE_GAP)
+    {
+      last->x2 = x2;
+      return;
+    }
+  }
+
+  list->span[list->spans++] = (struct Span) { .x1 = x1, .x2 = x2 };
+  ++band->count;
+}
+
+inline static void spansEndBand(struct SpanList * list)
+{
+  struct Band * band = list->band + list->bands;
+  if (band->count == 0 || band->y1 == band->y2)
+  {
+    list->spans = band->first;
+    return;
+  }
+
+  // extend the previous band instead if it has the same spans
+  if (list->bands > 0)
+  {
+    struct Band * prev = band - 1;
+    if (prev->y2 == band->y1 && prev->count == band->count &&
+        memcmp(list->span + prev->first, list->span + band->first,
+          band->count * sizeof(struct Span)) == 0)
+    {
+      prev->y2    = band->y2;
+      list->spans = band->first;
+      return;
+    }
+  }
+
+  ++list->bands;
+}
+
+/* The damage is converted into a list of bands of rows that share the same
+ * spans, which is then copied in a single pass. Spans that are close together
+ * are merged, and bands with identical spans are coalesced to minimise the
+ * number of small copies. */
+static void rectsBufferCopy(FrameDamageRect * rects, int count, int bpp,
   uint8_t * dst, int dstStride, int height,
   const uint8_t * src, int srcStride, void * opaque,
-  void (*rowCopyStart)(int y, void * opaque),
-  void (*rowCopyFinish)(int y, void * opaque))
+  RowCopyFn rowCopyStart, RowCopyFn rowCopyFinish)
 {
+  if (count == 0)
+    return;
+
+  struct SpanList list;
+  list.bands = 0;
+  list.spans = 0;
+
   const int cornerCount = 4 * count;
   struct Corner corners[cornerCount];
 
@@ -138,28 +277,29 @@ inline static void rectsBufferCopy(FrameDamageRect * rects, int count, int bpp,
       change[changes++] = (struct Edge) { .x = x, .delta = delta };
     }
 
-    if (rowCopyStart)
-      rowCopyStart(y, opaque);
+    // flush the list if this band may not fit, at most one span per two edges
+    if (list.bands == SPANS_MAX_BANDS ||
+        list.spans + actives / 2 > SPANS_MAX)
+      spansCopy(&list, dst, dstStride, src, srcStride, opaque,
+          rowCopyStart, rowCopyFinish);
 
     struct Edge * active = active_[activeRow];
     int x1 = 0;
     int in_rect = 0;
+    spansBeginBand(&list, prev_y, y);
     for (int i = 0; i < actives; ++i)
     {
       if (!in_rect)
         x1 = active[i].x;
       in_rect += active[i].delta;
       if (!in_rect)
-        rectCopyUnaligned(dst, src, prev_y, y, x1 * bpp, dstStride, srcStride,
-            (active[i].x - x1) * bpp);
+        spansAdd(&list, x1 * bpp, active[i].x * bpp);
     }
+    spansEndBand(&list);
 
     if (re >= cornerCount || y == height)
       break;
 
-    if (rowCopyFinish)
-      rowCopyFinish(y, opaque);
-
     struct Edge * new = active_[activeRow ^ 1];
     int ai = 0;
     int ci = 0;
@@ -191,6 +331,9 @@ inline static void rectsBufferCopy(FrameDamageRect * rects, int count, int bpp,
     rs = re;
     activeRow ^= 1;
   }
+
+  spansCopy(&list, dst, dstStride, src, srcStride, opaque,
+      rowCopyStart, rowCopyFinish);
 }
 
 struct ToFramebufferData
@@ -202,6 +345,8 @@ struct ToFramebufferData
 static void fbRowFinish(int y, void * opaque)
 {
   struct ToFramebufferData * data = opaque;
+  // ensure the non-temporal stores are visible before the rows are published
+  _mm_sfence();
   framebuffer_set_write_ptr(data->frame, y * data->pitch);
 }
 
@@ -236,69 +381,599 @@ void rectsFramebufferToBuffer(FrameDamageRect * rects, int count, int bpp,
     framebuffer_get_buffer(frame), srcPitch, &data, fbRowStart, NULL);
 }
 
+/* sorted by x, then by descending size so a rect that contains another with
+ * the same origin always comes first, then by y so the order is stable */
+static int rectXCompare(const void * a_, const void * b_)
+{
+  const FrameDamageRect * a = a_;
+  const FrameDamageRect * b = b_;
+
+  if (a->x < b->x) return -1;
+  if (a->x > b->x) return +1;
+  if (a->width > b->width) return -1;
+  if (a->width < b->width) return +1;
+  if (a->height > b->height) return -1;
+  if (a->height < b->height) return +1;
+  if (a->y < b->y) return -1;
+  if (a->y > b->y) return +1;
+  return 0;
+}
+
+static int intCompare(const void * a_, const void * b_)
+{
+  const int a = *(const int *)a_;
+  const int b = *(const int *)b_;
+  return (a > b) - (a < b);
+}
+
+/* A segment tree over the y coordinates that flags the coordinates the active
+ * rects start at, used to find the active rects overlapping a range of rows */
+struct YTree
+{
+  int   size;
+  int * count;
+};
+
+static void yTreeSet(struct YTree * tree, int pos, int value)
+{
+  int i = tree->size + pos;
+  const int delta = value - tree->count[i];
+  for (; i > 0; i >>= 1)
+    tree->count[i] += delta;
+}
+
+// returns the first flagged position at or after `pos`, or -1
+static int yTreeNext(const struct YTree * tree, int pos)
+{
+  int i = tree->size + pos;
+  if (tree->count[i])
+    return pos;
+
+  for (; i > 1; i >>= 1)
+    if (!(i & 1) && tree->count[i + 1])
+    {
+      for (++i; i < tree->size;)
+        i = tree->count[2 * i] ? 2 * i : 2 * i + 1;
+      return i - tree->size;
+    }
+
+  return -1;
+}
+
+// returns the last flagged position at or before `pos`, or -1
+static int yTreePrev(const struct YTree * tree, int pos)
+{
+  int i = tree->size + pos;
+  if (tree->count[i])
+    return pos;
+
+  for (; i > 1; i >>= 1)
+    if ((i & 1) && tree->count[i - 1])
+    {
+      for (--i; i < tree->size;)
+        i = tree->count[2 * i + 1] ? 2 * i + 1 : 2 * i;
+      return i - tree->size;
+    }
+
+  return -1;
+}
+
+// returns the index of `y` in the sorted unique `ys`, which must contain it
+inline static int yIndex(const int * ys, int count, int y)
+{
+  int lo = 0;
+  while (count > 1)
+  {
+    const int half = count / 2;
+    if (ys[lo + half] <= y)
+      lo += half;
+    count -= half;
+  }
+  return lo;
+}
+
+/* Sweep the rects from left to right keeping the active rects, those the sweep
+ * is still inside of, indexed by y. The active rects all cross the sweep line
+ * and do not intersect, so their row ranges are disjoint and only the one
+ * starting before a rect and those starting within it can overlap it. Each
+ * rect absorbs every active rect it intersects, an overlapping rect that has
+ * ended to the left is retired instead.
+ *
+ * Growing a rect to the left can make it reach a rect retired earlier in the
+ * pass, so passes are repeated until nothing merges. */
 int rectsMergeOverlapping(FrameDamageRect * rects, int count)
 {
-  if (count == 0)
-    return 0;
+  if (count < 2)
+    return count;
 
-  bool removed[count];
-  bool changed;
+  /* the merged rects only ever use coordinates of the input rects, so the
+   * rows can be compressed to the distinct edges */
+  int   yCount = 0;
+  int   size   = 1;
+  while (size < 2 * count)
+    size <<= 1;
 
-  memset(removed, 0, sizeof(removed));
+  int  * ys      = malloc(sizeof(*ys) * 2 * count);
+  int  * owner   = malloc(sizeof(*owner) * 2 * count);
+  bool * removed = malloc(sizeof(*removed) * count);
+  struct YTree tree =
+  {
+    .size  = size,
+    .count = malloc(sizeof(*tree.count) * 2 * size)
+  };
 
+  if (!ys || !owner || !removed || !tree.count)
+  {
+    DEBUG_ERROR("Out of memory");
+    goto out;
+  }
+
+  for (int i = 0; i < count; ++i)
+  {
+    ys[yCount++] = rects[i].y;
+    ys[yCount++] = rects[i].y + rects[i].height;
+  }
+  qsort(ys, yCount, sizeof(*ys), intCompare);
+
+  int unique = 1;
+  for (int i = 1; i < yCount; ++i)
+    if (ys[i] != ys[unique - 1])
+      ys[unique++] = ys[i];
+  yCount = unique;
+
+  bool changed;
   do
   {
     changed = false;
-    for (int i = 0; i < count; ++i)
-    {
-      if (removed[i])
-        continue;
+    memset(removed, 0, sizeof(*removed) * count);
+    memset(tree.count, 0, sizeof(*tree.count) * 2 * size);
+    qsort(rects, count, sizeof(*rects), rectXCompare);
 
-      for (int j = i + 1; j < count; ++j)
+    for (int j = 0; j < count; ++j)
+    {
+      FrameDamageRect * rect = rects + j;
+      for (;;)
       {
-        if (removed[j] || !rectIntersects(rects + i, rects + j))
+        const int top    = yIndex(ys, yCount, rect->y);
+        const int bottom = yIndex(ys, yCount, rect->y + rect->height);
+
+        int pos = yTreePrev(&tree, top);
+        if (pos < 0 || yIndex(ys, yCount,
+              rects[owner[pos]].y + rects[owner[pos]].height) < top)
+        {
+          pos = top + 1 < yCount ? yTreeNext(&tree, top + 1) : -1;
+          if (pos > bottom)
+            pos = -1;
+        }
+
+        if (pos < 0)
+        {
+          owner[top] = j;
+          yTreeSet(&tree, top, 1);
+          break;
+        }
+
+        yTreeSet(&tree, pos, 0);
+        const int i = owner[pos];
+        if (!rectIntersects(rects + i, rect))
           continue;
 
-        const uint32_t x2 = max(rects[i].x + rects[i].width,
-            rects[j].x + rects[j].width);
-        const uint32_t y2 = max(rects[i].y + rects[i].height,
-            rects[j].y + rects[j].height);
+        const uint32_t x1 = min(rect->x, rects[i].x);
+        const uint32_t y1 = min(rect->y, rects[i].y);
+        const uint32_t x2 = max(rect->x + rect->width,
+            rects[i].x + rects[i].width);
+        const uint32_t y2 = max(rect->y + rect->height,
+            rects[i].y + rects[i].height);
 
-        rects[i].x      = min(rects[i].x, rects[j].x);
-        rects[i].y      = min(rects[i].y, rects[j].y);
-        rects[i].width  = x2 - rects[i].x;
-        rects[i].height = y2 - rects[i].y;
+        rect->x      = x1;
+        rect->y      = y1;
+        rect->width  = x2 - x1;
+        rect->height = y2 - y1;
 
-        removed[j] = true;
+        removed[i] = true;
         changed    = true;
       }
     }
+
+    count = removeRects(rects, count, removed);
   }
-  while (changed);
+  while (changed && count > 1);
 
-  return removeRects(rects, count, removed);
+out:
+  free(tree.count);
+  free(removed);
+  free(owner);
+  free(ys);
+  return count;
 }
 
 int rectsRejectContained(FrameDamageRect * rects, int count)
 {
+  if (count < 2)
+    return count;
+
   bool removed[count];
   memset(removed, 0, sizeof(removed));
 
+  /* sorted by x and then by descending width, a rect can only be contained by
+   * one before it, and only by those that have not ended to the left of it */
+  qsort(rects, count, sizeof(*rects), rectXCompare);
+
+  int active[count];
+  int actives = 0;
+  for (int j = 0; j < count; ++j)
+  {
+    int o = 0;
+    for (int i = 0; i < actives; ++i)
+    {
+      const FrameDamageRect * rect = rects + active[i];
+      if (rect->x + rect->width < rects[j].x)
+        continue;
+
+      active[o++] = active[i];
+      if (!removed[j] && rectContains(rect, rects + j))
+        removed[j] = true;
+    }
+    actives = o;
+
+    if (!removed[j])
+      active[actives++] = j;
+  }
+
+  return removeRects(rects, count, removed);
+}
+
+struct RegionCorner
+{
+  int x;
+  int y;
+  int delta;
+  int set;
+};
+
+struct RegionEdge
+{
+  int x;
+  int delta[2];
+};
+
+static int regionCornerCompare(const void * a_, const void * b_)
+{
+  const struct RegionCorner * a = a_;
+  const struct RegionCorner * b = b_;
+
+  if (a->y < b->y) return -1;
+  if (a->y > b->y) return +1;
+  if (a->x < b->x) return -1;
+  if (a->x > b->x) return +1;
+  return 0;
+}
+
+inline static bool sameSpans(const FrameDamageRect * a,
+    const FrameDamageRect * b, int count)
+{
   for (int i = 0; i < count; ++i)
+    if (a[i].x != b[i].x || a[i].width != b[i].width)
+      return false;
+  return true;
+}
+
+/* Sweep the corners of both sets from top to bottom, maintaining the edges
+ * crossing the current band sorted by x along with how many rects of each set
+ * they open or close. Each band is emitted as rects covering the spans where
+ * the operation holds, and merged with the band above if it has the same
+ * spans. */
+static int regionOp(const FrameDamageRect * a, int countA,
+    const FrameDamageRect * b, int countB, bool subtract,
+    FrameDamageRect * out, int maxOut)
+{
+  const int maxCorners = 4 * (countA + countB);
+  if (maxCorners == 0)
+    return 0;
+
+  // the sizes come from the caller, keep these off the stack
+  struct RegionCorner * corners = malloc(sizeof(*corners) * maxCorners);
+  struct RegionEdge   * edges   = malloc(sizeof(*edges) * maxCorners * 3);
+  if (!corners || !edges)
   {
-    if (removed[i])
-      continue;
+    DEBUG_ERROR("Out of memory");
+    free(edges);
+    free(corners);
+    return -1;
+  }
 
-    for (int j = 0; j < count; ++j)
+  int cornerCount = 0;
+  for (int set = 0; set < 2; ++set)
+  {
+    const FrameDamageRect * rects = set ? b : a;
+    const int count = set ? countB : countA;
+    for (int i = 0; i < count; ++i)
     {
-      if (j == i || removed[j])
+      const FrameDamageRect * rect = rects + i;
+      if (rect->width == 0 || rect->height == 0)
         continue;
 
-      removed[j] = rectContains(rects + i, rects + j);
+      const int x2 = rect->x + rect->width;
+      const int y2 = rect->y + rect->height;
+      corners[cornerCount++] = (struct RegionCorner) {
+        .x = rect->x, .y = rect->y, .delta =  1, .set = set };
+      corners[cornerCount++] = (struct RegionCorner) {
+        .x = x2     , .y = rect->y, .delta = -1, .set = set };
+      corners[cornerCount++] = (struct RegionCorner) {
+        .x = rect->x, .y = y2     , .delta = -1, .set = set };
+      corners[cornerCount++] = (struct RegionCorner) {
+        .x = x2     , .y = y2     , .delta =  1, .set = set };
     }
   }
 
-  return removeRects(rects, count, removed);
+  int outCount  = 0;
+  if (cornerCount == 0)
+    goto out;
+
+  qsort(corners, cornerCount, sizeof(*corners), regionCornerCompare);
+
+  struct RegionEdge * active_[2] = { edges, edges + maxCorners };
+  struct RegionEdge * change = edges + 2 * maxCorners;
+  int activeRow = 0;
+  int actives   = 0;
+  int prevY     = 0;
+  int bandStart = 0;
+  int bandCount = 0;
+  int bandY2    = -1;
+
+  for (int rs = 0; rs < cornerCount;)
+  {
+    const int y = corners[rs].y;
+    int re = rs;
+    while (re < cornerCount && corners[re].y == y)
+      ++re;
+
+    struct RegionEdge * active = active_[activeRow];
+    if (actives > 0 && y > prevY)
+    {
+      const int start = outCount;
+      int  depth[2] = { 0, 0 };
+      bool inside   = false;
+      int  x1       = 0;
+
+      for (int i = 0; i < actives; ++i)
+      {
+        depth[0] += active[i].delta[0];
+        depth[1] += active[i].delta[1];
+
+        const bool in = subtract ?
+          depth[0] > 0 && depth[1] == 0 :
+          depth[0] > 0 || depth[1] > 0;
+
+        if (in == inside)
+          continue;
+
+        inside = in;
+        if (in)
+        {
+          x1 = active[i].x;
+          continue;
+        }
+
+        if (outCount == maxOut)
+        {
+          outCount = -1;
+          goto out;
+        }
+
+        out[outCount++] = (FrameDamageRect) {
+          .x      = x1,
+          .y      = prevY,
+          .width  = active[i].x - x1,
+          .height = y - prevY
+        };
+      }
+
+      const int spans = outCount - start;
+      if (spans > 0)
+      {
+        if (bandY2 == prevY && bandCount == spans &&
+            sameSpans(out + bandStart, out + start, spans))
+        {
+          for (int i = 0; i < spans; ++i)
+            out[bandStart + i].height += y - prevY;
+          outCount = start;
+        }
+        else
+        {
+          bandStart = start;
+          bandCount = spans;
+        }
+        bandY2 = y;
+      }
+    }
+
+    int changes = 0;
+    for (int i = rs; i < re;)
+    {
+      struct RegionEdge edge = { .x = corners[i].x };
+      while (i < re && corners[i].x == edge.x)
+      {
+        edge.delta[corners[i].set] += corners[i].delta;
+        ++i;
+      }
+
+      if (edge.delta[0] || edge.delta[1])
+        change[changes++] = edge;
+    }
+
+    struct RegionEdge * new = active_[activeRow ^ 1];
+    int ai = 0;
+    int ci = 0;
+    int ni = 0;
+
+    while (ai < actives && ci < changes)
+    {
+      if (active[ai].x < change[ci].x)
+        new[ni++] = active[ai++];
+      else if (active[ai].x > change[ci].x)
+        new[ni++] = change[ci++];
+      else
+      {
+        active[ai].delta[0] += change[ci  ].delta[0];
+        active[ai].delta[1] += change[ci++].delta[1];
+        if (active[ai].delta[0] || active[ai].delta[1])
+          new[ni++] = active[ai];
+        ++ai;
+      }
+    }
+
+    // only one of (actives - ai) and (changes - ci) will be non-zero.
+    memcpy(new + ni, active + ai, (actives - ai) * sizeof(struct RegionEdge));
+    memcpy(new + ni, change + ci, (changes - ci) * sizeof(struct RegionEdge));
+    ni += actives - ai;
+    ni += changes - ci;
+
+    actives    = ni;
+    prevY      = y;
+    rs         = re;
+    activeRow ^= 1;
+  }
+
+out:
+  free(edges);
+  free(corners);
+  return outCount;
+}
+
+int rectsUnion(const FrameDamageRect * rects, int count,
+    FrameDamageRect * out, int maxOut)
+{
+  return regionOp(rects, count, NULL, 0, false, out, maxOut);
+}
+
+int rectsSubtract(const FrameDamageRect * a, int countA,
+    const FrameDamageRect * b, int countB,
+    FrameDamageRect * out, int maxOut)
+{
+  return regionOp(a, countA, b, countB, true, out, maxOut);
+}
+
+// the number of neighbours considered when looking for a rect to merge with
+#define COALESCE_WINDOW 8
+
+struct CoalesceCandidate
+{
+  int      i, j;
+  uint64_t cost;
+};
+
+static int rectYCompare(const void * a_, const void * b_)
+{
+  const FrameDamageRect * a = a_;
+  const FrameDamageRect * b = b_;
+
+  if (a->y < b->y) return -1;
+  if (a->y > b->y) return +1;
+  if (a->x < b->x) return -1;
+  if (a->x > b->x) return +1;
+  return 0;
+}
+
+static int candidateCompare(const void * a_, const void * b_)
+{
+  const struct CoalesceCandidate * a = a_;
+  const struct CoalesceCandidate * b = b_;
+
+  if (a->cost < b->cost) return -1;
+  if (a->cost > b->cost) return +1;
+  return 0;
+}
+
+inline static uint64_t rectArea(const FrameDamageRect * rect)
+{
+  return (uint64_t)rect->width * rect->height;
+}
+
+inline static FrameDamageRect rectBounds(const FrameDamageRect * a,
+    const FrameDamageRect * b)
+{
+  const uint32_t x1 = min(a->x, b->x);
+  const uint32_t y1 = min(a->y, b->y);
+  return (FrameDamageRect) {
+    .x      = x1,
+    .y      = y1,
+    .width  = max(a->x + a->width , b->x + b->width ) - x1,
+    .height = max(a->y + a->height, b->y + b->height) - y1
+  };
+}
+
+inline static uint64_t rectOverlap(const FrameDamageRect * a,
+    const FrameDamageRect * b)
+{
+  const uint32_t x1 = max(a->x, b->x);
+  const uint32_t y1 = max(a->y, b->y);
+  const uint32_t x2 = min(a->x + a->width , b->x + b->width );
+  const uint32_t y2 = min(a->y + a->height, b->y + b->height);
+  if (x2 <= x1 || y2 <= y1)
+    return 0;
+  return (uint64_t)(x2 - x1) * (y2 - y1);
+}
+
+int rectsCoalesce(FrameDamageRect * rects, int count, int maxRects)
+{
+  maxRects = max(maxRects, 1);
+  count    = rectsMergeOverlapping(rects, count);
+
+  /* each pass pairs every rect with the nearby rect that wastes the least area
+   * when merged, and then merges the cheapest pairs until enough rects have
+   * been removed. The merged rects are not merged with any they now overlap
+   * as this tends to cascade into a single rect covering the frame. */
+  while (count > maxRects)
+  {
+    qsort(rects, count, sizeof(*rects), rectYCompare);
+
+    struct CoalesceCandidate candidates[count];
+    int candidateCount = 0;
+    for (int i = 0; i < count - 1; ++i)
+    {
+      struct CoalesceCandidate best = { .i = i, .j = -1, .cost = UINT64_MAX };
+      const int end = min(count, i + 1 + COALESCE_WINDOW);
+      for (int j = i + 1; j < end; ++j)
+      {
+        const FrameDamageRect bounds = rectBounds(rects + i, rects + j);
+        const uint64_t cost = rectArea(&bounds) -
+          (rectArea(rects + i) + rectArea(rects + j) -
+           rectOverlap(rects + i, rects + j));
+
+        if (cost < best.cost)
+        {
+          best.j    = j;
+          best.cost = cost;
+        }
+      }
+      candidates[candidateCount++] = best;
+    }
+    qsort(candidates, candidateCount, sizeof(*candidates), candidateCompare);
+
+    bool used   [count];
+    bool removed[count];
+    memset(used   , 0, sizeof(used   ));
+    memset(removed, 0, sizeof(removed));
+
+    int merges = count - maxRects;
+    for (int i = 0; i < candidateCount && merges > 0; ++i)
+    {
+      const struct CoalesceCandidate * c = candidates + i;
+      if (used[c->i] || used[c->j])
+        continue;
+
+      rects[c->i] = rectBounds(rects + c->i, rects + c->j);
+      used   [c->i] = true;
+      used   [c->j] = true;
+      removed[c->j] = true;
+      --merges;
+    }
+
+    count = removeRects(rects, count, removed);
+  }
+
+  return count;
 }
 
 static void rectCopyUnaligned_memcpy(
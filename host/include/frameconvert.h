@@ -0,0 +1,69 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_HOST_FRAMECONVERT_
+#define _H_LG_HOST_FRAMECONVERT_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interface/capture.h"
+#include "common/vector.h"
+
+typedef struct FrameConvert FrameConvert;
+
+typedef struct FrameConvertFormat
+{
+  CaptureFormat   format;
+  CaptureRotation rotation;
+  unsigned int    frameWidth, frameHeight;
+  unsigned int    dataWidth , dataHeight;
+  unsigned int    stride, pitch, bpp;
+}
+FrameConvertFormat;
+
+/**
+ * Register the `downsample`, `downsampleFilter`, `allowRGB24` and `rotate`
+ * options for the capture module
+ */
+void frameConvert_initOptions(const char * module, Vector * downsampleRules);
+
+bool frameConvert_new(FrameConvert ** fc, const char * module,
+    Vector * downsampleRules);
+void frameConvert_free(FrameConvert ** fc);
+
+/**
+ * Configure the conversion for the source frame and fill `out` with the
+ * format of the frame to send.
+ *
+ * Returns false if the frame needs no conversion and can be sent as is.
+ */
+bool frameConvert_configure(FrameConvert * fc, unsigned int width,
+    unsigned int height, CaptureFormat format, FrameConvertFormat * out);
+
+/**
+ * Convert the damaged regions of `src` and return the converted frame. The
+ * damage rects are transformed in place into the output coordinates, a
+ * `count` of zero indicates full frame damage.
+ */
+const uint8_t * frameConvert_process(FrameConvert * fc, const uint8_t * src,
+    unsigned int srcPitch, FrameDamageRect * rects, unsigned int * count);
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_HOST_FRAMEDIFF_
+#define _H_LG_HOST_FRAMEDIFF_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/types.h"
+
+// the size of the tiles the frames are compared in, in pixels
+#define FRAMEDIFF_TILE_SIZE 64
+
+typedef struct FrameDiff FrameDiff;
+
+bool frameDiff_new(FrameDiff ** diff);
+void frameDiff_free(FrameDiff ** diff);
+
+/**
+ * Forget the previous frame, the next compare will report full damage
+ */
+void frameDiff_reset(FrameDiff * diff);
+
+/**
+ * Compare `src` against the previous frame and write the tiles that changed
+ * into `rects`, merged into as few rects as practical. `src` then becomes the
+ * previous frame for the next compare.
+ *
+ * `count` is set to the number of rects, or zero for full frame damage, which
+ * is also used if more than `maxRects` rects would be needed.
+ *
+ * Returns false if the frame has not changed.
+ */
+bool frameDiff_compare(FrameDiff * diff, const uint8_t * src,
+    unsigned int width, unsigned int height, unsigned int pitch,
+    unsigned int bpp, FrameDamageRect * rects, unsigned int maxRects,
+    unsigned int * count);
+
+#endif
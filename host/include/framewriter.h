@@ -0,0 +1,85 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_HOST_FRAMEWRITER_
+#define _H_LG_HOST_FRAMEWRITER_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/framebuffer.h"
+#include "common/types.h"
+
+/* The maximum number of rects tracked per frame buffer, beyond this the
+ * history for that buffer is coalesced into fewer, larger rects */
+#define FRAMEWRITER_MAX_RECTS 256
+
+typedef struct FrameWriter FrameWriter;
+
+typedef struct FrameWriterStats
+{
+  uint64_t frames;      // frames written
+  uint64_t fullFrames;  // frames that required a full copy
+  uint64_t bytesCopied; // bytes actually copied into the frame buffers
+  uint64_t bytesTotal;  // bytes that full copies would have required
+  uint64_t compressedFrames;  // frames that were compressed
+  uint64_t bytesCompressed;   // bytes written for the compressed frames
+  uint64_t bytesUncompressed; // the raw size of the compressed frames
+}
+FrameWriterStats;
+
+/**
+ * Create a damage-aware writer for `frameBuffers` frame buffers
+ */
+bool frameWriter_new(FrameWriter ** writer, unsigned int frameBuffers);
+void frameWriter_free(FrameWriter ** writer);
+
+/**
+ * Discard the damage history of all frame buffers, this must be called when
+ * the frame format or dimensions change
+ */
+void frameWriter_invalidate(FrameWriter * writer);
+
+/**
+ * Select if the next frame is compressed, frames are only compressed if
+ * `app:compressFrames` is enabled and `frameSize` exceeds `maxFrameSize`.
+ * Returns true if the frame will be compressed.
+ */
+bool frameWriter_useCompression(FrameWriter * writer, size_t frameSize,
+    size_t maxFrameSize);
+
+/**
+ * Write `src` into the frame buffer at `index`, only copying the regions that
+ * have changed since that frame buffer was last written. A `damageCount` of
+ * zero indicates full frame damage. Compressed frames are always written in
+ * full.
+ *
+ * Returns the number of bytes written to the frame buffer, the encoded size
+ * for compressed frames.
+ */
+size_t frameWriter_write(FrameWriter * writer, unsigned int index,
+    FrameBuffer * frame, unsigned int dstPitch,
+    const uint8_t * src, unsigned int srcPitch,
+    unsigned int height, unsigned int bpp,
+    const FrameDamageRect * damage, unsigned int damageCount);
+
+void frameWriter_getStats(FrameWriter * writer, FrameWriterStats * stats);
+
+#endif
@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "common/KVMFR.h"
+#include "common/framedamage.h"
 
 #ifdef __cplusplus
 /* using common/framebuffer.h breaks compatibillity with C++ due to it's usage
@@ -82,12 +83,14 @@ typedef struct CaptureFrame
   unsigned        stride;       // total width of one row of data in pixels
   CaptureFormat   format;       // the data format of the frame
   bool            truncated;    // true if the frame data is truncated
+  bool            compressed;   // true if the frame data is a KVMFRCodec stream
   bool            hdr;          // true if the frame format is HDR
   bool            hdrPQ;        // true if the frame format is PQ transformed
   CaptureRotation rotation;     // output rotation of the frame
 
+  // only the first damageRectsCount rects are valid, the rest are not cleared
   uint32_t        damageRectsCount;
-  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+  FrameDamageRect damageRects[FRAMEDAMAGE_MAX_RECTS];
 }
 CaptureFrame;
 
@@ -136,9 +139,13 @@ typedef struct CaptureInterface
     unsigned frameBufferIndex,
     CaptureFrame * frame,
     const size_t maxFrameSize);
+  /* `bytesWritten` is set by the caller to the size of the frame data, backends
+   * that write less, such as only the damaged regions or a compressed frame,
+   * report the bytes actually written */
   CaptureResult (*getFrame  )(
     unsigned frameBufferIndex,
     FrameBuffer  * frame,
-    const size_t maxFrameSize);
+    const size_t maxFrameSize,
+    size_t       * bytesWritten);
 }
 CaptureInterface;
@@ -25,15 +25,35 @@
 #include "common/debug.h"
 #include "common/event.h"
 #include "common/thread.h"
+#include "common/array.h"
+#include "framewriter.h"
+#include "framediff.h"
+#include "frameconvert.h"
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <poll.h>
 #include <xcb/shm.h>
 #include <xcb/xfixes.h>
+#include <xcb/damage.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
+// the most damaged regions that are fetched individually
+#define XCB_MAX_SUBIMAGES  64
+// how long to wait for damage before reporting a timeout
+#define XCB_DAMAGE_POLL_MS 1
+// how long the frame thread waits for a frame before reporting a timeout
+#define XCB_FRAME_TIMEOUT  100
+
+struct SubImage
+{
+  xcb_shm_get_image_cookie_t cookie;
+  FrameDamageRect            rect;
+  size_t                     offset;
+};
+
 struct xcb
 {
   bool                        initialized;
@@ -44,6 +64,13 @@ struct xcb
   int                         shmID;
   void                      * data;
   LGEvent                   * frameEvent;
+  unsigned                    frameBuffers;
+  FrameWriter               * frameWriter;
+  FrameDiff                 * frameDiff;
+  FrameConvert              * frameConvert;
+  bool                        convert;
+  FrameConvertFormat          format;
+  const uint8_t             * frameData;
 
   CaptureGetPointerBuffer     getPointerBufferFn;
   CapturePostPointerBuffer    postPointerBufferFn;
@@ -57,10 +84,20 @@ struct xcb
 
   bool                                 hasFrame;
   xcb_shm_get_image_cookie_t           imgC;
+  unsigned int                         damageCount;
+  FrameDamageRect                      damage[FRAMEDAMAGE_MAX_RECTS];
+
+  xcb_damage_damage_t                  damageID;
+  xcb_xfixes_region_t                  damageRegion;
+  uint8_t                              damageEvent;
+  bool                                 needFullFrame;
+  unsigned int                         subImageCount;
+  struct SubImage                      subImages[XCB_MAX_SUBIMAGES];
   xcb_xfixes_get_cursor_image_cookie_t curC;
 };
 
 static struct xcb * this = NULL;
+static Vector downsampleRules = {0};
 
 static int pointerThread(void * unused);
 
@@ -79,10 +116,25 @@ static void xcb_initOptions(void)
 {
   struct Option options[] =
   {
+    {
+      .module         = "xcb",
+      .name           = "useDamage",
+      .description    = "Use XDamage to only capture the regions that changed",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "xcb",
+      .name           = "frameDiff",
+      .description    = "Compare each frame to the last and only send the regions that changed",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
     {0}
   };
 
   option_register(options);
+  frameConvert_initOptions("xcb", &downsampleRules);
 }
 
 static bool xcb_create(
@@ -96,6 +148,7 @@ static bool xcb_create(
   this->shmID      = -1;
   this->data       = (void *)-1;
   this->frameEvent = lgCreateEvent(true, 20);
+  this->frameBuffers = frameBuffers;
 
   this->getPointerBufferFn = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
@@ -139,9 +192,11 @@ static bool xcb_init(void * ivshmemBase, unsigned * alignSize)
   this->pitch     = this->width * 4;
   DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
 
+  /* the segment holds the full frame followed by space for the damaged
+   * sub-images, which are packed and have to be copied into the frame */
   this->seg   = xcb_generate_id(this->xcb);
   const size_t maxFrameSize = this->width * this->height * 4;
-  this->shmID = shmget(IPC_PRIVATE, maxFrameSize, IPC_CREAT | 0777);
+  this->shmID = shmget(IPC_PRIVATE, maxFrameSize * 2, IPC_CREAT | 0777);
   if (this->shmID == -1)
   {
     DEBUG_ERROR("shmget failed");
@@ -157,6 +212,18 @@ static bool xcb_init(void * ivshmemBase, unsigned * alignSize)
   }
   DEBUG_INFO("Frame Data       : 0x%" PRIXPTR, (uintptr_t)this->data);
 
+  if (!frameWriter_new(&this->frameWriter, this->frameBuffers))
+    goto fail;
+
+  if (!frameConvert_new(&this->frameConvert, "xcb", &downsampleRules))
+    goto fail;
+
+  this->convert = frameConvert_configure(this->frameConvert,
+      this->width, this->height, CAPTURE_FMT_BGRA, &this->format);
+
+  if (option_get_bool("xcb", "frameDiff") && !frameDiff_new(&this->frameDiff))
+    goto fail;
+
   xcb_query_extension_cookie_t extension_cookie =
 		xcb_query_extension(this->xcb, strlen("XFIXES"), "XFIXES");
   xcb_query_extension_reply_t * extension_reply =
@@ -181,6 +248,34 @@ static bool xcb_init(void * ivshmemBase, unsigned * alignSize)
   }
   free(version_reply);
 
+  this->needFullFrame = true;
+  this->subImageCount = 0;
+  if (option_get_bool("xcb", "useDamage"))
+  {
+    const xcb_query_extension_reply_t * damageExt =
+      xcb_get_extension_data(this->xcb, &xcb_damage_id);
+
+    xcb_damage_query_version_reply_t * damageVersion = NULL;
+    if (damageExt->present)
+      damageVersion = xcb_damage_query_version_reply(this->xcb,
+          xcb_damage_query_version(this->xcb, XCB_DAMAGE_MAJOR_VERSION,
+            XCB_DAMAGE_MINOR_VERSION), NULL);
+
+    if (!damageVersion)
+      DEBUG_WARN("Extension \"DAMAGE\" isn't available, capturing full frames");
+    else
+    {
+      free(damageVersion);
+      this->damageEvent  = damageExt->first_event + XCB_DAMAGE_NOTIFY;
+      this->damageID     = xcb_generate_id(this->xcb);
+      this->damageRegion = xcb_generate_id(this->xcb);
+      xcb_damage_create(this->xcb, this->damageID, this->xcbScreen->root,
+          XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+      xcb_xfixes_create_region(this->xcb, this->damageRegion, 0, NULL);
+      DEBUG_INFO("Using XDamage");
+    }
+  }
+
   this->initialized = true;
   return true;
 fail:
@@ -228,12 +323,38 @@ static bool xcb_deinit(void)
     this->shmID = -1;
   }
 
+  if (this->damageID)
+  {
+    xcb_damage_destroy(this->xcb, this->damageID);
+    xcb_xfixes_destroy_region(this->xcb, this->damageRegion);
+    this->damageID     = 0;
+    this->damageRegion = 0;
+  }
+
   if (this->xcb)
   {
     xcb_disconnect(this->xcb);
     this->xcb = NULL;
   }
 
+  if (this->frameWriter)
+  {
+    FrameWriterStats stats;
+    frameWriter_getStats(this->frameWriter, &stats);
+    if (stats.bytesTotal)
+      DEBUG_INFO("Frame Writes     : %" PRIu64 " (%" PRIu64 " full), %.1f%% copied",
+          stats.frames, stats.fullFrames,
+          (double)stats.bytesCopied * 100.0 / stats.bytesTotal);
+    if (stats.compressedFrames)
+      DEBUG_INFO("Compressed Frames: %" PRIu64 ", %.1f%% of the raw size",
+          stats.compressedFrames,
+          (double)stats.bytesCompressed * 100.0 / stats.bytesUncompressed);
+    frameWriter_free(&this->frameWriter);
+  }
+
+  frameDiff_free(&this->frameDiff);
+  frameConvert_free(&this->frameConvert);
+
   this->initialized = false;
   return true;
 }
@@ -245,6 +366,106 @@ static void xcb_free(void)
   this = NULL;
 }
 
+/* Collect the damage since the last capture and request the damaged regions,
+ * returns false if nothing has changed */
+static bool xcb_requestDamage(void)
+{
+  bool damaged = false;
+  xcb_generic_event_t * event;
+  while((event = xcb_poll_for_event(this->xcb)))
+  {
+    if ((event->response_type & 0x7f) == this->damageEvent)
+      damaged = true;
+    free(event);
+  }
+
+  if (!damaged && !this->needFullFrame)
+  {
+    struct pollfd pfd =
+    {
+      .fd     = xcb_get_file_descriptor(this->xcb),
+      .events = POLLIN
+    };
+    poll(&pfd, 1, XCB_DAMAGE_POLL_MS);
+    return false;
+  }
+
+  // move the accumulated damage into our region and clear it
+  xcb_damage_subtract(this->xcb, this->damageID, XCB_NONE, this->damageRegion);
+  xcb_xfixes_fetch_region_reply_t * reply = xcb_xfixes_fetch_region_reply(
+      this->xcb, xcb_xfixes_fetch_region(this->xcb, this->damageRegion), NULL);
+  if (!reply)
+  {
+    DEBUG_ERROR("Failed to fetch the damage region");
+    return false;
+  }
+
+  const xcb_rectangle_t * rects = xcb_xfixes_fetch_region_rectangles(reply);
+  const unsigned int count = xcb_xfixes_fetch_region_rectangles_length(reply);
+
+  unsigned int damageCount = 0;
+  size_t       damageArea  = 0;
+  for(unsigned int i = 0; i < count && damageCount < ARRAY_LENGTH(this->damage); ++i)
+  {
+    const xcb_rectangle_t * r = rects + i;
+    if (r->x < 0 || r->y < 0 || r->x >= this->width || r->y >= this->height)
+      continue;
+
+    FrameDamageRect * rect = this->damage + damageCount++;
+    *rect = (FrameDamageRect) {
+      .x      = r->x,
+      .y      = r->y,
+      .width  = min(r->width , this->width  - r->x),
+      .height = min(r->height, this->height - r->y)
+    };
+    damageArea += (size_t)rect->width * rect->height;
+  }
+  free(reply);
+
+  if (damageCount == 0 && !this->needFullFrame)
+    return false;
+
+  /* too many rects to be worth the individual requests, or the full frame is
+   * required, grab the entire frame but still report what changed */
+  if (this->needFullFrame || count > ARRAY_LENGTH(this->damage) ||
+      damageCount > XCB_MAX_SUBIMAGES ||
+      damageArea > (size_t)this->width * this->height / 2)
+  {
+    if (this->needFullFrame || count > ARRAY_LENGTH(this->damage))
+      damageCount = 0;
+
+    this->needFullFrame = false;
+    this->subImageCount = 0;
+    this->damageCount   = damageCount;
+    return true;
+  }
+
+  size_t offset = (size_t)this->height * this->pitch;
+  for(unsigned int i = 0; i < damageCount; ++i)
+  {
+    const FrameDamageRect * rect = this->damage + i;
+    struct SubImage * sub = this->subImages + i;
+
+    sub->rect   = *rect;
+    sub->offset = offset;
+    sub->cookie = xcb_shm_get_image_unchecked(
+        this->xcb,
+        this->xcbScreen->root,
+        rect->x, rect->y,
+        rect->width, rect->height,
+        ~0,
+        XCB_IMAGE_FORMAT_Z_PIXMAP,
+        this->seg,
+        offset);
+
+    offset += (size_t)rect->width * rect->height * 4;
+  }
+
+  this->subImageCount = damageCount;
+  this->damageCount   = damageCount;
+  return true;
+}
+
 static CaptureResult xcb_capture(
   unsigned frameBufferIndex,
   FrameBuffer * frame)
@@ -254,6 +475,19 @@ static CaptureResult xcb_capture(
 
   if (!this->hasFrame)
   {
+    if (this->damageID)
+    {
+      if (!xcb_requestDamage())
+        return CAPTURE_RESULT_TIMEOUT;
+
+      if (this->subImageCount > 0)
+      {
+        this->hasFrame = true;
+        lgSignalEvent(this->frameEvent);
+        return CAPTURE_RESULT_OK;
+      }
+    }
+
     this->imgC = xcb_shm_get_image_unchecked(
         this->xcb,
         this->xcbScreen->root,
@@ -272,28 +506,116 @@ static CaptureResult xcb_capture(
   return CAPTURE_RESULT_OK;
 }
 
+static bool xcb_readImage(void)
+{
+  if (this->subImageCount == 0)
+  {
+    xcb_shm_get_image_reply_t * img;
+    img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
+    if (!img)
+    {
+      DEBUG_ERROR("Failed to get image reply");
+      return false;
+    }
+    free(img);
+    return true;
+  }
+
+  bool ok = true;
+  for(unsigned int i = 0; i < this->subImageCount; ++i)
+  {
+    const struct SubImage * sub = this->subImages + i;
+    xcb_shm_get_image_reply_t * img;
+    img = xcb_shm_get_image_reply(this->xcb, sub->cookie, NULL);
+    if (!img)
+    {
+      DEBUG_ERROR("Failed to get sub-image reply");
+      ok = false;
+      continue;
+    }
+    free(img);
+
+    // unpack the sub-image into the frame
+    const unsigned int subPitch = sub->rect.width * 4;
+    const uint8_t * src = (const uint8_t *)this->data + sub->offset;
+    uint8_t       * dst = (uint8_t *)this->data +
+      (size_t)sub->rect.y * this->pitch + sub->rect.x * 4;
+    for(unsigned int y = 0; y < sub->rect.height; ++y)
+    {
+      memcpy(dst, src, subPitch);
+      src += subPitch;
+      dst += this->pitch;
+    }
+  }
+
+  this->subImageCount = 0;
+  return ok;
+}
+
 static CaptureResult xcb_waitFrame(
   unsigned frameBufferIndex,
   CaptureFrame * frame,
   const size_t maxFrameSize)
 {
-  lgWaitEvent(this->frameEvent, TIMEOUT_INFINITE);
+  /* with XDamage a static desktop never signals a frame, time out so the
+   * frame thread can resend the last frame to new clients */
+  if (!lgWaitEvent(this->frameEvent, XCB_FRAME_TIMEOUT))
+    return CAPTURE_RESULT_TIMEOUT;
+
+  if (!xcb_readImage())
+  {
+    this->hasFrame = false;
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  const bool compress = frameWriter_useCompression(this->frameWriter,
+      (size_t)this->format.dataHeight * this->format.pitch, maxFrameSize);
 
   const unsigned int maxHeight = maxFrameSize / this->pitch;
-  this->dataHeight = min(maxHeight, this->height);
+  this->dataHeight = compress ? this->height : min(maxHeight, this->height);
 
+  if (this->damageID)
+  {
+    // the damage was already reported by the X server
+  }
+  else if (!this->frameDiff)
+    this->damageCount = 0;
+  else if (!frameDiff_compare(this->frameDiff, this->data,
+        this->width, this->dataHeight, this->pitch, 4,
+        this->damage, ARRAY_LENGTH(this->damage), &this->damageCount))
+  {
+    // nothing has changed
+    this->hasFrame = false;
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  this->frameData = this->data;
+  if (this->convert)
+  {
+    this->frameData = frameConvert_process(this->frameConvert, this->data,
+        this->pitch, this->damage, &this->damageCount);
+
+    const unsigned int maxRows = maxFrameSize / this->format.pitch;
+    this->dataHeight = compress ? this->format.dataHeight :
+      min(maxRows, this->format.dataHeight);
+  }
 
   frame->screenWidth  = this->width;
   frame->screenHeight = this->height;
-  frame->dataWidth    = this->width;
+  frame->dataWidth    = this->format.dataWidth;
   frame->dataHeight   = this->dataHeight;
-  frame->frameWidth   = this->width;
-  frame->frameHeight  = this->height;
-  frame->truncated    = maxHeight < this->height;
-  frame->pitch        = this->pitch;
-  frame->stride       = this->width;
-  frame->format       = CAPTURE_FMT_BGRA;
-  frame->rotation     = CAPTURE_ROT_0;
+  frame->frameWidth   = this->format.frameWidth;
+  frame->frameHeight  = this->format.frameHeight;
+  frame->truncated    = this->dataHeight < this->format.dataHeight;
+  frame->compressed   = compress;
+  frame->pitch        = this->format.pitch;
+  frame->stride       = this->format.stride;
+  frame->format       = this->format.format;
+  frame->rotation     = this->format.rotation;
+
+  frame->damageRectsCount = this->damageCount;
+  memcpy(frame->damageRects, this->damage,
+      this->damageCount * sizeof(*this->damage));
 
   return CAPTURE_RESULT_OK;
 }
@@ -301,21 +623,17 @@ static CaptureResult xcb_waitFrame(
 static CaptureResult xcb_getFrame(
   unsigned frameBufferIndex,
   FrameBuffer  * frame,
-  const size_t maxFrameSize)
+  const size_t maxFrameSize,
+  size_t       * bytesWritten)
 {
   DEBUG_ASSERT(this);
   DEBUG_ASSERT(this->initialized);
 
-  xcb_shm_get_image_reply_t * img;
-  img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
-  if (!img)
-  {
-    DEBUG_ERROR("Failed to get image reply");
-    return CAPTURE_RESULT_ERROR;
-  }
-
-  framebuffer_write(frame, this->data, this->pitch);
-  free(img);
+  *bytesWritten = frameWriter_write(this->frameWriter, frameBufferIndex,
+      frame, this->format.pitch,
+      this->frameData, this->format.pitch,
+      this->dataHeight, this->format.bpp,
+      this->damage, this->damageCount);
 
   this->hasFrame = false;
   return CAPTURE_RESULT_OK;
@@ -23,16 +23,34 @@
 #include "interface/platform.h"
 #include "common/util.h"
 #include "common/debug.h"
+#include "common/option.h"
+#include "common/array.h"
 #include "common/stringutils.h"
+#include "framewriter.h"
+#include "framediff.h"
+#include "frameconvert.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include <pipewire/pipewire.h>
 #include <spa/pod/builder.h>
 #include <spa/param/format.h>
 #include <spa/param/video/format-utils.h>
 
+// from drm_fourcc.h, only linear buffers can be read by the CPU
+#define LG_DRM_FORMAT_MOD_LINEAR 0
+
+struct BufferMapping
+{
+  void   * map;
+  size_t   size;
+};
+
 struct pipewire
 {
   struct Portal         * portal;
@@ -51,11 +69,27 @@ struct pipewire
   CaptureFormat format;
   bool          hdr;
   bool          hdrPQ;
+  bool          dmabuf;
   uint8_t     * frameData;
+  int           framePitch;
+  bool          frameHeld; // the stream thread is waiting for us to release it
   unsigned int  formatVer;
+
+  unsigned int  frameBuffers;
+  FrameWriter * frameWriter;
+  FrameDiff   * frameDiff;
+
+  FrameConvert     * frameConvert;
+  bool               convert;
+  FrameConvertFormat outFormat;
+  const uint8_t    * outData;
+
+  unsigned int    damageCount;
+  FrameDamageRect damage[FRAMEDAMAGE_MAX_RECTS];
 };
 
 static struct pipewire * this = NULL;
+static Vector downsampleRules = {0};
 
 // forwards
 
@@ -68,6 +102,32 @@ static const char * pipewire_getName(void)
   return "PipeWire";
 }
 
+static void pipewire_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "pipewire",
+      .name           = "dmabuf",
+      .description    = "Accept linear DMA-BUF frames and map them directly "
+        "(CPU reads of GPU memory may be slower than a shared memory copy)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "pipewire",
+      .name           = "frameDiff",
+      .description    = "Compare each frame to the last and only send the regions that changed",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+  frameConvert_initOptions("pipewire", &downsampleRules);
+}
+
 static bool pipewire_create(
   CaptureGetPointerBuffer getPointerBufferFn,
   CapturePostPointerBuffer postPointerBufferFn,
@@ -77,6 +137,7 @@ static bool pipewire_create(
   DEBUG_ASSERT(!this);
   pw_init(NULL, NULL);
   this = calloc(1, sizeof(*this));
+  this->frameBuffers = frameBuffers;
   return true;
 }
 
@@ -91,12 +152,14 @@ static const struct pw_core_events coreEvents = {
   .error = coreErrorCallback,
 };
 
-static bool startStream(struct pw_stream * stream, uint32_t node)
+static const struct spa_pod * buildFormat(struct spa_pod_builder * builder,
+    bool linear)
 {
-  char buffer[1024];
-  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-  const struct spa_pod * param = spa_pod_builder_add_object(
-    &builder, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+  struct spa_pod_frame frame;
+  spa_pod_builder_push_object(builder, &frame,
+    SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+
+  spa_pod_builder_add(builder,
     SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
     SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
     SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(6,
@@ -106,10 +169,82 @@ static bool startStream(struct pw_stream * stream, uint32_t node)
     SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
       &SPA_RECTANGLE(1920, 1080), &SPA_RECTANGLE(1, 1), &SPA_RECTANGLE(8192, 4320)),
     SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
-      &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)));
+      &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)),
+    0);
+
+  if (linear)
+  {
+    spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier,
+      SPA_POD_PROP_FLAG_MANDATORY);
+    spa_pod_builder_long(builder, LG_DRM_FORMAT_MOD_LINEAR);
+  }
+
+  return spa_pod_builder_pop(builder, &frame);
+}
+
+static bool startStream(struct pw_stream * stream, uint32_t node)
+{
+  char buffer[2048];
+  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+  // prefer the linear DMA-BUF format so the compositor can share its buffers
+  const struct spa_pod * params[2];
+  int count = 0;
+  if (option_get_bool("pipewire", "dmabuf"))
+    params[count++] = buildFormat(&builder, true);
+  params[count++] = buildFormat(&builder, false);
 
   return pw_stream_connect(stream, PW_DIRECTION_INPUT, node,
-    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, &param, 1) >= 0;
+    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS,
+    params, count) >= 0;
+}
+
+static void dmabufSync(const struct spa_data * data, uint64_t flags)
+{
+  struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_READ | flags };
+  while(ioctl(data->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+    if (errno != EINTR && errno != EAGAIN)
+    {
+      DEBUG_WARN("DMA_BUF_IOCTL_SYNC failed: %s", strerror(errno));
+      break;
+    }
+}
+
+static void streamAddBufferCallback(void * opaque, struct pw_buffer * pwBuffer)
+{
+  struct spa_data * data = pwBuffer->buffer->datas;
+  if (data->type != SPA_DATA_DmaBuf || data->data)
+    return;
+
+  // DMA-BUFs are not mapped by PipeWire, map them once for the buffer lifetime
+  struct BufferMapping * mapping = malloc(sizeof(*mapping));
+  if (!mapping)
+  {
+    DEBUG_ERROR("Out of memory");
+    return;
+  }
+
+  mapping->size = data->mapoffset + data->maxsize;
+  mapping->map  = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, data->fd, 0);
+  if (mapping->map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map the DMA-BUF: %s", strerror(errno));
+    free(mapping);
+    return;
+  }
+
+  pwBuffer->user_data = mapping;
+}
+
+static void streamRemoveBufferCallback(void * opaque, struct pw_buffer * pwBuffer)
+{
+  struct BufferMapping * mapping = pwBuffer->user_data;
+  if (!mapping)
+    return;
+
+  munmap(mapping->map, mapping->size);
+  free(mapping);
+  pwBuffer->user_data = NULL;
 }
 
 static void streamProcessCallback(void * opaque)
@@ -136,13 +271,41 @@ static void streamProcessCallback(void * opaque)
     return;
   }
 
-  struct spa_buffer * buffer = pwBuffer->buffer;
-  if (!buffer->datas[0].chunk->size)
+  struct spa_data * data = pwBuffer->buffer->datas;
+  if (!data->chunk->size)
+  {
+    pw_stream_queue_buffer(this->stream, pwBuffer);
     return;
+  }
+
+  /* read straight from the buffer the compositor shared, this is either
+   * memory PipeWire mapped for us or a DMA-BUF we mapped ourselves */
+  uint8_t * base = data->data;
+  const bool isDmabuf = data->type == SPA_DATA_DmaBuf;
+  if (!base && pwBuffer->user_data)
+    base = (uint8_t *)((struct BufferMapping *)pwBuffer->user_data)->map +
+      data->mapoffset;
+
+  if (!base)
+  {
+    DEBUG_WARN("Unable to access the frame buffer data");
+    pw_stream_queue_buffer(this->stream, pwBuffer);
+    return;
+  }
 
-  this->frameData = buffer->datas[0].data;
+  this->frameData  = base + data->chunk->offset;
+  this->framePitch = data->chunk->stride > 0 ?
+    data->chunk->stride : this->pitch;
 
+  if (isDmabuf)
+    dmabufSync(data, DMA_BUF_SYNC_START);
+
+  // blocks until the frame has been consumed
   pw_thread_loop_signal(this->threadLoop, true);
+
+  if (isDmabuf)
+    dmabufSync(data, DMA_BUF_SYNC_END);
+
   pw_stream_queue_buffer(this->stream, pwBuffer);
 }
 
@@ -197,7 +360,8 @@ static void streamParamChangedCallback(void * opaque, uint32_t id,
   this->hdrPQ  = true; // this is assumed and untested
 
   const int bpp = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
-  this->pitch = this->width * bpp;
+  this->pitch  = this->width * bpp;
+  this->dmabuf = info.flags & SPA_VIDEO_FLAG_MODIFIER;
 
   if (this->hasFormat)
   {
@@ -208,9 +372,14 @@ static void streamParamChangedCallback(void * opaque, uint32_t id,
   char buffer[1024];
   struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
+  /* accept the compositor's own buffers where possible instead of having it
+   * copy each frame into memory PipeWire allocated for us */
+  const int dataType = this->dmabuf ? (1 << SPA_DATA_DmaBuf) :
+    (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd);
+
   param = spa_pod_builder_add_object(
     &builder, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int(1 << SPA_DATA_MemPtr));
+    SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(dataType));
   pw_stream_update_params(this->stream, &param, 1);
 
   this->hasFormat = true;
@@ -233,6 +402,8 @@ static const struct pw_stream_events streamEvents = {
   .process       = streamProcessCallback,
   .state_changed = streamStateChangedCallback,
   .param_changed = streamParamChangedCallback,
+  .add_buffer    = streamAddBufferCallback,
+  .remove_buffer = streamRemoveBufferCallback,
 };
 
 static bool pipewire_init(void * ivshmemBase, unsigned * alignSize)
@@ -325,6 +496,7 @@ static bool pipewire_init(void * ivshmemBase, unsigned * alignSize)
   this->hasFormat     = false;
   this->formatChanged = false;
   this->frameData     = NULL;
+  this->frameHeld     = false;
   pw_stream_add_listener(this->stream, &this->streamListener, &streamEvents, NULL);
 
   if (!startStream(this->stream, pipewireNode))
@@ -347,6 +519,24 @@ static bool pipewire_init(void * ivshmemBase, unsigned * alignSize)
   }
 
   DEBUG_INFO("Frame size       : %dx%d", this->width, this->height);
+  DEBUG_INFO("Buffer type      : %s", this->dmabuf ? "DMA-BUF" : "Memory");
+
+  if (!frameConvert_new(&this->frameConvert, "pipewire", &downsampleRules))
+  {
+    pw_thread_loop_accept(this->threadLoop);
+    goto fail;
+  }
+
+  this->convert = frameConvert_configure(this->frameConvert,
+      this->width, this->height, this->format, &this->outFormat);
+
+  if (!frameWriter_new(&this->frameWriter, this->frameBuffers) ||
+      (option_get_bool("pipewire", "frameDiff") &&
+       !frameDiff_new(&this->frameDiff)))
+  {
+    pw_thread_loop_accept(this->threadLoop);
+    goto fail;
+  }
 
   pw_thread_loop_accept(this->threadLoop);
 
@@ -393,6 +583,24 @@ static bool pipewire_deinit(void)
     this->portal = NULL;
   }
 
+  if (this->frameWriter)
+  {
+    FrameWriterStats stats;
+    frameWriter_getStats(this->frameWriter, &stats);
+    if (stats.bytesTotal)
+      DEBUG_INFO("Frame Writes     : %" PRIu64 " (%" PRIu64 " full), %.1f%% copied",
+          stats.frames, stats.fullFrames,
+          (double)stats.bytesCopied * 100.0 / stats.bytesTotal);
+    if (stats.compressedFrames)
+      DEBUG_INFO("Compressed Frames: %" PRIu64 ", %.1f%% of the raw size",
+          stats.compressedFrames,
+          (double)stats.bytesCompressed * 100.0 / stats.bytesUncompressed);
+    frameWriter_free(&this->frameWriter);
+  }
+
+  frameDiff_free(&this->frameDiff);
+  frameConvert_free(&this->frameConvert);
+
   return true;
 }
 
@@ -423,41 +631,85 @@ restart:
   {
     ++this->formatVer;
     this->formatChanged = false;
+    frameWriter_invalidate(this->frameWriter);
+    if (this->frameDiff)
+      frameDiff_reset(this->frameDiff);
+    this->convert = frameConvert_configure(this->frameConvert,
+        this->width, this->height, this->format, &this->outFormat);
     pw_thread_loop_accept(this->threadLoop);
     goto restart;
   }
 
+  this->frameHeld = true;
   return CAPTURE_RESULT_OK;
 }
 
+// hand the buffer back to the stream thread, it must only be released once
+static void pipewire_releaseFrame(void)
+{
+  if (!this->frameHeld)
+    return;
+
+  this->frameHeld = false;
+  pw_thread_loop_accept(this->threadLoop);
+}
+
 static CaptureResult pipewire_waitFrame(
   unsigned frameBufferIndex,
   CaptureFrame * frame,
   const size_t maxFrameSize)
 {
-  if (this->stop)
+  if (this->stop || !this->frameData)
     return CAPTURE_RESULT_REINIT;
 
+  const bool compress = frameWriter_useCompression(this->frameWriter,
+      (size_t)this->outFormat.dataHeight * this->outFormat.pitch,
+      maxFrameSize);
+
   const unsigned int maxHeight = maxFrameSize / this->pitch;
-  this->dataHeight = min(maxHeight, this->height);
+  this->dataHeight = compress ? this->height : min(maxHeight, this->height);
+
+  this->damageCount = 0;
+  if (this->frameDiff && !frameDiff_compare(this->frameDiff, this->frameData,
+        this->width, this->dataHeight, this->framePitch,
+        this->format == CAPTURE_FMT_RGBA16F ? 8 : 4,
+        this->damage, ARRAY_LENGTH(this->damage), &this->damageCount))
+  {
+    // nothing has changed, release the buffer
+    pipewire_releaseFrame();
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  this->outData = this->frameData;
+  if (this->convert)
+  {
+    this->outData = frameConvert_process(this->frameConvert, this->frameData,
+        this->framePitch, this->damage, &this->damageCount);
+
+    const unsigned int maxRows = maxFrameSize / this->outFormat.pitch;
+    this->dataHeight = compress ? this->outFormat.dataHeight :
+      min(maxRows, this->outFormat.dataHeight);
+  }
 
   frame->formatVer    = this->formatVer;
-  frame->format       = this->format;
+  frame->format       = this->outFormat.format;
   frame->hdr          = this->hdr;
   frame->hdrPQ        = this->hdrPQ;
   frame->screenWidth  = this->width;
   frame->screenHeight = this->height;
-  frame->dataWidth    = this->width;
+  frame->dataWidth    = this->outFormat.dataWidth;
   frame->dataHeight   = this->dataHeight;
-  frame->frameWidth   = this->width;
-  frame->frameHeight  = this->height;
-  frame->truncated    = maxHeight < this->dataHeight;
-  frame->pitch        = this->pitch;
-  frame->stride       = this->width;
-  frame->rotation     = CAPTURE_ROT_0;
-
-  // TODO: implement damage.
-  frame->damageRectsCount = 0;
+  frame->frameWidth   = this->outFormat.frameWidth;
+  frame->frameHeight  = this->outFormat.frameHeight;
+  frame->truncated    = this->dataHeight < this->outFormat.dataHeight;
+  frame->compressed   = compress;
+  frame->pitch        = this->outFormat.pitch;
+  frame->stride       = this->outFormat.stride;
+  frame->rotation     = this->outFormat.rotation;
+
+  frame->damageRectsCount = this->damageCount;
+  memcpy(frame->damageRects, this->damage,
+      this->damageCount * sizeof(*this->damage));
 
   return CAPTURE_RESULT_OK;
 }
@@ -465,15 +717,24 @@ static CaptureResult pipewire_waitFrame(
 static CaptureResult pipewire_getFrame(
   unsigned frameBufferIndex,
   FrameBuffer  * frame,
-  const size_t maxFrameSize)
+  const size_t maxFrameSize,
+  size_t       * bytesWritten)
 {
+  *bytesWritten = 0;
   if (this->stop || !this->frameData)
     return CAPTURE_RESULT_REINIT;
 
-  framebuffer_write(frame, this->frameData,
-      this->dataHeight * this->pitch);
+  // the buffer has already been released, its data is no longer ours
+  if (!this->frameHeld)
+    return CAPTURE_RESULT_TIMEOUT;
 
-  pw_thread_loop_accept(this->threadLoop);
+  *bytesWritten = frameWriter_write(this->frameWriter, frameBufferIndex,
+      frame, this->outFormat.pitch,
+      this->outData, this->convert ? this->outFormat.pitch : this->framePitch,
+      this->dataHeight, this->outFormat.bpp,
+      this->damage, this->damageCount);
+
+  pipewire_releaseFrame();
   return CAPTURE_RESULT_OK;
 }
 
@@ -481,6 +742,7 @@ struct CaptureInterface Capture_pipewire =
 {
   .shortName       = "pipewire",
   .asyncCapture    = false,
+  .initOptions     = pipewire_initOptions,
   .getName         = pipewire_getName,
   .create          = pipewire_create,
   .init            = pipewire_init,
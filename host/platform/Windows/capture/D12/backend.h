@@ -26,8 +26,9 @@
 #include <stdbool.h>
 #include <d3d12.h>
 #include "interface/capture.h"
+#include "common/framedamage.h"
 
-#define D12_MAX_DIRTY_RECTS 256
+#define D12_MAX_DIRTY_RECTS FRAMEDAMAGE_MAX_RECTS
 
 typedef struct D12Backend D12Backend;
 
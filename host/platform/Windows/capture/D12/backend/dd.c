@@ -78,6 +78,9 @@ typedef struct DDInstance
 
   void   * shapeBuffer;
   unsigned shapeBufferSize;
+
+  // scratch space for the frame move rects, too large for the stack
+  DXGI_OUTDUPL_MOVE_RECT moveRects[D12_MAX_DIRTY_RECTS / 2];
 }
 DDInstance;
 
@@ -559,11 +562,11 @@ static bool d12_dd_handleFrameUpdate(DDInstance * this, IDXGIResource * res)
       this->current->nbDirtyRects = nbDirtyRects;
     }
 
-    DXGI_OUTDUPL_MOVE_RECT moveRects[
-      (ARRAY_LENGTH(this->current->dirtyRects) - this->current->nbDirtyRects) / 2
-    ];
+    DXGI_OUTDUPL_MOVE_RECT * moveRects = this->moveRects;
     hr = IDXGIOutputDuplication_GetFrameMoveRects(*this->dup,
-      sizeof(moveRects), moveRects, &requiredSize);
+      (ARRAY_LENGTH(this->current->dirtyRects) - this->current->nbDirtyRects) /
+        2 * sizeof(*moveRects),
+      moveRects, &requiredSize);
     if (FAILED(hr))
     {
       this->current->nbDirtyRects = 0;
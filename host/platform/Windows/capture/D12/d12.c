@@ -77,6 +77,9 @@ struct D12Interface
   RECT      dirtyRects[D12_MAX_DIRTY_RECTS];
   unsigned  nbDirtyRects;
 
+  // scratch space for merging the prior and current dirty rects
+  FrameDamageRect allRects[D12_MAX_DIRTY_RECTS * 2];
+
   // options
   bool debug;
   bool trackDamage;
@@ -631,7 +634,7 @@ static CaptureResult d12_waitFrame(unsigned frameBufferIndex,
 
   {
     // create a clean list of rects
-    FrameDamageRect allRects[desc.nbDirtyRects];
+    FrameDamageRect * allRects = this->allRects;
     unsigned count = 0;
     for(const RECT * rect = desc.dirtyRects;
       rect < desc.dirtyRects + desc.nbDirtyRects; ++rect)
@@ -663,7 +666,7 @@ exit:
 }
 
 static CaptureResult d12_getFrame(unsigned frameBufferIndex,
-  FrameBuffer * frameBuffer, const size_t maxFrameSize)
+  FrameBuffer * frameBuffer, const size_t maxFrameSize, size_t * bytesWritten)
 {
   CaptureResult result = CAPTURE_RESULT_ERROR;
   comRef_scopePush(3);
@@ -759,7 +762,7 @@ static CaptureResult d12_getFrame(unsigned frameBufferIndex,
     {
       DEBUG_TRACE("Damage aware update");
 
-      FrameDamageRect allRects[this->nbDirtyRects + desc.nbDirtyRects];
+      FrameDamageRect * allRects = this->allRects;
       unsigned count = 0;
 
       /* we must update the rects that were dirty in the prior frame also,
@@ -788,8 +791,13 @@ static CaptureResult d12_getFrame(unsigned frameBufferIndex,
       count = rectsMergeOverlapping(allRects, count);
 
       /* copy all the rects */
+      const unsigned bpp =
+        this->dstFormat.format == CAPTURE_FMT_RGBA16F ? 8 : 4;
+      *bytesWritten = 0;
       for(FrameDamageRect * rect = allRects; rect < allRects + count; ++rect)
       {
+        *bytesWritten += (size_t)rect->width * rect->height * bpp;
+
         D3D12_BOX box =
         {
           .left   = rect->x,
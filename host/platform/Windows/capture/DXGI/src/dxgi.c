@@ -29,6 +29,7 @@
 #include "common/rects.h"
 #include "common/runningavg.h"
 #include "common/KVMFR.h"
+#include "common/framedamage.h"
 #include "common/vector.h"
 
 #include <math.h>
@@ -88,9 +89,9 @@ typedef struct Texture
   volatile enum TextureState state;
   void                     * map;
   uint32_t                   damageRectsCount;
-  FrameDamageRect            damageRects[KVMFR_MAX_DAMAGE_RECTS];
+  FrameDamageRect            damageRects[FRAMEDAMAGE_MAX_RECTS];
   int                        texDamageCount;
-  FrameDamageRect            texDamageRects[KVMFR_MAX_DAMAGE_RECTS];
+  FrameDamageRect            texDamageRects[FRAMEDAMAGE_MAX_RECTS];
 
   // post processing
   Vector                     pp;
@@ -100,7 +101,7 @@ Texture;
 typedef struct FrameDamage
 {
   int             count;
-  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  FrameDamageRect rects[FRAMEDAMAGE_MAX_RECTS];
 }
 FrameDamage;
 
@@ -158,7 +159,11 @@ struct DXGIInterface
   int  lastPointerX, lastPointerY;
   bool lastPointerVisible;
 
-  FrameDamage frameDamage[LGMP_Q_FRAME_LEN];
+  FrameDamage frameDamage[LGMP_Q_FRAME_BUFFERS_MAX];
+
+  // scratch space for computeFrameDamage, too large for the stack
+  RECT                   dirtyRects[FRAMEDAMAGE_MAX_RECTS];
+  DXGI_OUTDUPL_MOVE_RECT moveRects [FRAMEDAMAGE_MAX_RECTS / 2];
 };
 
 // locals
@@ -848,7 +853,7 @@ static bool dxgi_init(void * ivshmemBase, unsigned * alignSize)
       DEBUG_WARN("Failed to initialize the RGB24 post processor");
   }
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_BUFFERS_MAX; ++i)
     this->frameDamage[i].count = -1;
 
   QueryPerformanceFrequency(&this->perfFreq) ;
@@ -971,10 +976,10 @@ static void computeFrameDamage(Texture * tex)
   const int maxDamageRectsCount = ARRAY_LENGTH(tex->damageRects);
 
   // Compute dirty rectangles.
-  RECT dirtyRects[maxDamageRectsCount];
+  RECT * dirtyRects = this->dirtyRects;
   UINT dirtyRectsBufferSizeRequired;
   if (FAILED(IDXGIOutputDuplication_GetFrameDirtyRects(*this->dup,
-        sizeof(dirtyRects), dirtyRects,
+        sizeof(this->dirtyRects), dirtyRects,
         &dirtyRectsBufferSizeRequired)))
     return;
 
@@ -986,10 +991,11 @@ static void computeFrameDamage(Texture * tex)
   // on Windows 8 and earlier.
   //
   // Divide by two here since each move generates two dirty regions.
-  DXGI_OUTDUPL_MOVE_RECT moveRects[(maxDamageRectsCount - dirtyRectsCount) / 2];
+  DXGI_OUTDUPL_MOVE_RECT * moveRects = this->moveRects;
   UINT moveRectsBufferSizeRequired;
   if (FAILED(IDXGIOutputDuplication_GetFrameMoveRects(*this->dup,
-        sizeof(moveRects), moveRects,
+        (maxDamageRectsCount - dirtyRectsCount) / 2 * sizeof(*moveRects),
+        moveRects,
         &moveRectsBufferSizeRequired)))
     return;
 
@@ -1029,18 +1035,32 @@ static void computeFrameDamage(Texture * tex)
   tex->damageRectsCount = dirtyRectsCount + actuallyMovedRectsCount;
 }
 
-static void computeTexDamage(Texture * tex)
+/* Add a frame's damage to the damage accumulated in `rects`, coalescing the
+ * accumulated damage when there is no room for it. A count of -1 means the
+ * whole frame is damaged. */
+static void accumulateDamage(FrameDamageRect * rects, int * count,
+  const FrameDamageRect * add, int addCount)
 {
-  if (tex->texDamageCount < 0 || tex->damageRectsCount == 0 ||
-      tex->texDamageCount + tex->damageRectsCount > KVMFR_MAX_DAMAGE_RECTS)
-    tex->texDamageCount = -1;
-  else
+  if (*count < 0 || addCount == 0 || addCount >= FRAMEDAMAGE_MAX_RECTS)
   {
-    memcpy(tex->texDamageRects + tex->texDamageCount, tex->damageRects,
-      tex->damageRectsCount * sizeof(FrameDamageRect));
-    tex->texDamageCount += tex->damageRectsCount;
-    tex->texDamageCount = rectsMergeOverlapping(tex->texDamageRects, tex->texDamageCount);
+    *count = -1;
+    return;
   }
+
+  if (*count + addCount > FRAMEDAMAGE_MAX_RECTS)
+    *count = rectsCoalesce(rects, *count, FRAMEDAMAGE_MAX_RECTS - addCount);
+
+  memcpy(rects + *count, add, addCount * sizeof(*add));
+  *count += addCount;
+}
+
+static void computeTexDamage(Texture * tex)
+{
+  accumulateDamage(tex->texDamageRects, &tex->texDamageCount,
+    tex->damageRects, tex->damageRectsCount);
+
+  if (tex->texDamageCount > 0)
+    tex->texDamageCount = rectsMergeOverlapping(tex->texDamageRects, tex->texDamageCount);
 }
 
 static CaptureResult dxgi_capture(unsigned frameBufferIndex,
@@ -1272,15 +1292,9 @@ static CaptureResult dxgi_capture(unsigned frameBufferIndex,
         Texture * t = this->texture + i;
         if (i == this->texWIndex)
           t->texDamageCount = 0;
-        else if (tex->damageRectsCount > 0 && t->texDamageCount >= 0 &&
-                 t->texDamageCount + tex->damageRectsCount <= KVMFR_MAX_DAMAGE_RECTS)
-        {
-          memcpy(t->texDamageRects + t->texDamageCount, tex->damageRects,
-            tex->damageRectsCount * sizeof(*tex->damageRects));
-          t->texDamageCount += tex->damageRectsCount;
-        }
         else
-          t->texDamageCount = -1;
+          accumulateDamage(t->texDamageRects, &t->texDamageCount,
+            tex->damageRects, tex->damageRectsCount);
       }
 
       // set the state, and signal
@@ -1428,7 +1442,7 @@ static CaptureResult dxgi_waitFrame(unsigned frameBufferIndex,
 }
 
 static CaptureResult dxgi_getFrame(unsigned frameBufferIndex,
-  FrameBuffer * frame, const size_t maxFrameSize)
+  FrameBuffer * frame, const size_t maxFrameSize, size_t * bytesWritten)
 {
   DEBUG_ASSERT(this);
   DEBUG_ASSERT(this->initialized);
@@ -1444,57 +1458,49 @@ static CaptureResult dxgi_getFrame(unsigned frameBufferIndex,
   }
   else
   {
-    if (tex->damageRectsCount                 == 0 ||
-        damage->count                          < 0 ||
-        damage->count + tex->damageRectsCount  > KVMFR_MAX_DAMAGE_RECTS)
+    accumulateDamage(damage->rects, &damage->count,
+      tex->damageRects, tex->damageRectsCount);
+
+    if (damage->count < 0)
     {
       // damage all
       framebuffer_write(frame, tex->map, this->pitch * this->dataHeight);
     }
     else
     {
-      memcpy(damage->rects + damage->count, tex->damageRects,
-        tex->damageRectsCount * sizeof(*tex->damageRects));
-      damage->count += tex->damageRectsCount;
-
+      /* the damage for this buffer is reset below once it is written, so the
+       * rects can be scaled in place */
       if (this->outputFormat == CAPTURE_FMT_BGR_32)
-      {
-        FrameDamageRect scaledDamageRects[damage->count];
-        for (int i = 0; i < ARRAYSIZE(scaledDamageRects); i++) {
-          FrameDamageRect rect = damage->rects[i];
-          int originalX = rect.x;
+        for (int i = 0; i < damage->count; i++) {
+          FrameDamageRect * rect = damage->rects + i;
+          int originalX = rect->x;
           int scaledX = originalX * 3 / 4;
-          rect.x = scaledX;
-          rect.width = (((originalX + rect.width) * 3 + 3) / 4) - scaledX;
-
-          scaledDamageRects[i] = rect;
+          rect->x = scaledX;
+          rect->width = (((originalX + rect->width) * 3 + 3) / 4) - scaledX;
         }
 
-        rectsBufferToFramebuffer(scaledDamageRects, damage->count, this->bpp, frame,
-          this->pitch, this->dataHeight, tex->map, this->pitch);
-      }
-      else
+      rectsBufferToFramebuffer(damage->rects, damage->count, this->bpp, frame,
+        this->pitch, this->dataHeight, tex->map, this->pitch);
+
+      *bytesWritten = 0;
+      for (int i = 0; i < damage->count; i++)
       {
-        rectsBufferToFramebuffer(damage->rects, damage->count, this->bpp, frame,
-          this->pitch, this->dataHeight, tex->map, this->pitch);
+        const FrameDamageRect * rect = damage->rects + i;
+        if (rect->y < this->dataHeight)
+          *bytesWritten += (size_t)rect->width * this->bpp *
+            min(rect->height, this->dataHeight - rect->y);
       }
     }
   }
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_BUFFERS_MAX; ++i)
   {
     struct FrameDamage * damage = this->frameDamage + i;
     if (i == frameBufferIndex)
       damage->count = 0;
-    else if (tex->damageRectsCount > 0 && damage->count >= 0 &&
-             damage->count + tex->damageRectsCount <= KVMFR_MAX_DAMAGE_RECTS)
-    {
-      memcpy(damage->rects + damage->count, tex->damageRects,
-        tex->damageRectsCount * sizeof(*tex->damageRects));
-      damage->count += tex->damageRectsCount;
-    }
     else
-      damage->count = -1;
+      accumulateDamage(damage->rects, &damage->count,
+        tex->damageRects, tex->damageRectsCount);
   }
 
   this->backend->unmapTexture(this->texRIndex);
@@ -92,7 +92,7 @@ struct iface
   bool mouseHookCreated;
   bool forceCompositionCreated;
 
-  struct FrameInfo frameInfo[LGMP_Q_FRAME_LEN];
+  struct FrameInfo frameInfo[LGMP_Q_FRAME_BUFFERS_MAX];
 };
 
 static struct iface * this = NULL;
@@ -353,7 +353,7 @@ static bool nvfbc_init(void * ivshmemBase, unsigned * alignSize)
   DEBUG_INFO("DiffMap block    : %dx%d", 1 << this->diffShift, 1 << this->diffShift);
   DEBUG_INFO("Cursor mode      : %s", this->seperateCursor ? "decoupled" : "integrated");
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_BUFFERS_MAX; ++i)
   {
     this->frameInfo[i].width    = 0;
     this->frameInfo[i].height   = 0;
@@ -426,7 +426,7 @@ static bool nvfbc_deinit(void)
 {
   this->cursorEvent = NULL;
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_BUFFERS_MAX; ++i)
   {
     free(this->frameInfo[i].diffMap);
     this->frameInfo[i].diffMap = NULL;
@@ -633,7 +633,7 @@ static void updateDamageRects(CaptureFrame * frame)
 
       if (ds[c].use && ds[c].id == c)
       {
-        if (rectId >= KVMFR_MAX_DAMAGE_RECTS)
+        if (rectId >= ARRAY_LENGTH(frame->damageRects))
         {
           rectId = 0;
           goto done;
@@ -718,7 +718,7 @@ static CaptureResult nvfbc_waitFrame(unsigned frameBufferIndex,
 }
 
 static CaptureResult nvfbc_getFrame(unsigned frameBufferIndex,
-    FrameBuffer * frame, const size_t maxFrameSize)
+    FrameBuffer * frame, const size_t maxFrameSize, size_t * bytesWritten)
 {
   const unsigned int h = DIFF_MAP_DIM(this->grabHeight, this->diffShift);
   const unsigned int w = DIFF_MAP_DIM(this->grabWidth,  this->diffShift);
@@ -728,6 +728,7 @@ static CaptureResult nvfbc_getFrame(unsigned frameBufferIndex,
   if (info->width == this->grabWidth && info->height == this->grabHeight)
   {
     const bool wasFresh = info->wasFresh;
+    *bytesWritten = 0;
 
     for (unsigned int y = 0; y < h; ++y)
     {
@@ -765,6 +766,7 @@ static CaptureResult nvfbc_getFrame(unsigned frameBufferIndex,
           this->shmStride  * this->bpp,
           this->grabStride * this->bpp,
           width            * this->bpp);
+        *bytesWritten += (size_t)(yend - ystart) * width * this->bpp;
 
         x = x2;
       }
@@ -796,7 +798,7 @@ static CaptureResult nvfbc_getFrame(unsigned frameBufferIndex,
       this->dataHeight * this->grabInfo.dwBufferWidth * this->bpp
     );
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_BUFFERS_MAX; ++i)
   {
     if (i == frameBufferIndex)
     {
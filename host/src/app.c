@@ -25,6 +25,7 @@
 #include "common/debug.h"
 #include "common/option.h"
 #include "common/locking.h"
+#include "common/event.h"
 #include "common/KVMFR.h"
 #include "common/crash.h"
 #include "common/thread.h"
@@ -35,6 +36,9 @@
 #include "common/cpuinfo.h"
 #include "common/util.h"
 #include "common/array.h"
+#include "common/framebuffer.h"
+#include "common/framedamage.h"
+#include "common/histogram.h"
 
 #include <lgmp/host.h>
 
@@ -42,11 +46,21 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #define CONFIG_FILE "looking-glass-host.ini"
-#define POINTER_SHAPE_BUFFERS 3
+
+/* shape buffers stay resident as a cache, recurring shapes are posted from the
+ * buffer that already holds them instead of being copied again */
+#define POINTER_SHAPE_BUFFERS 6
+
+/* the period over which the client's frame consumption rate is measured, and
+ * the step by which the capture interval relaxes once the client keeps up */
+#define PACING_WINDOW_US 250000
+#define PACING_RELAX(x)  ((x) * 7 / 8)
 
 static const struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
 {
@@ -80,6 +94,12 @@ struct app
   PLGMPHost lgmp;
   void *ivshmemBase;
 
+  // serializes lgmpHostProcess, signalled when queue state changes
+  LG_Lock   lgmpLock;
+  LGEvent * lgmpEvent;
+  bool      lgmpHadSubs;
+  uint32_t  lgmpPending;
+
   PLGMPHostQueue pointerQueue;
   PLGMPMemory    pointerMemory[LGMP_Q_POINTER_LEN];
   PLGMPMemory    pointerShapeMemory[POINTER_SHAPE_BUFFERS];
@@ -90,17 +110,74 @@ struct app
   unsigned int   pointerIndex;
   unsigned int   pointerShapeIndex;
 
+  // the content ID of each shape buffer, zero if the buffer is not cached
+  struct
+  {
+    uint32_t     id;
+    uint64_t     lastUse;
+  }
+  pointerShapeCache[POINTER_SHAPE_BUFFERS];
+  uint64_t       pointerShapeUse;
+
+  // the latest position, moves are written here instead of the pointer queue
+  PLGMPMemory      pointerPosMemory;
+  KVMFRCursorPos * pointerPos;
+
+  // live performance counters for the client and other tools to read
+  PLGMPMemory      statsMemory;
+  KVMFRStats     * stats;
+
   unsigned       alignSize;
   size_t         maxFrameSize;
   PLGMPHostQueue frameQueue;
-  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN];
-  KVMFRFrame   * frame      [LGMP_Q_FRAME_LEN];
-  FrameBuffer  * frameBuffer[LGMP_Q_FRAME_LEN];
-
+  PLGMPMemory    frameMemory[LGMP_Q_FRAME_BUFFERS_MAX];
+  KVMFRFrame   * frame      [LGMP_Q_FRAME_BUFFERS_MAX];
+  FrameBuffer  * frameBuffer[LGMP_Q_FRAME_BUFFERS_MAX];
+  unsigned int   frameQueueLen;
+  unsigned int   frameSlots;
+  bool           dropFrames;
+
+  // the slots of the most recent posts, the last `pending` are still in use
+  unsigned int   postedSlots[LGMP_Q_FRAME_LEN_MAX];
+  unsigned int   postedPos;
+
+  CaptureFrame   captureFrame;
   unsigned int   captureIndex;
   unsigned int   readIndex;
+  int            heldIndex;
+
+  // the damage of the held frame, carried into the frame that replaces it
+  FrameDamageRect heldDamage[FRAMEDAMAGE_MAX_RECTS];
+  unsigned int    heldDamageCount;
   bool           frameValid;
   uint32_t       frameSerial;
+  uint64_t       captureTime;
+
+  struct
+  {
+    uint64_t posted;
+    uint64_t dropped;
+    uint64_t stalled; // captures that waited for the client to release a slot
+    uint64_t samples;
+    uint64_t occupancy;
+    uint64_t full;
+  }
+  queueStats;
+
+  // capture pacing, learnt from the rate the client releases frames at
+  struct
+  {
+    bool         enabled;
+    unsigned int maxUs;
+    unsigned int clientUs;
+    uint64_t     windowStart;
+    uint64_t     posted;
+    uint64_t     dropped;
+    uint64_t     stalled;
+    uint32_t     pending;
+    uint64_t     delayed;
+  }
+  pacing;
 
   CaptureInterface * iface;
   bool captureStarted;
@@ -151,10 +228,45 @@ static struct Option options[] =
   {
     .module         = "app",
     .name           = "throttleFPS",
-    .description    = "Throttle Capture Frame Rate",
+    .description    = "Throttle Capture Frame Rate (the maximum rate when pacing to the client)",
     .type           = OPTION_TYPE_INT,
     .value.x_int    = 0,
   },
+  {
+    .module         = "app",
+    .name           = "paceToClient",
+    .description    = "Slow capture to the rate the client consumes frames at instead of capturing frames it will drop or wait for",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "frameQueueLen",
+    .description    = "The number of frames that can be queued for the client (2-8)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = LGMP_Q_FRAME_LEN,
+  },
+  {
+    .module         = "app",
+    .name           = "dropFrames",
+    .description    = "Replace the newest unsent frame instead of stalling capture when the queue is full (needs an extra frame buffer, reducing the maximum frame size)",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "copyThreads",
+    .description    = "The number of threads used to copy frames into shared memory (0 = single threaded)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+  },
+  {
+    .module         = "app",
+    .name           = "compressFrames",
+    .description    = "Losslessly compress frames that do not fit in shared memory instead of truncating them",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true,
+  },
   {0}
 };
 
@@ -166,10 +278,27 @@ inline static void setAppState(enum AppState state)
   app.state     = state;
 }
 
+static LGMP_STATUS lgmpProcess(void)
+{
+  LG_LOCK(app.lgmpLock);
+  LGMP_STATUS status = lgmpHostProcess(app.lgmp);
+  LG_UNLOCK(app.lgmpLock);
+  return status;
+}
+
+/* Wait for the client to release queued messages. The client can not notify
+ * us, so rather than waiting for the next timer tick the queues are processed
+ * directly and then we wait briefly for the timer or another producer. */
+static void lgmpWaitRelease(void)
+{
+  lgmpProcess();
+  lgWaitEvent(app.lgmpEvent, 1);
+}
+
 static bool lgmpTimer(void * opaque)
 {
   LGMP_STATUS status;
-  if ((status = lgmpHostProcess(app.lgmp)) != LGMP_OK)
+  if ((status = lgmpProcess()) != LGMP_OK)
   {
     // something has messed up the LGMP headers, etc, we need to reinit
     if (status == LGMP_ERR_CORRUPTED)
@@ -203,35 +332,217 @@ static bool lgmpTimer(void * opaque)
     lgmpHostAckData(app.pointerQueue);
   }
 
+  // wake anything waiting on a subscriber change or a released message
+  const bool hasSubs =
+    lgmpHostQueueHasSubs(app.pointerQueue) ||
+    lgmpHostQueueHasSubs(app.frameQueue);
+  const uint32_t pending =
+    lgmpHostQueuePending(app.pointerQueue) +
+    lgmpHostQueuePending(app.frameQueue);
+
+  if (hasSubs != app.lgmpHadSubs || pending < app.lgmpPending)
+    lgSignalEvent(app.lgmpEvent);
+
+  app.lgmpHadSubs = hasSubs;
+  app.lgmpPending = pending;
+  return true;
+}
+
+#define STATS_ADD(field, value) \
+  do { if (app.stats) app.stats->field += (value); } while(0)
+
+static void statsRecord(unsigned int stage, uint64_t startTime)
+{
+  if (app.stats)
+    histogram_record(&app.stats->stage[stage], microtime() - startTime);
+}
+
+static void statsFrame(const CaptureFrame * frame)
+{
+  if (!app.stats)
+    return;
+
+  const uint64_t total = (uint64_t)frame->frameWidth * frame->frameHeight;
+  uint64_t damaged = 0;
+  if (frame->damageRectsCount == 0)
+    damaged = total;
+  else
+    for(unsigned int i = 0; i < frame->damageRectsCount; ++i)
+      damaged += (uint64_t)frame->damageRects[i].width *
+        frame->damageRects[i].height;
+
+  app.stats->pixelsTotal   += total;
+  app.stats->pixelsDamaged += min(damaged, total);
+}
+
+static bool frameSlotInUse(unsigned int slot, unsigned int pending)
+{
+  unsigned int pos = app.postedPos;
+  for(unsigned int i = 0; i < pending; ++i)
+  {
+    pos = (pos == 0 ? app.frameQueueLen : pos) - 1;
+    if (app.postedSlots[pos] == slot)
+      return true;
+  }
+  return false;
+}
+
+static bool postFrame(unsigned int slot)
+{
+  app.frame[slot]->postTime = microtime();
+
+  LGMP_STATUS status;
+  if ((status = lgmpHostQueuePost(app.frameQueue, 0,
+          app.frameMemory[slot])) != LGMP_OK)
+  {
+    DEBUG_ERROR("%s", lgmpStatusString(status));
+    return false;
+  }
+
+  app.postedSlots[app.postedPos] = slot;
+  if (++app.postedPos == app.frameQueueLen)
+    app.postedPos = 0;
+  return true;
+}
+
+/* account for a new frame posted to the client. New frames are only posted
+ * from sendFrame, which runs on the frame thread for asynchronous backends and
+ * on the main loop otherwise, so these counters have a single writer. */
+static void frameSent(unsigned int slot)
+{
+  ++app.queueStats.posted;
+  STATS_ADD(framesSent, 1);
+  app.readIndex = slot;
+}
+
+// post the held frame if the queue has room for it
+static bool flushHeldFrame(void)
+{
+  if (app.heldIndex < 0)
+    return true;
+
+  if (lgmpHostQueuePending(app.frameQueue) >= app.frameQueueLen ||
+      !postFrame(app.heldIndex))
+    return false;
+
+  frameSent(app.heldIndex);
+  app.heldIndex = -1;
   return true;
 }
 
+/* resend the last frame for new subscribers. Reading the new subscriber count
+ * zeros it, so it is only read once the frame can be posted. A held frame is
+ * newer and will be sent instead once there is room. */
+static void repostFrame(void)
+{
+  if (!app.frameValid || app.heldIndex >= 0 ||
+      lgmpHostQueuePending(app.frameQueue) >= app.frameQueueLen ||
+      lgmpHostQueueNewSubs(app.frameQueue) == 0)
+    return;
+
+  postFrame(app.readIndex);
+}
+
+static unsigned int nextFrameSlot(void)
+{
+  if (!app.dropFrames)
+    return (app.captureIndex + 1) % app.frameSlots;
+
+  // find a slot that is neither queued, held, nor needed to repeat the frame
+  const unsigned int pending = lgmpHostQueuePending(app.frameQueue);
+  for(unsigned int i = 1; i <= app.frameSlots; ++i)
+  {
+    const unsigned int slot = (app.captureIndex + i) % app.frameSlots;
+    if ((int)slot == app.heldIndex ||
+        (app.frameValid && slot == app.readIndex) ||
+        frameSlotInUse(slot, pending))
+      continue;
+    return slot;
+  }
+
+  // the queue is full, replace the held frame
+  if (app.heldIndex >= 0)
+    return app.heldIndex;
+
+  return (app.captureIndex + 1) % app.frameSlots;
+}
+
+// copy the captured frame into the frame buffer at `slot`
+static void copyFrame(unsigned int slot, uint64_t copyStart)
+{
+  size_t written = (size_t)app.captureFrame.dataHeight *
+    app.captureFrame.pitch;
+
+  app.iface->getFrame(slot, app.frameBuffer[slot], app.maxFrameSize,
+      &written);
+  statsRecord(KVMFR_STAGE_COPY, copyStart);
+  STATS_ADD(bytesCopied, written);
+}
+
 static bool sendFrame(CaptureResult result, bool * restart)
 {
-  CaptureFrame frame = { 0 };
-  bool repeatFrame = false;
+  /* the damage rects are large, only the header is cleared and the backend
+   * fills in as many rects as it reports */
+  CaptureFrame * frame = &app.captureFrame;
+  memset(frame, 0, offsetof(CaptureFrame, damageRects));
+
+  /* asynchronous backends only return from waitFrame when there is a new
+   * frame, so the held frame must be sent first or it may never be seen */
+  const uint64_t queueStart = microtime();
+  if (app.iface->asyncCapture)
+  {
+    while(app.state == APP_STATE_RUNNING && !flushHeldFrame())
+      lgmpWaitRelease();
+  }
+  else
+    flushHeldFrame();
 
-  //wait until there is room in the queue
+  //wait until the slot we will write to has been released
+  bool stalled = false;
   while(app.state == APP_STATE_RUNNING &&
-      lgmpHostQueuePending(app.frameQueue) == LGMP_Q_FRAME_LEN)
+      frameSlotInUse(app.captureIndex, lgmpHostQueuePending(app.frameQueue)))
   {
-    usleep(1);
-    continue;
+    stalled = true;
+    lgmpWaitRelease();
   }
 
+  if (stalled)
+    ++app.queueStats.stalled;
+
   if (app.state != APP_STATE_RUNNING)
     return false;
 
+  statsRecord(KVMFR_STAGE_QUEUE, queueStart);
+
   // only wait if the result from the capture was OK
   if (result == CAPTURE_RESULT_OK)
-    result = app.iface->waitFrame(app.captureIndex, &frame, app.maxFrameSize);
+  {
+    const uint64_t waitStart = microtime();
+    result = app.iface->waitFrame(app.captureIndex, frame, app.maxFrameSize);
+    statsRecord(KVMFR_STAGE_WAIT, waitStart);
+
+    // asynchronous backends only know a frame was captured once it arrives
+    if (app.iface->asyncCapture)
+      app.captureTime = microtime();
+  }
 
   switch(result)
   {
     case CAPTURE_RESULT_OK:
+    {
       // reading the new subs count zeros it
       lgmpHostQueueNewSubs(app.frameQueue);
+
+      const unsigned int pending = lgmpHostQueuePending(app.frameQueue);
+      ++app.queueStats.samples;
+      app.queueStats.occupancy += pending;
+      if (pending >= app.frameQueueLen)
+      {
+        ++app.queueStats.full;
+        STATS_ADD(queueFull, 1);
+      }
       break;
+    }
 
     case CAPTURE_RESULT_REINIT:
     {
@@ -249,34 +560,19 @@ static bool sendFrame(CaptureResult result, bool * restart)
 
     case CAPTURE_RESULT_TIMEOUT:
     {
-      if (app.frameValid && lgmpHostQueueNewSubs(app.frameQueue) > 0)
-      {
-        // resend the last frame
-        repeatFrame = app.iface->asyncCapture;
-        break;
-      }
-
+      /* there is no new frame, synchronous backends such as PipeWire can
+       * also time out here when the frame did not change */
+      repostFrame();
       return true;
     }
   }
 
-  LGMP_STATUS status;
-
-  // if we are repeating a frame just send the last frame again
-  if (repeatFrame)
-  {
-    if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-           app.frameMemory[app.readIndex])) != LGMP_OK)
-      DEBUG_ERROR("%s", lgmpStatusString(status));
-    return true;
-  }
-
   KVMFRFrame * fi = app.frame[app.captureIndex];
   KVMFRFrameFlags flags =
-    (frame.hdr   ? FRAME_FLAG_HDR    : 0) |
-    (frame.hdrPQ ? FRAME_FLAG_HDR_PQ : 0);
+    (frame->hdr   ? FRAME_FLAG_HDR    : 0) |
+    (frame->hdrPQ ? FRAME_FLAG_HDR_PQ : 0);
 
-  switch(frame.format)
+  switch(frame->format)
   {
     case CAPTURE_FMT_BGRA:
       fi->type = FRAME_TYPE_BGRA;
@@ -304,18 +600,18 @@ static bool sendFrame(CaptureResult result, bool * restart)
       break;
 
     default:
-      DEBUG_ERROR("Unsupported frame format %d, skipping frame", frame.format);
+      DEBUG_ERROR("Unsupported frame format %d, skipping frame", frame->format);
       return true;
   }
 
-  switch(frame.rotation)
+  switch(frame->rotation)
   {
     case CAPTURE_ROT_0  : fi->rotation = FRAME_ROT_0  ; break;
     case CAPTURE_ROT_90 : fi->rotation = FRAME_ROT_90 ; break;
     case CAPTURE_ROT_180: fi->rotation = FRAME_ROT_180; break;
     case CAPTURE_ROT_270: fi->rotation = FRAME_ROT_270; break;
     default:
-      DEBUG_WARN("Unsupported frame rotation %d", frame.rotation);
+      DEBUG_WARN("Unsupported frame rotation %d", frame->rotation);
       fi->rotation = FRAME_ROT_0;
       break;
   }
@@ -326,48 +622,148 @@ static bool sendFrame(CaptureResult result, bool * restart)
   if (os_getAndClearPendingActivationRequest())
     flags |= FRAME_FLAG_REQUEST_ACTIVATION;
 
-  if (frame.truncated)
+  if (frame->truncated)
     flags |= FRAME_FLAG_TRUNCATED;
 
-  fi->formatVer         = frame.formatVer;
+  if (frame->compressed)
+    flags |= FRAME_FLAG_COMPRESSED;
+
+  fi->formatVer         = frame->formatVer;
   fi->frameSerial       = app.frameSerial++;
-  fi->screenWidth       = frame.screenWidth;
-  fi->screenHeight      = frame.screenHeight;
-  fi->dataWidth         = frame.dataWidth;
-  fi->dataHeight        = frame.dataHeight;
-  fi->frameWidth        = frame.frameWidth;
-  fi->frameHeight       = frame.frameHeight;
-  fi->stride            = frame.stride;
-  fi->pitch             = frame.pitch;
+  fi->screenWidth       = frame->screenWidth;
+  fi->screenHeight      = frame->screenHeight;
+  fi->dataWidth         = frame->dataWidth;
+  fi->dataHeight        = frame->dataHeight;
+  fi->frameWidth        = frame->frameWidth;
+  fi->frameHeight       = frame->frameHeight;
+  fi->stride            = frame->stride;
+  fi->pitch             = frame->pitch;
   // fi->offset is initialized at startup
   fi->flags             = flags;
-  fi->damageRectsCount  = frame.damageRectsCount;
-  memcpy(fi->damageRects, frame.damageRects,
-    frame.damageRectsCount * sizeof(FrameDamageRect));
+  fi->captureTime       = app.captureTime;
+
+  /* a held frame is either replaced or superseded by this one and is never
+   * seen by the client, so its damage must be sent with this frame */
+  if (app.heldIndex >= 0)
+  {
+    if (frame->damageRectsCount == 0 || app.heldDamageCount == 0 ||
+        frame->damageRectsCount + app.heldDamageCount > FRAMEDAMAGE_MAX_RECTS)
+      frame->damageRectsCount = 0;
+    else
+    {
+      memcpy(frame->damageRects + frame->damageRectsCount, app.heldDamage,
+          app.heldDamageCount * sizeof(*app.heldDamage));
+      frame->damageRectsCount += app.heldDamageCount;
+    }
+  }
+
+  frameDamage_encode(fi, frame->damageRects, frame->damageRectsCount);
 
   app.frameValid = true;
+  statsFrame(frame);
 
   framebuffer_prepare(app.frameBuffer[app.captureIndex]);
+  const uint64_t copyStart = microtime();
 
-  /* we post and then get the frame, this is intentional! */
-  if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-    app.frameMemory[app.captureIndex])) != LGMP_OK)
+  /* the queue is full, keep the frame and send it when there is room. Any
+   * frame already held is older and is dropped. */
+  if (app.dropFrames &&
+      lgmpHostQueuePending(app.frameQueue) >= app.frameQueueLen)
   {
-    DEBUG_ERROR("%s", lgmpStatusString(status));
+    if (app.heldIndex >= 0)
+    {
+      ++app.queueStats.dropped;
+      STATS_ADD(framesDropped, 1);
+    }
+
+    copyFrame(app.captureIndex, copyStart);
+
+    app.heldIndex       = app.captureIndex;
+    app.heldDamageCount = frame->damageRectsCount;
+    memcpy(app.heldDamage, frame->damageRects,
+        frame->damageRectsCount * sizeof(*frame->damageRects));
+
+    app.captureIndex = nextFrameSlot();
+    return true;
+  }
+
+  /* we post and then get the frame, this is intentional! */
+  if (!postFrame(app.captureIndex))
     return true;
+
+  // a newer frame has been sent, the held frame is no longer needed
+  if (app.heldIndex >= 0)
+  {
+    ++app.queueStats.dropped;
+    STATS_ADD(framesDropped, 1);
+    app.heldIndex = -1;
   }
 
-  app.iface->getFrame(
-    app.captureIndex,
-    app.frameBuffer[app.captureIndex],
-    app.maxFrameSize);
+  copyFrame(app.captureIndex, copyStart);
 
-  app.readIndex = app.captureIndex;
-  if (++app.captureIndex == LGMP_Q_FRAME_LEN)
-    app.captureIndex = 0;
+  frameSent(app.captureIndex);
+  app.captureIndex = nextFrameSlot();
   return true;
 }
 
+static void pacingReset(void)
+{
+  app.pacing.clientUs    = 0;
+  app.pacing.windowStart = microtime();
+  app.pacing.posted      = app.queueStats.posted;
+  app.pacing.dropped     = app.queueStats.dropped;
+  app.pacing.stalled     = app.queueStats.stalled;
+  app.pacing.pending     = 0;
+  app.pacing.delayed     = 0;
+}
+
+/* Returns the minimum interval between captures. The client acknowledges each
+ * frame as it takes it, so the frames released over a window are the posts
+ * less the growth of the queue. If frames were dropped in that window, or
+ * capture had to wait for the client to release a frame when frames are not
+ * dropped, the client is the bottleneck and capture is slowed to the rate it
+ * released frames at, otherwise the interval is relaxed until the client can
+ * no longer keep up or `throttleFPS` is reached. */
+static unsigned int pacingInterval(uint64_t now)
+{
+  if (!app.pacing.enabled || now - app.pacing.windowStart < PACING_WINDOW_US)
+    return max(app.pacing.maxUs, app.pacing.clientUs);
+
+  const uint64_t posted  = app.queueStats.posted;
+  const uint64_t dropped = app.queueStats.dropped;
+  const uint64_t stalled = app.queueStats.stalled;
+  const uint32_t pending = lgmpHostQueuePending(app.frameQueue);
+  const int64_t  acks    = (int64_t)(posted - app.pacing.posted) -
+    ((int64_t)pending - (int64_t)app.pacing.pending);
+
+  if ((dropped != app.pacing.dropped || stalled != app.pacing.stalled) &&
+      acks > 0)
+  {
+    const unsigned int clientUs = (now - app.pacing.windowStart) / acks;
+    if (app.pacing.clientUs == 0)
+      DEBUG_INFO("Pacing capture to the client at %.1f FPS",
+          1000000.0 / clientUs);
+    app.pacing.clientUs = clientUs;
+  }
+  else if (app.pacing.clientUs)
+  {
+    app.pacing.clientUs = PACING_RELAX(app.pacing.clientUs);
+    if (app.pacing.clientUs <= app.pacing.maxUs ||
+        app.pacing.clientUs < 1000)
+    {
+      app.pacing.clientUs = 0;
+      DEBUG_INFO("The client is keeping up, capture pacing released");
+    }
+  }
+
+  app.pacing.windowStart = now;
+  app.pacing.posted      = posted;
+  app.pacing.dropped     = dropped;
+  app.pacing.stalled     = stalled;
+  app.pacing.pending     = pending;
+  return max(app.pacing.maxUs, app.pacing.clientUs);
+}
+
 static int frameThread(void * opaque)
 {
   DEBUG_INFO("Frame thread started");
@@ -443,6 +839,8 @@ static bool captureStart(void)
   }
 
   DEBUG_INFO("==== [ Capture Start ] ====");
+  memset(&app.queueStats, 0, sizeof(app.queueStats));
+  pacingReset();
   app.captureStarted = true;
   return true;
 }
@@ -454,6 +852,18 @@ static bool captureStop(void)
 
   DEBUG_INFO("==== [ Capture Stop ] ====");
 
+  if (app.queueStats.samples)
+    DEBUG_INFO("Frame Queue      : %" PRIu64 " sent, %" PRIu64 " dropped, "
+        "%" PRIu64 " stalled, %.2f/%u average depth, full %.1f%%",
+        app.queueStats.posted, app.queueStats.dropped, app.queueStats.stalled,
+        (double)app.queueStats.occupancy / app.queueStats.samples,
+        app.frameQueueLen,
+        (double)app.queueStats.full * 100.0 / app.queueStats.samples);
+
+  if (app.pacing.delayed)
+    DEBUG_INFO("Capture Pacing   : %" PRIu64 " captures delayed",
+        app.pacing.delayed);
+
   if (!app.iface->deinit())
   {
     DEBUG_ERROR("Failed to deinitialize the capture device");
@@ -461,6 +871,7 @@ static bool captureStop(void)
   }
 
   app.frameValid = false;
+  app.heldIndex  = -1;
   app.captureStarted = false;
   return true;
 }
@@ -480,7 +891,10 @@ static void postPointer(uint32_t flags, PLGMPMemory mem)
   {
     if (status == LGMP_ERR_QUEUE_FULL)
     {
-      usleep(1);
+      if (app.state != APP_STATE_RUNNING)
+        break;
+
+      lgmpWaitRelease();
       continue;
     }
 
@@ -489,6 +903,81 @@ static void postPointer(uint32_t flags, PLGMPMemory mem)
   }
 }
 
+static uint32_t pointerShapeID(const CapturePointer * pointer,
+    const uint8_t * data)
+{
+  // FNV-1a over the shape description and data, zero is reserved
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const uint32_t desc[] =
+  {
+    pointer->format, pointer->width, pointer->height, pointer->pitch
+  };
+
+  for(int i = 0; i < ARRAY_LENGTH(desc); ++i)
+    hash = (hash ^ desc[i]) * 0x100000001b3ULL;
+
+  const size_t size = (size_t)pointer->height * pointer->pitch;
+  size_t i = 0;
+  for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    hash = (hash ^ v) * 0x100000001b3ULL;
+  }
+
+  for(; i < size; ++i)
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+  const uint32_t id = (uint32_t)(hash ^ (hash >> 32));
+  return id ? id : 1;
+}
+
+/* look for the shape just written to the current shape buffer in the other
+ * buffers, if it is not found the shape is cached and the least recently used
+ * buffer is selected for the next shape */
+static PLGMPMemory cachePointerShape(uint32_t * shapeID)
+{
+  const unsigned int index = app.pointerShapeIndex;
+  PLGMPMemory        mem   = app.pointerShapeMemory[index];
+  const uint8_t    * data  = (uint8_t *)lgmpHostMemPtr(mem) + sizeof(KVMFRCursor);
+  const uint32_t     id    = pointerShapeID(&app.pointerInfo, data);
+  const size_t       size  =
+    (size_t)app.pointerInfo.height * app.pointerInfo.pitch;
+
+  for(unsigned int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
+  {
+    if (i == index || app.pointerShapeCache[i].id != id)
+      continue;
+
+    PLGMPMemory cached = app.pointerShapeMemory[i];
+    const KVMFRCursor * cursor = lgmpHostMemPtr(cached);
+    if (cursor->width  != app.pointerInfo.width  ||
+        cursor->height != app.pointerInfo.height ||
+        cursor->pitch  != app.pointerInfo.pitch  ||
+        memcmp(cursor + 1, data, size) != 0)
+      continue;
+
+    app.pointerShapeCache[i].lastUse = ++app.pointerShapeUse;
+    *shapeID = id;
+    return cached;
+  }
+
+  app.pointerShapeCache[index].id      = id;
+  app.pointerShapeCache[index].lastUse = ++app.pointerShapeUse;
+
+  unsigned int next = (index + 1) % POINTER_SHAPE_BUFFERS;
+  for(unsigned int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
+    if (app.pointerShapeCache[i].lastUse <
+        app.pointerShapeCache[next].lastUse)
+      next = i;
+
+  // the buffer is about to be overwritten
+  app.pointerShapeCache[next].id = 0;
+  app.pointerShapeIndex          = next;
+  *shapeID = id;
+  return mem;
+}
+
 static void sendPointer(bool newClient)
 {
   // new clients need the last known shape and current position
@@ -518,13 +1007,10 @@ static void sendPointer(bool newClient)
   }
 
   uint32_t flags = 0;
+  uint32_t shapeID = 0;
   PLGMPMemory mem;
   if (app.pointerInfo.shapeUpdate)
-  {
-    mem = app.pointerShapeMemory[app.pointerShapeIndex];
-    if (++app.pointerShapeIndex == POINTER_SHAPE_BUFFERS)
-      app.pointerShapeIndex = 0;
-  }
+    mem = cachePointerShape(&shapeID);
   else
   {
     mem = app.pointerMemory[app.pointerIndex];
@@ -550,6 +1036,7 @@ static void sendPointer(bool newClient)
     cursor->width  = app.pointerInfo.width;
     cursor->height = app.pointerInfo.height;
     cursor->pitch  = app.pointerInfo.pitch;
+    cursor->shapeID = shapeID;
     switch(app.pointerInfo.format)
     {
       case CAPTURE_FMT_COLOR : cursor->type = CURSOR_TYPE_COLOR       ; break;
@@ -570,12 +1057,30 @@ static void sendPointer(bool newClient)
   postPointer(flags, mem);
 }
 
+static void writePointerPos(int x, int y)
+{
+  KVMFRCursorPos * pos = app.pointerPos;
+  _Atomic(uint32_t) * seq = (_Atomic(uint32_t) *)&pos->seq;
+
+  // there is only one writer, the sequence is odd while writing
+  const uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  *(volatile int16_t *)&pos->x = x;
+  *(volatile int16_t *)&pos->y = y;
+
+  atomic_store_explicit(seq, s + 2, memory_order_release);
+}
+
 void capturePostPointerBuffer(const CapturePointer * pointer)
 {
+  const uint64_t startTime = microtime();
   LG_LOCK(app.pointerLock);
 
   int x = app.pointerInfo.x;
   int y = app.pointerInfo.y;
+  const bool visible = app.pointerInfo.visible;
 
   memcpy(&app.pointerInfo, pointer, sizeof(CapturePointer));
 
@@ -586,8 +1091,24 @@ void capturePostPointerBuffer(const CapturePointer * pointer)
     app.pointerInfo.y = y;
   }
 
+  /* moves only update the position slot, the queue is kept for shape and
+   * visibility changes so high rate mice can not fill it */
+  if (app.pointerPos)
+  {
+    if (pointer->positionUpdate)
+      writePointerPos(app.pointerInfo.x, app.pointerInfo.y);
+
+    if (!pointer->shapeUpdate && pointer->visible == visible)
+    {
+      statsRecord(KVMFR_STAGE_POINTER, startTime);
+      LG_UNLOCK(app.pointerLock);
+      return;
+    }
+  }
+
   sendPointer(false);
 
+  statsRecord(KVMFR_STAGE_POINTER, startTime);
   LG_UNLOCK(app.pointerLock);
 }
 
@@ -596,15 +1117,25 @@ static void lgmpShutdown(void)
   if (app.lgmpTimer)
     lgTimerDestroy(app.lgmpTimer);
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  LG_LOCK(app.pointerLock);
+  app.pointerPos = NULL;
+  app.stats      = NULL;
+  LG_UNLOCK(app.pointerLock);
+
+  for(int i = 0; i < ARRAY_LENGTH(app.frameMemory); ++i)
     lgmpHostMemFree(&app.frameMemory[i]);
   for(int i = 0; i < LGMP_Q_POINTER_LEN; ++i)
     lgmpHostMemFree(&app.pointerMemory[i]);
   for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
     lgmpHostMemFree(&app.pointerShapeMemory[i]);
+  lgmpHostMemFree(&app.pointerPosMemory);
+  lgmpHostMemFree(&app.statsMemory);
   lgmpHostFree(&app.lgmp);
 
   app.pointerShapeValid = false;
+  app.pointerShapeIndex = 0;
+  app.pointerShapeUse   = 0;
+  memset(app.pointerShapeCache, 0, sizeof(app.pointerShapeCache));
 }
 
 typedef struct KVMFRUserData
@@ -713,6 +1244,24 @@ static bool newKVMFRData(KVMFRUserData * dst)
       return false;
   }
 
+  {
+    const KVMFRRecord_Clock clock =
+    {
+      .monotonic = microtime(),
+      .realtime  = wallmicrotime()
+    };
+
+    const KVMFRRecord record =
+    {
+      .type = KVMFR_RECORD_CLOCK,
+      .size = sizeof(clock)
+    };
+
+    if (!appendData(dst, &record, sizeof(record)) ||
+        !appendData(dst, &clock , sizeof(clock )))
+      return false;
+  }
+
   return true;
 }
 
@@ -730,7 +1279,9 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
     goto fail_init;
   }
 
-  if ((status = lgmpHostQueueNew(app.lgmp, FRAME_QUEUE_CONFIG, &app.frameQueue)) != LGMP_OK)
+  struct LGMPQueueConfig frameQueueConfig = FRAME_QUEUE_CONFIG;
+  frameQueueConfig.numMessages = app.frameQueueLen;
+  if ((status = lgmpHostQueueNew(app.lgmp, frameQueueConfig, &app.frameQueue)) != LGMP_OK)
   {
     DEBUG_ERROR("lgmpHostQueueCreate Failed (Frame): %s", lgmpStatusString(status));
     goto fail_lgmp;
@@ -762,12 +1313,59 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
     memset(lgmpHostMemPtr(app.pointerShapeMemory[i]), 0, MAX_POINTER_SIZE);
   }
 
+  if ((status = lgmpHostMemAlloc(app.lgmp, sizeof(KVMFRCursorPos),
+          &app.pointerPosMemory)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer Position): %s",
+        lgmpStatusString(status));
+    goto fail_lgmp;
+  }
+
+  {
+    KVMFRCursorPos * pos = lgmpHostMemPtr(app.pointerPosMemory);
+    pos->seq = 0;
+    pos->x   = app.pointerInfo.x;
+    pos->y   = app.pointerInfo.y;
+
+    // every pointer message tells the client where to find the position
+    const uint32_t posOffset = (uint8_t *)pos - (uint8_t *)app.ivshmemBase;
+    for(int i = 0; i < LGMP_Q_POINTER_LEN; ++i)
+      ((KVMFRCursor *)lgmpHostMemPtr(app.pointerMemory[i]))->posOffset =
+        posOffset;
+    for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
+      ((KVMFRCursor *)lgmpHostMemPtr(app.pointerShapeMemory[i]))->posOffset =
+        posOffset;
+
+    LG_LOCK(app.pointerLock);
+    app.pointerPos = pos;
+    LG_UNLOCK(app.pointerLock);
+  }
+
+  if ((status = lgmpHostMemAlloc(app.lgmp, sizeof(KVMFRStats),
+          &app.statsMemory)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostMemAlloc Failed (Stats): %s",
+        lgmpStatusString(status));
+    goto fail_lgmp;
+  }
+
+  KVMFRStats * stats = lgmpHostMemPtr(app.statsMemory);
+  memset(stats, 0, sizeof(*stats));
+  stats->size   = sizeof(*stats);
+  stats->stages = KVMFR_STAGE_MAX;
+  const uint32_t statsOffset = (uint8_t *)stats - (uint8_t *)app.ivshmemBase;
+
   app.maxFrameSize = lgmpHostMemAvail(app.lgmp);
   app.maxFrameSize = (app.maxFrameSize - (app.alignSize - 1)) & ~(app.alignSize - 1);
-  app.maxFrameSize /= LGMP_Q_FRAME_LEN;
+  app.maxFrameSize /= app.frameSlots;
   DEBUG_INFO("Max Frame Size   : %u MiB", (unsigned int)(app.maxFrameSize / 1048576LL));
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  app.captureIndex = 0;
+  app.readIndex    = 0;
+  app.heldIndex    = -1;
+  app.postedPos    = 0;
+
+  for(unsigned int i = 0; i < app.frameSlots; ++i)
   {
     if ((status = lgmpHostMemAllocAligned(app.lgmp, app.maxFrameSize,
             app.alignSize, &app.frameMemory[i])) != LGMP_OK)
@@ -782,9 +1380,15 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
        aligned DMA transfers by the receiver */
     const unsigned alignOffset = app.alignSize - sizeof(FrameBuffer);
     app.frame[i]->offset = alignOffset;
+    app.frame[i]->statsOffset = statsOffset;
     app.frameBuffer[i] = (FrameBuffer *)(((uint8_t*)app.frame[i]) + alignOffset);
+    atomic_store(&app.frameBuffer[i]->waiters, 0);
   }
 
+  LG_LOCK(app.pointerLock);
+  app.stats = stats;
+  LG_UNLOCK(app.pointerLock);
+
   if (!lgCreateTimer(10, lgmpTimer, NULL, &app.lgmpTimer))
   {
     DEBUG_ERROR("Failed to create the LGMP timer");
@@ -881,12 +1485,44 @@ int app_main(int argc, char * argv[])
   DEBUG_INFO("Max Pointer Size : %u KiB", (unsigned int)MAX_POINTER_SIZE / 1024);
   DEBUG_INFO("KVMFR Version    : %u", KVMFR_VERSION);
 
+  LG_LOCK_INIT(app.lgmpLock);
+  LG_LOCK_INIT(app.pointerLock);
+  app.lgmpEvent = lgCreateEvent(true, 0);
+  if (!app.lgmpEvent)
+  {
+    DEBUG_ERROR("Failed to create the LGMP event");
+    exitcode = LG_HOST_EXIT_FATAL;
+    goto fail_ivshmem;
+  }
+
   app.alignSize         = sysinfo_getPageSize();
   app.frameValid        = false;
   app.pointerShapeValid = false;
 
-  int throttleFps = option_get_int("app", "throttleFPS");
-  int throttleUs = throttleFps ? 1000000 / throttleFps : 0;
+  const int frameQueueLen = option_get_int("app", "frameQueueLen");
+  app.frameQueueLen = min(max(frameQueueLen, 2), LGMP_Q_FRAME_LEN_MAX);
+  if (app.frameQueueLen != frameQueueLen)
+    DEBUG_WARN("app:frameQueueLen must be between 2 and %d",
+        LGMP_Q_FRAME_LEN_MAX);
+
+  // keep a spare frame buffer to capture into while the queue is full
+  app.dropFrames = option_get_bool("app", "dropFrames");
+  app.frameSlots = app.frameQueueLen + (app.dropFrames ? 1 : 0);
+  DEBUG_INFO("Frame Queue      : %u (%s when full)", app.frameQueueLen,
+      app.dropFrames ? "drop" : "wait");
+
+  const int copyThreads = option_get_int("app", "copyThreads");
+  if (copyThreads > 1)
+  {
+    if (framebuffer_set_write_threads(copyThreads))
+      DEBUG_INFO("Copy Threads     : %d", copyThreads);
+    else
+      DEBUG_WARN("Failed to start the copy threads, using a single thread");
+  }
+
+  const int throttleFps = option_get_int("app", "throttleFPS");
+  app.pacing.maxUs   = throttleFps > 0 ? 1000000 / throttleFps : 0;
+  app.pacing.enabled = option_get_bool("app", "paceToClient");
   uint64_t previousFrameTime = 0;
 
   {
@@ -913,7 +1549,7 @@ int app_main(int argc, char * argv[])
       if (!iface->create(
         captureGetPointerBuffer,
         capturePostPointerBuffer,
-        ARRAY_LENGTH(app.frameBuffer)))
+        app.frameSlots))
       {
         iface = NULL;
         continue;
@@ -950,8 +1586,6 @@ int app_main(int argc, char * argv[])
     goto fail_ivshmem;
   }
 
-  LG_LOCK_INIT(app.pointerLock);
-
   do
   {
     switch(app.state)
@@ -969,7 +1603,7 @@ int app_main(int argc, char * argv[])
         if (!lgmpHostQueueHasSubs(app.pointerQueue) &&
             !lgmpHostQueueHasSubs(app.frameQueue))
         {
-          usleep(100000);
+          lgWaitEvent(app.lgmpEvent, 100);
           continue;
         }
 
@@ -1009,13 +1643,19 @@ int app_main(int argc, char * argv[])
           LG_UNLOCK(app.pointerLock);
         }
 
-        const uint64_t delta = microtime() - previousFrameTime;
-        if (delta < throttleUs)
+        const uint64_t now        = microtime();
+        const uint64_t intervalUs = pacingInterval(now);
+        const uint64_t delta      = now - previousFrameTime;
+        if (delta < intervalUs)
         {
-          const uint64_t us = throttleUs - delta;
+          const uint64_t us = intervalUs - delta;
           // only delay if the time is reasonable
           if (us > 1000)
+          {
+            if (app.pacing.clientUs)
+              ++app.pacing.delayed;
             nsleep(us * 1000);
+          }
         }
 
         const uint64_t captureStartTime = microtime();
@@ -1024,18 +1664,16 @@ int app_main(int argc, char * argv[])
           app.captureIndex, app.frameBuffer[app.captureIndex]);
 
         if (likely(result == CAPTURE_RESULT_OK))
+        {
           previousFrameTime = captureStartTime;
+          if (!app.iface->asyncCapture)
+            app.captureTime = microtime();
+          statsRecord(KVMFR_STAGE_CAPTURE, captureStartTime);
+        }
         else if (likely(result == CAPTURE_RESULT_TIMEOUT))
         {
           if (!app.iface->asyncCapture)
-            if (unlikely(app.frameValid &&
-                  lgmpHostQueueNewSubs(app.frameQueue) > 0))
-            {
-              LGMP_STATUS status;
-              if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-                      app.frameMemory[app.readIndex])) != LGMP_OK)
-                DEBUG_ERROR("%s", lgmpStatusString(status));
-            }
+            repostFrame();
         }
         else
         {
@@ -1077,12 +1715,18 @@ fail:
   captureStop();
   app.iface->free();
 
-  LG_LOCK_FREE(app.pointerLock);
-
 fail_lgmp:
   lgmpShutdown();
 
 fail_ivshmem:
+  if (app.lgmpEvent)
+  {
+    lgFreeEvent(app.lgmpEvent);
+    app.lgmpEvent = NULL;
+  }
+  LG_LOCK_FREE(app.lgmpLock);
+  LG_LOCK_FREE(app.pointerLock);
+  framebuffer_set_write_threads(0);
   ivshmemClose(&shmDev);
   ivshmemFree(&shmDev);
   DEBUG_INFO("Host application exited");
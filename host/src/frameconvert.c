@@ -0,0 +1,534 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "frameconvert.h"
+#include "downsample_parser.h"
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/cpuinfo.h"
+#include "common/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <immintrin.h>
+
+typedef enum Filter
+{
+  FILTER_BOX,
+  FILTER_BILINEAR
+}
+Filter;
+
+typedef void (*ScaleRowFn)(const FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, unsigned int oy, unsigned int ox1, unsigned int ox2,
+    uint8_t * dst);
+
+typedef void (*PackRowFn)(const uint8_t * src, uint8_t * dst, unsigned int n,
+    bool rgba);
+
+struct FrameConvert
+{
+  Vector        * rules;
+  Filter          filter;
+  bool            allowRGB24;
+  CaptureRotation rotation;
+
+  bool          valid;
+  bool          scale, pack, rgba;
+  unsigned int  srcWidth, srcHeight;
+  ScaleRowFn    scaleRow;
+  PackRowFn     packRow;
+
+  /* per output column and row, either the first and one past the last source
+   * pixel of the box filter, or the source pixel and 8-bit weight of the
+   * bilinear filter */
+  uint32_t    * xa, * xb;
+  uint32_t    * ya, * yb;
+
+  FrameConvertFormat out;
+  uint8_t     * data;
+  uint8_t     * row;
+};
+
+void frameConvert_initOptions(const char * module, Vector * downsampleRules)
+{
+  char * name = (char *)module;
+  struct Option options[] =
+  {
+    DOWNSAMPLE_PARSER(name, downsampleRules),
+    {
+      .module         = name,
+      .name           = "downsampleFilter",
+      .description    = "The filter used to downsample (box or bilinear)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "box"
+    },
+    {
+      .module         = name,
+      .name           = "allowRGB24",
+      .description    = "Losslessly pack 32-bit RGBA8 into 24-bit RGB (saves bandwidth)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = name,
+      .name           = "rotate",
+      .description    = "Rotate the output by 0, 90, 180 or 270 degrees",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+// box filter, averages the source pixels covered by each output pixel
+
+static void scaleRow_box(const FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, unsigned int oy, unsigned int ox1, unsigned int ox2,
+    uint8_t * dst)
+{
+  const unsigned int y1 = this->ya[oy];
+  const unsigned int y2 = this->yb[oy];
+  const __m128i zero = _mm_setzero_si128();
+
+  for(unsigned int ox = ox1; ox < ox2; ++ox, dst += 4)
+  {
+    const unsigned int x1 = this->xa[ox];
+    const unsigned int x2 = this->xb[ox];
+
+    __m128i sum = _mm_setzero_si128();
+    const uint8_t * row = src + (size_t)y1 * srcPitch + x1 * 4;
+    for(unsigned int y = y1; y < y2; ++y, row += srcPitch)
+      for(unsigned int x = 0; x < x2 - x1; ++x)
+      {
+        uint32_t px;
+        memcpy(&px, row + x * 4, sizeof(px));
+        __m128i v = _mm_cvtsi32_si128(px);
+        v = _mm_unpacklo_epi8 (v, zero);
+        v = _mm_unpacklo_epi16(v, zero);
+        sum = _mm_add_epi32(sum, v);
+      }
+
+    const float scale = 1.0f / ((x2 - x1) * (y2 - y1));
+    __m128i v = _mm_cvtps_epi32(
+        _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(scale)));
+    v = _mm_packs_epi32 (v, v);
+    v = _mm_packus_epi16(v, v);
+
+    const uint32_t px = _mm_cvtsi128_si32(v);
+    memcpy(dst, &px, sizeof(px));
+  }
+}
+
+// exact 2:1 box filter, four output pixels at a time
+static void scaleRow_half(const FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, unsigned int oy, unsigned int ox1, unsigned int ox2,
+    uint8_t * dst)
+{
+  const uint8_t * r1 = src + (size_t)oy * 2 * srcPitch + ox1 * 8;
+  const uint8_t * r2 = r1 + srcPitch;
+
+  unsigned int ox = ox1;
+  for(; ox + 4 <= ox2; ox += 4, r1 += 32, r2 += 32, dst += 16)
+  {
+    const __m128i v1 = _mm_avg_epu8(
+        _mm_loadu_si128((const __m128i *)r1),
+        _mm_loadu_si128((const __m128i *)r2));
+    const __m128i v2 = _mm_avg_epu8(
+        _mm_loadu_si128((const __m128i *)(r1 + 16)),
+        _mm_loadu_si128((const __m128i *)(r2 + 16)));
+
+    const __m128i even = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v1), _mm_castsi128_ps(v2), _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i odd  = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v1), _mm_castsi128_ps(v2), _MM_SHUFFLE(3, 1, 3, 1)));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_avg_epu8(even, odd));
+  }
+
+  // round the same way as the vector path so partial updates match
+  for(; ox < ox2; ++ox, r1 += 8, r2 += 8, dst += 4)
+    for(int c = 0; c < 4; ++c)
+      dst[c] = (((r1[c    ] + r2[c    ] + 1) >> 1) +
+                ((r1[c + 4] + r2[c + 4] + 1) >> 1) + 1) >> 1;
+}
+
+static void scaleRow_bilinear(const FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, unsigned int oy, unsigned int ox1, unsigned int ox2,
+    uint8_t * dst)
+{
+  const uint8_t * r1 = src + (size_t)this->ya[oy] * srcPitch;
+  const uint8_t * r2 = r1 + srcPitch;
+  const __m128i   zero = _mm_setzero_si128();
+  const __m128i   wy2  = _mm_set1_epi16(this->yb[oy]);
+  const __m128i   wy1  = _mm_set1_epi16(256 - this->yb[oy]);
+
+  for(unsigned int ox = ox1; ox < ox2; ++ox, dst += 4)
+  {
+    const unsigned int x  = this->xa[ox] * 4;
+    const unsigned int fx = this->xb[ox];
+
+    // the weights for the left pixel in the low half, the right in the high
+    const __m128i wx = _mm_unpacklo_epi64(
+        _mm_set1_epi16(256 - fx), _mm_set1_epi16(fx));
+
+    /* the weights sum to 256 so the 16-bit products can not overflow when
+     * treated as unsigned */
+    __m128i h1 = _mm_mullo_epi16(_mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(r1 + x)), zero), wx);
+    __m128i h2 = _mm_mullo_epi16(_mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(r2 + x)), zero), wx);
+    h1 = _mm_srli_epi16(_mm_add_epi16(h1, _mm_srli_si128(h1, 8)), 8);
+    h2 = _mm_srli_epi16(_mm_add_epi16(h2, _mm_srli_si128(h2, 8)), 8);
+
+    __m128i v = _mm_add_epi16(
+        _mm_mullo_epi16(h1, wy1),
+        _mm_mullo_epi16(h2, wy2));
+    v = _mm_srli_epi16(v, 8);
+    v = _mm_packus_epi16(v, v);
+
+    const uint32_t px = _mm_cvtsi128_si32(v);
+    memcpy(dst, &px, sizeof(px));
+  }
+}
+
+// pack 32-bit BGRA or RGBA pixels into 24-bit RGB
+
+static void packRow_c(const uint8_t * src, uint8_t * dst, unsigned int n,
+    bool rgba)
+{
+  const int r = rgba ? 0 : 2;
+  const int b = rgba ? 2 : 0;
+  for(unsigned int i = 0; i < n; ++i, src += 4, dst += 3)
+  {
+    dst[0] = src[r];
+    dst[1] = src[1];
+    dst[2] = src[b];
+  }
+}
+
+#ifdef __clang__
+  #pragma clang attribute push (__attribute__((target("ssse3"))), apply_to=function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target ("ssse3")
+#endif
+static void packRow_ssse3(const uint8_t * src, uint8_t * dst, unsigned int n,
+    bool rgba)
+{
+  const __m128i mask = rgba ?
+    _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1) :
+    _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+  /* each store writes 16 bytes for 12 bytes of output, only use it while the
+   * excess lands inside this row */
+  unsigned int i = 0;
+  for(; i + 6 <= n; i += 4, src += 16, dst += 12)
+    _mm_storeu_si128((__m128i *)dst,
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), mask));
+
+  packRow_c(src, dst, n - i, rgba);
+}
+#ifdef __clang__
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+bool frameConvert_new(FrameConvert ** fc, const char * module,
+    Vector * downsampleRules)
+{
+  FrameConvert * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  this->rules      = downsampleRules;
+  this->allowRGB24 = option_get_bool(module, "allowRGB24");
+  this->packRow    = cpuInfo_getFeatures()->ssse3 ?
+    &packRow_ssse3 : &packRow_c;
+
+  const char * filter = option_get_string(module, "downsampleFilter");
+  if (!filter || strcasecmp(filter, "box") == 0)
+    this->filter = FILTER_BOX;
+  else if (strcasecmp(filter, "bilinear") == 0)
+    this->filter = FILTER_BILINEAR;
+  else
+  {
+    DEBUG_WARN("%s:downsampleFilter: unknown filter \"%s\", using box",
+        module, filter);
+    this->filter = FILTER_BOX;
+  }
+
+  switch(option_get_int(module, "rotate"))
+  {
+    case   0: this->rotation = CAPTURE_ROT_0  ; break;
+    case  90: this->rotation = CAPTURE_ROT_90 ; break;
+    case 180: this->rotation = CAPTURE_ROT_180; break;
+    case 270: this->rotation = CAPTURE_ROT_270; break;
+    default:
+      DEBUG_WARN("%s:rotate must be 0, 90, 180 or 270", module);
+      this->rotation = CAPTURE_ROT_0;
+      break;
+  }
+
+  *fc = this;
+  return true;
+}
+
+static void freeBuffers(FrameConvert * this)
+{
+  free(this->xa);
+  free(this->xb);
+  free(this->ya);
+  free(this->yb);
+  free(this->row);
+  free(this->data);
+  this->xa   = this->xb = NULL;
+  this->ya   = this->yb = NULL;
+  this->row  = NULL;
+  this->data = NULL;
+}
+
+void frameConvert_free(FrameConvert ** fc)
+{
+  FrameConvert * this = *fc;
+  if (!this)
+    return;
+
+  freeBuffers(this);
+  free(this);
+  *fc = NULL;
+}
+
+static void buildBoxTable(uint32_t * a, uint32_t * b, unsigned int src,
+    unsigned int dst)
+{
+  for(unsigned int i = 0; i < dst; ++i)
+  {
+    a[i] = (uint64_t)i * src / dst;
+    b[i] = max(a[i] + 1, (uint32_t)((uint64_t)(i + 1) * src / dst));
+  }
+}
+
+static void buildBilinearTable(uint32_t * idx, uint32_t * weight,
+    unsigned int src, unsigned int dst)
+{
+  for(unsigned int i = 0; i < dst; ++i)
+  {
+    // sample at the center of the output pixel in 8-bit fixed point
+    int64_t pos = ((2 * (int64_t)i + 1) * src * 256) / (2 * dst) - 128;
+    pos = clamp(pos, (int64_t)0, (int64_t)(src - 1) * 256);
+
+    idx   [i] = pos >> 8;
+    weight[i] = pos & 0xff;
+
+    // keep the right hand pixel inside the source
+    if (idx[i] == src - 1)
+    {
+      idx   [i] = src - 2;
+      weight[i] = 256;
+    }
+  }
+}
+
+bool frameConvert_configure(FrameConvert * this, unsigned int width,
+    unsigned int height, CaptureFormat format, FrameConvertFormat * out)
+{
+  const unsigned int bpp = format == CAPTURE_FMT_RGBA16F ? 8 : 4;
+  *out = (FrameConvertFormat) {
+    .format      = format,
+    .rotation    = this->rotation,
+    .frameWidth  = width,
+    .frameHeight = height,
+    .dataWidth   = width,
+    .dataHeight  = height,
+    .stride      = width,
+    .pitch       = width * bpp,
+    .bpp         = bpp
+  };
+
+  this->valid = false;
+  freeBuffers(this);
+
+  const bool rgba8 = format == CAPTURE_FMT_BGRA || format == CAPTURE_FMT_RGBA;
+
+  unsigned int dstWidth  = width;
+  unsigned int dstHeight = height;
+  DownsampleRule * rule = downsampleRule_match(this->rules, width, height);
+  if (rule && rule->targetX && rule->targetY &&
+      (rule->targetX != width || rule->targetY != height))
+  {
+    if (rgba8)
+    {
+      dstWidth  = rule->targetX;
+      dstHeight = rule->targetY;
+    }
+    else
+      DEBUG_WARN("Downsampling is only supported for 8-bit RGBA formats");
+  }
+
+  this->scale = dstWidth != width || dstHeight != height;
+  this->pack  = this->allowRGB24 && rgba8;
+  this->rgba  = format == CAPTURE_FMT_RGBA;
+  if (!this->scale && !this->pack)
+    return false;
+
+  this->srcWidth  = width;
+  this->srcHeight = height;
+
+  if (this->scale)
+  {
+    this->xa = malloc(dstWidth  * sizeof(*this->xa));
+    this->xb = malloc(dstWidth  * sizeof(*this->xb));
+    this->ya = malloc(dstHeight * sizeof(*this->ya));
+    this->yb = malloc(dstHeight * sizeof(*this->yb));
+    if (!this->xa || !this->xb || !this->ya || !this->yb)
+      goto nomem;
+
+    if (this->filter == FILTER_BILINEAR && width > 1 && height > 1)
+    {
+      buildBilinearTable(this->xa, this->xb, width , dstWidth );
+      buildBilinearTable(this->ya, this->yb, height, dstHeight);
+      this->scaleRow = &scaleRow_bilinear;
+    }
+    else
+    {
+      buildBoxTable(this->xa, this->xb, width , dstWidth );
+      buildBoxTable(this->ya, this->yb, height, dstHeight);
+      this->scaleRow = width == dstWidth * 2 && height == dstHeight * 2 ?
+        &scaleRow_half : &scaleRow_box;
+    }
+
+    DEBUG_INFO("Downsampling to  : %ux%u (%s)", dstWidth, dstHeight,
+        this->scaleRow == &scaleRow_bilinear ? "bilinear" : "box");
+  }
+
+  out->frameWidth  = dstWidth;
+  out->frameHeight = dstHeight;
+  out->dataWidth   = dstWidth;
+  out->dataHeight  = dstHeight;
+
+  if (this->pack)
+  {
+    /* EGL can not import 24-bit DMA-BUFs, the client stuffs this into a
+     * 32-bit texture so the padding must keep that aligned too */
+    out->format = CAPTURE_FMT_RGB_24;
+    out->bpp    = 3;
+    out->stride = ALIGN_TO((dstWidth + 3) / 4, 64) * 4;
+    out->pitch  = out->stride * 3;
+    DEBUG_INFO("Packing to       : RGB24");
+  }
+  else
+  {
+    out->stride = dstWidth;
+    out->pitch  = dstWidth * 4;
+  }
+
+  this->data = calloc(dstHeight, out->pitch);
+  this->row  = malloc(dstWidth * 4);
+  if (!this->data || !this->row)
+    goto nomem;
+
+  this->out   = *out;
+  this->valid = true;
+  return true;
+
+nomem:
+  DEBUG_ERROR("Out of memory");
+  freeBuffers(this);
+  this->scale = false;
+  this->pack  = false;
+  return false;
+}
+
+static void mapRange(unsigned int * pos, unsigned int * size,
+    unsigned int src, unsigned int dst)
+{
+  // grow by a pixel for the filter footprint and round outwards
+  const unsigned int p1 = *pos > 0 ? *pos - 1 : 0;
+  const unsigned int p2 = min(*pos + *size + 1, src);
+  const unsigned int o1 = (uint64_t)p1 * dst / src;
+  const unsigned int o2 = min((uint32_t)(((uint64_t)p2 * dst + src - 1) / src),
+      dst);
+  *pos  = o1;
+  *size = max(o2, o1 + 1) - o1;
+}
+
+static void convertRect(FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, const FrameDamageRect * rect)
+{
+  const FrameConvertFormat * out = &this->out;
+  for(unsigned int oy = rect->y; oy < rect->y + rect->height; ++oy)
+  {
+    uint8_t * dst = this->data + (size_t)oy * out->pitch + rect->x * out->bpp;
+
+    const uint8_t * px;
+    if (this->scale)
+    {
+      uint8_t * scaled = this->pack ? this->row : dst;
+      this->scaleRow(this, src, srcPitch, oy, rect->x, rect->x + rect->width,
+          scaled);
+      px = scaled;
+    }
+    else
+      px = src + (size_t)oy * srcPitch + rect->x * 4;
+
+    if (this->pack)
+      this->packRow(px, dst, rect->width, this->rgba);
+  }
+}
+
+const uint8_t * frameConvert_process(FrameConvert * this, const uint8_t * src,
+    unsigned int srcPitch, FrameDamageRect * rects, unsigned int * count)
+{
+  DEBUG_ASSERT(this->valid);
+
+  if (*count == 0)
+  {
+    const FrameDamageRect full =
+    {
+      .x      = 0,
+      .y      = 0,
+      .width  = this->out.dataWidth,
+      .height = this->out.dataHeight
+    };
+    convertRect(this, src, srcPitch, &full);
+    return this->data;
+  }
+
+  for(unsigned int i = 0; i < *count; ++i)
+  {
+    FrameDamageRect * rect = rects + i;
+    if (this->scale)
+    {
+      mapRange(&rect->x, &rect->width , this->srcWidth , this->out.dataWidth );
+      mapRange(&rect->y, &rect->height, this->srcHeight, this->out.dataHeight);
+    }
+    convertRect(this, src, srcPitch, rect);
+  }
+
+  return this->data;
+}
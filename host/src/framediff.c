@@ -0,0 +1,297 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "framediff.h"
+#include "common/debug.h"
+#include "common/cpuinfo.h"
+#include "common/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+typedef int (*TileCompareFn)(const uint8_t * a, const uint8_t * b,
+    unsigned int pitch, unsigned int rows, unsigned int bytes);
+
+struct FrameDiff
+{
+  TileCompareFn compare;
+
+  uint8_t     * prev;
+  size_t        prevSize;
+  bool          valid;
+  unsigned int  width, height, pitch, bpp;
+
+  // the dirty tile columns of the row being built, reused between compares
+  bool        * dirty;
+  unsigned int  dirtySize;
+};
+
+/* Each compare returns the first row of the tile that differs, or -1 if the
+ * tile is unchanged, which lets the caller skip copying the equal rows */
+
+static int tileCompare_sse2(const uint8_t * a, const uint8_t * b,
+    unsigned int pitch, unsigned int rows, unsigned int bytes)
+{
+  const unsigned int nvec = bytes / sizeof(__m128i);
+  const unsigned int rem  = bytes % sizeof(__m128i);
+
+  for(unsigned int y = 0; y < rows; ++y, a += pitch, b += pitch)
+  {
+    const __m128i * va = (const __m128i *)a;
+    const __m128i * vb = (const __m128i *)b;
+
+    __m128i diff = _mm_setzero_si128();
+    for(unsigned int i = 0; i < nvec; ++i)
+      diff = _mm_or_si128(diff, _mm_xor_si128(
+            _mm_loadu_si128(va + i), _mm_loadu_si128(vb + i)));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF ||
+        (rem && memcmp(a + bytes - rem, b + bytes - rem, rem) != 0))
+      return y;
+  }
+
+  return -1;
+}
+
+#ifdef __clang__
+  #pragma clang attribute push (__attribute__((target("avx2"))), apply_to=function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target ("avx2")
+#endif
+static int tileCompare_avx2(const uint8_t * a, const uint8_t * b,
+    unsigned int pitch, unsigned int rows, unsigned int bytes)
+{
+  const unsigned int nvec = bytes / sizeof(__m256i);
+  const unsigned int rem  = bytes % sizeof(__m256i);
+
+  for(unsigned int y = 0; y < rows; ++y, a += pitch, b += pitch)
+  {
+    const __m256i * va = (const __m256i *)a;
+    const __m256i * vb = (const __m256i *)b;
+
+    __m256i diff = _mm256_setzero_si256();
+    for(unsigned int i = 0; i < nvec; ++i)
+      diff = _mm256_or_si256(diff, _mm256_xor_si256(
+            _mm256_loadu_si256(va + i), _mm256_loadu_si256(vb + i)));
+
+    if (!_mm256_testz_si256(diff, diff) ||
+        (rem && memcmp(a + bytes - rem, b + bytes - rem, rem) != 0))
+      return y;
+  }
+
+  return -1;
+}
+#ifdef __clang__
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+bool frameDiff_new(FrameDiff ** diff)
+{
+  FrameDiff * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  this->compare = cpuInfo_getFeatures()->avx2 ?
+    &tileCompare_avx2 : &tileCompare_sse2;
+
+  *diff = this;
+  return true;
+}
+
+void frameDiff_free(FrameDiff ** diff)
+{
+  FrameDiff * this = *diff;
+  if (!this)
+    return;
+
+  free(this->dirty);
+  free(this->prev);
+  free(this);
+  *diff = NULL;
+}
+
+void frameDiff_reset(FrameDiff * this)
+{
+  this->valid = false;
+}
+
+static bool frameDiff_resize(FrameDiff * this, unsigned int width,
+    unsigned int height, unsigned int pitch, unsigned int bpp)
+{
+  const size_t size = (size_t)height * pitch;
+  if (size > this->prevSize)
+  {
+    free(this->prev);
+    this->prev = malloc(size);
+    if (!this->prev)
+    {
+      DEBUG_ERROR("Out of memory");
+      this->prevSize = 0;
+      return false;
+    }
+    this->prevSize = size;
+  }
+
+  const unsigned int columns =
+    (width + FRAMEDIFF_TILE_SIZE - 1) / FRAMEDIFF_TILE_SIZE;
+  if (columns > this->dirtySize)
+  {
+    free(this->dirty);
+    this->dirty = malloc(columns * sizeof(*this->dirty));
+    if (!this->dirty)
+    {
+      DEBUG_ERROR("Out of memory");
+      this->dirtySize = 0;
+      return false;
+    }
+    this->dirtySize = columns;
+  }
+
+  this->width  = width;
+  this->height = height;
+  this->pitch  = pitch;
+  this->bpp    = bpp;
+  return true;
+}
+
+bool frameDiff_compare(FrameDiff * this, const uint8_t * src,
+    unsigned int width, unsigned int height, unsigned int pitch,
+    unsigned int bpp, FrameDamageRect * rects, unsigned int maxRects,
+    unsigned int * rectCount)
+{
+  *rectCount = 0;
+  if (!this->valid || width != this->width || height != this->height ||
+      pitch != this->pitch || bpp != this->bpp)
+  {
+    this->valid = false;
+    if (!frameDiff_resize(this, width, height, pitch, bpp))
+      return true;
+
+    memcpy(this->prev, src, (size_t)height * pitch);
+    this->valid = true;
+    return true;
+  }
+
+  const unsigned int columns =
+    (width + FRAMEDIFF_TILE_SIZE - 1) / FRAMEDIFF_TILE_SIZE;
+  const unsigned int tileBytes = FRAMEDIFF_TILE_SIZE * bpp;
+
+  unsigned int count     = 0;
+  unsigned int prevStart = 0;
+  unsigned int prevCount = 0;
+  bool         overflow  = false;
+  bool         changed   = false;
+
+  for(unsigned int y = 0; y < height; y += FRAMEDIFF_TILE_SIZE)
+  {
+    const unsigned int rows = min(FRAMEDIFF_TILE_SIZE, height - y);
+    const size_t       row  = (size_t)y * pitch;
+
+    for(unsigned int tx = 0; tx < columns; ++tx)
+    {
+      const unsigned int x     = tx * tileBytes;
+      const unsigned int bytes = min(tileBytes, width * bpp - x);
+      const int first = this->compare(src + row + x, this->prev + row + x,
+          pitch, rows, bytes);
+
+      this->dirty[tx] = first >= 0;
+      if (first < 0)
+        continue;
+
+      changed = true;
+
+      // the rows before the first difference are already equal
+      const uint8_t * s = src        + row + (size_t)first * pitch + x;
+      uint8_t       * d = this->prev + row + (size_t)first * pitch + x;
+      for(unsigned int r = first; r < rows; ++r, s += pitch, d += pitch)
+        memcpy(d, s, bytes);
+    }
+
+    // the previous frame must still be updated once the rects have overflowed
+    if (overflow)
+      continue;
+
+    // emit the runs of dirty tiles in this row
+    const unsigned int start = count;
+    for(unsigned int tx = 0; tx < columns;)
+    {
+      if (!this->dirty[tx])
+      {
+        ++tx;
+        continue;
+      }
+
+      unsigned int tx2 = tx + 1;
+      while(tx2 < columns && this->dirty[tx2])
+        ++tx2;
+
+      if (count == maxRects)
+      {
+        overflow = true;
+        break;
+      }
+
+      const unsigned int x1 = tx * FRAMEDIFF_TILE_SIZE;
+      rects[count++] = (FrameDamageRect) {
+        .x      = x1,
+        .y      = y,
+        .width  = min(tx2 * FRAMEDIFF_TILE_SIZE, width) - x1,
+        .height = rows
+      };
+      tx = tx2;
+    }
+
+    // extend the runs of the previous row instead if they match
+    const unsigned int runs = count - start;
+    if (!overflow && runs > 0 && runs == prevCount &&
+        rects[prevStart].y + rects[prevStart].height == y)
+    {
+      bool same = true;
+      for(unsigned int i = 0; i < runs && same; ++i)
+        same =
+          rects[prevStart + i].x     == rects[start + i].x &&
+          rects[prevStart + i].width == rects[start + i].width;
+
+      if (same)
+      {
+        for(unsigned int i = 0; i < runs; ++i)
+          rects[prevStart + i].height += rows;
+        count = start;
+        continue;
+      }
+    }
+
+    if (runs > 0)
+    {
+      prevStart = start;
+      prevCount = runs;
+    }
+  }
+
+  *rectCount = overflow ? 0 : count;
+  return changed;
+}
@@ -0,0 +1,205 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "framewriter.h"
+#include "common/debug.h"
+#include "common/framecodec.h"
+#include "common/option.h"
+#include "common/rects.h"
+#include "common/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct FrameHistory
+{
+  // the number of rects damaged since this buffer was written, or -1 if the
+  // history is unknown and the entire frame must be copied
+  int             count;
+  FrameDamageRect rects[FRAMEWRITER_MAX_RECTS];
+};
+
+struct FrameWriter
+{
+  unsigned int        frameBuffers;
+  bool                allowCompression;
+  bool                compress;
+  size_t              maxFrameSize;
+  FrameWriterStats    stats;
+  struct FrameHistory history[];
+};
+
+bool frameWriter_new(FrameWriter ** writer, unsigned int frameBuffers)
+{
+  FrameWriter * this = calloc(1, sizeof(*this) +
+      sizeof(*this->history) * frameBuffers);
+  if (!this)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  this->frameBuffers     = frameBuffers;
+  this->allowCompression = option_get_bool("app", "compressFrames");
+  frameWriter_invalidate(this);
+
+  *writer = this;
+  return true;
+}
+
+void frameWriter_free(FrameWriter ** writer)
+{
+  if (!*writer)
+    return;
+
+  free(*writer);
+  *writer = NULL;
+}
+
+void frameWriter_invalidate(FrameWriter * this)
+{
+  for(unsigned int i = 0; i < this->frameBuffers; ++i)
+    this->history[i].count = -1;
+}
+
+static void historyAdd(struct FrameHistory * history,
+    const FrameDamageRect * damage, unsigned int count)
+{
+  if (history->count < 0)
+    return;
+
+  if (count == 0)
+  {
+    history->count = -1;
+    return;
+  }
+
+  if (count >= FRAMEWRITER_MAX_RECTS)
+  {
+    history->count = -1;
+    return;
+  }
+
+  if (history->count + count > FRAMEWRITER_MAX_RECTS)
+    history->count = rectsCoalesce(history->rects, history->count,
+        FRAMEWRITER_MAX_RECTS - count);
+
+  memcpy(history->rects + history->count, damage, count * sizeof(*damage));
+  history->count += count;
+}
+
+bool frameWriter_useCompression(FrameWriter * this, size_t frameSize,
+    size_t maxFrameSize)
+{
+  this->compress     = this->allowCompression && frameSize > maxFrameSize;
+  this->maxFrameSize = maxFrameSize;
+  return this->compress;
+}
+
+size_t frameWriter_write(FrameWriter * this, unsigned int index,
+    FrameBuffer * frame, unsigned int dstPitch,
+    const uint8_t * src, unsigned int srcPitch,
+    unsigned int height, unsigned int bpp,
+    const FrameDamageRect * damage, unsigned int damageCount)
+{
+  DEBUG_ASSERT(index < this->frameBuffers);
+
+  struct FrameHistory * history = this->history + index;
+  const size_t total = (size_t)height * dstPitch;
+
+  // reduce large damage sets so they fit in the history of every buffer
+  FrameDamageRect coalesced[damageCount > FRAMEWRITER_MAX_RECTS / 4 ?
+    damageCount : 1];
+  if (damageCount > FRAMEWRITER_MAX_RECTS / 4)
+  {
+    memcpy(coalesced, damage, damageCount * sizeof(*damage));
+    damageCount = rectsCoalesce(coalesced, damageCount,
+        FRAMEWRITER_MAX_RECTS / 4);
+    damage = coalesced;
+  }
+
+  size_t written = 0;
+  historyAdd(history, damage, damageCount);
+  if (this->compress)
+  {
+    written = frameCodec_encode(frame, this->maxFrameSize,
+        src, srcPitch, min(dstPitch, srcPitch), height);
+
+    ++this->stats.compressedFrames;
+    this->stats.bytesCompressed   += written;
+    this->stats.bytesUncompressed += total;
+  }
+  else if (history->count < 0)
+  {
+    if (dstPitch == srcPitch)
+      framebuffer_write(frame, src, total);
+    else
+    {
+      FrameDamageRect full =
+      {
+        .x      = 0,
+        .y      = 0,
+        .width  = min(dstPitch, srcPitch) / bpp,
+        .height = height
+      };
+      rectsBufferToFramebuffer(&full, 1, bpp, frame, dstPitch, height,
+          src, srcPitch);
+    }
+
+    written = total;
+    ++this->stats.fullFrames;
+  }
+  else
+  {
+    history->count = rectsMergeOverlapping(history->rects, history->count);
+    rectsBufferToFramebuffer(history->rects, history->count, bpp, frame,
+        dstPitch, height, src, srcPitch);
+
+    for(int i = 0; i < history->count; ++i)
+    {
+      const FrameDamageRect * rect = history->rects + i;
+      if (rect->y >= height)
+        continue;
+
+      written += (size_t)rect->width * bpp *
+        min(rect->height, height - rect->y);
+    }
+  }
+
+  if (!this->compress)
+    this->stats.bytesCopied += written;
+
+  ++this->stats.frames;
+  this->stats.bytesTotal += total;
+
+  // this buffer is now current unless it holds a compressed frame, all others
+  // now also need this frame's damage
+  history->count = this->compress ? -1 : 0;
+  for(unsigned int i = 0; i < this->frameBuffers; ++i)
+    if (i != index)
+      historyAdd(this->history + i, damage, damageCount);
+
+  return written;
+}
+
+void frameWriter_getStats(FrameWriter * this, FrameWriterStats * stats)
+{
+  memcpy(stats, &this->stats, sizeof(*stats));
+}
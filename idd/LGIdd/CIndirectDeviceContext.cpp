@@ -458,6 +458,9 @@ void CIndirectDeviceContext::SendFrame(int width, int height, int pitch, DXGI_FO
   fi->offset       = (uint32_t)(CPlatformInfo::GetPageSize() - sizeof(FrameBuffer));
   fi->flags        = 0;
   fi->rotation     = FRAME_ROT_0;
+  fi->statsOffset  = 0;
+  fi->captureTime  = 0;
+  fi->postTime     = 0;
 
   fi->damageRectsCount = 0;
 
@@ -509,6 +512,7 @@ void CIndirectDeviceContext::SendCursor(const IDARG_OUT_QUERY_HWCURSOR& info, co
     cursor->width  = (uint32_t)info.CursorShapeInfo.Width;
     cursor->height = (uint32_t)info.CursorShapeInfo.Height;
     cursor->pitch  = (uint32_t)info.CursorShapeInfo.Pitch;
+    cursor->shapeID = 0;
 
     switch (info.CursorShapeInfo.CursorType)
     {
@@ -30,6 +30,7 @@
 #include <common/ivshmem.h>
 #include <common/KVMFR.h>
 #include <common/framebuffer.h>
+#include <common/framecodec.h>
 #include <lgmp/client.h>
 
 #include <stdio.h>
@@ -92,7 +93,8 @@ typedef struct
   bool              hideMouse;
 #if LIBOBS_API_MAJOR_VER >= 27
   bool              dmabuf;
-  DMAFrameInfo      dmaInfo[LGMP_Q_FRAME_LEN];
+  bool              texDMA; // the texture is a DMABUF import
+  DMAFrameInfo      dmaInfo[LGMP_Q_FRAME_BUFFERS_MAX];
 #endif
 
 #if LIBOBS_API_MAJOR_VER >= 28
@@ -230,7 +232,7 @@ static void deinit(LGPlugin * this)
 
   if (this->texture)
   {
-    if (!this->dmabuf)
+    if (!this->texDMA)
       gs_texture_unmap(this->texture);
     gs_texture_destroy(this->texture);
     this->texture = NULL;
@@ -328,9 +330,32 @@ inline static void allocCursorData(LGPlugin * this, const unsigned int size)
   this->cursorData = bmalloc(size);
 }
 
+// read the host's cursor position slot if it has changed since `seq`
+static bool readCursorPos(const KVMFRCursorPos * pos, uint32_t * seq,
+    int16_t * x, int16_t * y)
+{
+  atomic_uint_least32_t * s = (atomic_uint_least32_t *)&pos->seq;
+
+  const uint32_t s1 = atomic_load_explicit(s, memory_order_acquire);
+  if (s1 == *seq || (s1 & 1))
+    return false;
+
+  *x = *(volatile const int16_t *)&pos->x;
+  *y = *(volatile const int16_t *)&pos->y;
+  atomic_thread_fence(memory_order_acquire);
+
+  if (atomic_load_explicit(s, memory_order_relaxed) != s1)
+    return false;
+
+  *seq = s1;
+  return true;
+}
+
 static void * pointerThread(void * data)
 {
   LGPlugin * this = (LGPlugin *)data;
+  const KVMFRCursorPos * cursorPos = NULL;
+  uint32_t posSeq = 0;
 
   if (lgmpClientSubscribe(this->lgmp, LGMP_Q_POINTER, &this->pointerQueue) != LGMP_OK)
   {
@@ -351,11 +376,20 @@ static void * pointerThread(void * data)
         break;
       }
 
-      usleep(1000);
+      if (!cursorPos || !readCursorPos(cursorPos, &posSeq,
+            &this->cursor.x, &this->cursor.y))
+        usleep(1000);
       continue;
     }
 
     const KVMFRCursor * const cursor = (const KVMFRCursor * const)msg.mem;
+    if (cursor->posOffset &&
+        cursor->posOffset <= this->shmDev.size - sizeof(*cursorPos))
+      cursorPos = (const KVMFRCursorPos *)
+        ((const uint8_t *)this->shmDev.mem + cursor->posOffset);
+    else
+      cursorPos = NULL;
+
     this->cursorVisible = this->hideMouse ?
       0 : msg.udata & CURSOR_FLAG_VISIBLE;
 
@@ -423,7 +457,12 @@ static void * pointerThread(void * data)
       os_sem_post(this->cursorSem);
     }
 
-    if (msg.udata & CURSOR_FLAG_POSITION)
+    // once written the position slot is newer than any position in the queue
+    const bool posRead = cursorPos && readCursorPos(cursorPos, &posSeq,
+        &this->cursor.x, &this->cursor.y);
+
+    if (!posRead && (msg.udata & CURSOR_FLAG_POSITION) &&
+        (!cursorPos || !posSeq))
     {
       this->cursor.x = cursor->x;
       this->cursor.y = cursor->y;
@@ -642,7 +681,12 @@ static void lgVideoTick(void * data, float seconds)
   }
 
   KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
-  if (!this->texture || this->formatVer != frame->formatVer)
+
+  /* compressed frames must be decoded by the CPU, the texture is switched for
+   * these and back to a DMABUF import for the next uncompressed frame */
+  const bool useDMA = this->dmabuf && !(frame->flags & FRAME_FLAG_COMPRESSED);
+  if (!this->texture || this->formatVer != frame->formatVer ||
+      this->texDMA != useDMA)
   {
     this->formatVer    = frame->formatVer;
     this->screenWidth  = frame->screenWidth;
@@ -665,7 +709,7 @@ static void lgVideoTick(void * data, float seconds)
         this->dstTexture = NULL;
       }
 
-      if (!this->dmabuf)
+      if (!this->texDMA)
         gs_texture_unmap(this->texture);
 
       gs_texture_destroy(this->texture);
@@ -735,8 +779,9 @@ static void lgVideoTick(void * data, float seconds)
         return;
     }
 
+    this->texDMA = false;
 #if LIBOBS_API_MAJOR_VER >= 27
-    if (this->dmabuf)
+    if (useDMA)
     {
       int fd = dmabufGetFd(this, &msg, frame, frame->frameHeight * frame->pitch);
       if (fd >= 0)
@@ -757,13 +802,17 @@ static void lgVideoTick(void * data, float seconds)
           puts("Failed to create dmabuf texture");
           this->dmabuf = false;
         }
+        else
+          this->texDMA = true;
       }
+      else
+        this->dmabuf = false;
     }
 #else
     (void)drm_format;
 #endif
 
-    if (!this->dmabuf)
+    if (!this->texDMA)
     {
       this->texture = gs_texture_create(
         width,
@@ -803,7 +852,7 @@ static void lgVideoTick(void * data, float seconds)
   }
 
   // if using dmabuf there is nothing more here to do
-  if (!this->texture || this->dmabuf)
+  if (!this->texture || this->texDMA)
   {
     lgmpClientMessageDone(this->frameQueue);
     os_sem_post(this->frameSem);
@@ -811,15 +860,25 @@ static void lgVideoTick(void * data, float seconds)
   }
 
   FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-  framebuffer_read(
-      fb,
-      this->texData   , // dst
-      this->linesize  , // dstpitch
-      this->dataHeight, // height
-      this->dataWidth , // width
-      this->bpp       , // bpp
-      frame->pitch
-  );
+  if (frame->flags & FRAME_FLAG_COMPRESSED)
+  {
+    const size_t maxSize = this->shmDev.size - sizeof(*fb) -
+      ((uint8_t *)fb - (uint8_t *)this->shmDev.mem);
+    unsigned int rows;
+    if (!frameCodec_decode(fb, maxSize, this->texData, this->linesize,
+          this->dataHeight, &rows))
+      puts("Failed to decode the compressed frame");
+  }
+  else
+    framebuffer_read(
+        fb,
+        this->texData   , // dst
+        this->linesize  , // dstpitch
+        this->dataHeight, // height
+        this->dataWidth , // width
+        this->bpp       , // bpp
+        frame->pitch
+    );
 
   lgmpClientMessageDone(this->frameQueue);
   os_sem_post(this->frameSem);
@@ -26,26 +26,158 @@
 #include "common/stringutils.h"
 #include "common/ivshmem.h"
 #include "common/util.h"
+#include "common/array.h"
+#include "common/clocksync.h"
+#include "common/histogram.h"
+#include "common/framebuffer.h"
+#include "common/framedamage.h"
+#include "common/framecodec.h"
+#include "common/time.h"
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <pwd.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include <lgmp/client.h>
 
+#define RECORD_MAGIC "LGPREC01"
+#define FB_ALIGN     4096
+
+/* A recorded frame, followed by `damageCount` FrameDamageRect and then
+ * `height` rows of `pitch` bytes of frame data. Compressed frames are recorded
+ * decoded. */
+typedef struct RecordFrame
+{
+  uint64_t interval;    // microseconds since the previous frame
+  uint64_t latency;     // capture to receive in microseconds, zero if unknown
+  uint32_t type;        // FrameType
+  uint32_t width;       // the packed frame width
+  uint32_t height;      // the packed frame height
+  uint32_t frameWidth;  // the unpacked frame width
+  uint32_t frameHeight; // the unpacked frame height
+  uint32_t pitch;       // the row pitch in bytes
+  uint32_t damageCount; // zero for full frame damage
+  uint32_t pad;
+}
+RecordFrame;
+
+enum OutputFormat
+{
+  OUTPUT_TEXT,
+  OUTPUT_CSV,
+  OUTPUT_JSON
+};
+
+// the ways a frame is read, each frame is read with every one of them
+enum
+{
+  READ_LINEAR,  // framebuffer_read_linear
+  READ_PITCHED, // framebuffer_read into a tightly packed buffer
+  READ_FN,      // framebuffer_read_fn with a row copy callback
+  READ_DECODE,  // frameCodec_decode, compressed frames only
+
+  READ_MAX
+};
+
+static const char * readNames[READ_MAX] =
+{
+  [READ_LINEAR ] = "linear",
+  [READ_PITCHED] = "pitched",
+  [READ_FN     ] = "fn",
+  [READ_DECODE ] = "decode"
+};
+
+struct ReadStats
+{
+  KVMFRHistogram cost;  // per frame copy cost in microseconds
+  uint64_t       bytes;
+  uint64_t       ns;
+};
+
+// the frame being analysed, from shared memory or a recording
+struct FrameInfo
+{
+  uint32_t              type;
+  uint32_t              width, height;
+  uint32_t              frameWidth, frameHeight;
+  uint32_t              pitch;
+  bool                  compressed;
+  const FrameBuffer   * fb;
+  size_t                maxSize;
+  const FrameDamageRect * rects;
+  unsigned int          rectCount;
+  uint64_t              interval;
+  uint64_t              latency;
+};
+
 struct state
 {
   bool           running;
   struct IVSHMEM shmDev;
+
+  enum OutputFormat format;
+  FILE         * out;
+  FILE         * record;
+  unsigned int   maxFrames;
+
+  uint8_t      * dst;
+  size_t         dstSize;
+
+  uint64_t         frames;
+  uint64_t         compressed;
+  uint64_t         startTime;
+  KVMFRHistogram   interval;
+  KVMFRHistogram   latency;
+  KVMFRHistogram   wait;
+  struct ReadStats reads[READ_MAX];
+
+  uint64_t       fullDamage;
+  uint64_t       damageRects;
+  uint64_t       pixelsDamaged;
+  uint64_t       pixelsTotal;
+
+  // the live text report
+  uint64_t       reportTime;
+  uint64_t       reportFrames;
+  uint64_t       reportBytes;
 };
 
 struct state state;
 
+static bool validateFormat(struct Option * opt, const char ** error)
+{
+  const char * value = opt->value.x_string;
+  if (!strcasecmp(value, "text") ||
+      !strcasecmp(value, "csv" ) ||
+      !strcasecmp(value, "json"))
+    return true;
+
+  *error = "Valid values are text, csv or json";
+  return false;
+}
+
+static bool validateReadMethod(struct Option * opt, const char ** error)
+{
+  const char * value = opt->value.x_string;
+  if (!strcasecmp(value, "memcpy") ||
+      !strcasecmp(value, "stream") ||
+      !strcasecmp(value, "sse4.1") ||
+      !strcasecmp(value, "avx2"  ) ||
+      !strcasecmp(value, "avx512"))
+    return true;
+
+  *error = "Valid values are memcpy, stream, sse4.1, avx2 or avx512";
+  return false;
+}
+
 static struct Option options[] =
 {
   {
@@ -56,6 +188,50 @@ static struct Option options[] =
     .type           = OPTION_TYPE_STRING,
     .value.x_string = NULL
   },
+  {
+    .module         = "profile",
+    .name           = "frames",
+    .description    = "Stop after this many frames (0 = until interrupted)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "profile",
+    .name           = "readMethod",
+    .description    = "The framebuffer read method (memcpy, stream, sse4.1, avx2, avx512)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "memcpy",
+    .validator      = validateReadMethod
+  },
+  {
+    .module         = "profile",
+    .name           = "format",
+    .description    = "The report format (text, csv or json), csv reports every frame",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "text",
+    .validator      = validateFormat
+  },
+  {
+    .module         = "profile",
+    .name           = "output",
+    .description    = "Write the report to this file instead of stdout",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "record",
+    .description    = "Record the frames to this file for replay",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "replay",
+    .description    = "Replay frames from a recording instead of the host",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
   {0}
 };
 
@@ -103,7 +279,357 @@ static bool config_load(int argc, char * argv[])
   return true;
 }
 
-static int run(void)
+static void signalHandler(int sig)
+{
+  state.running = false;
+}
+
+static unsigned int frameTypeBpp(uint32_t type)
+{
+  switch(type)
+  {
+    case FRAME_TYPE_RGBA16F:
+      return 8;
+
+    case FRAME_TYPE_RGB_24:
+      return 3;
+
+    default:
+      return 4;
+  }
+}
+
+static bool ensureDst(size_t size)
+{
+  if (size <= state.dstSize)
+    return true;
+
+  free(state.dst);
+  state.dst = aligned_alloc(FB_ALIGN, ALIGN_TO(size, FB_ALIGN));
+  if (!state.dst)
+  {
+    DEBUG_ERROR("Failed to allocate %zu bytes", size);
+    state.dstSize = 0;
+    return false;
+  }
+
+  state.dstSize = size;
+  return true;
+}
+
+struct FnCopy
+{
+  uint8_t * dst;
+};
+
+static bool readFnCopy(void * opaque, const void * src, size_t size)
+{
+  struct FnCopy * copy = opaque;
+  framebuffer_read_copy(copy->dst, src, size);
+  copy->dst += size;
+  return true;
+}
+
+static uint64_t timeRead(int variant, const struct FrameInfo * fi,
+    size_t rowBytes)
+{
+  const size_t size = (size_t)fi->height * fi->pitch;
+  const uint64_t start = nanotime();
+  bool ok = false;
+
+  switch(variant)
+  {
+    case READ_LINEAR:
+      ok = framebuffer_read_linear(fi->fb, state.dst, size);
+      break;
+
+    case READ_PITCHED:
+      ok = framebuffer_read(fi->fb, state.dst, rowBytes, fi->height,
+          rowBytes, 1, fi->pitch);
+      break;
+
+    case READ_FN:
+    {
+      struct FnCopy copy = { .dst = state.dst };
+      ok = framebuffer_read_fn(fi->fb, fi->height, rowBytes, 1, fi->pitch,
+          readFnCopy, &copy);
+      break;
+    }
+
+    case READ_DECODE:
+    {
+      unsigned int rows;
+      ok = frameCodec_decode(fi->fb, fi->maxSize, state.dst, fi->pitch,
+          fi->height, &rows);
+      break;
+    }
+  }
+
+  const uint64_t ns = nanotime() - start;
+  if (!ok)
+  {
+    DEBUG_WARN("The %s read failed", readNames[variant]);
+    return 0;
+  }
+
+  struct ReadStats * stats = &state.reads[variant];
+  histogram_record(&stats->cost, ns / 1000);
+  stats->bytes += variant == READ_PITCHED || variant == READ_FN ?
+    rowBytes * fi->height : size;
+  stats->ns    += ns;
+  return ns;
+}
+
+static bool recordFrame(const struct FrameInfo * fi)
+{
+  const RecordFrame rf =
+  {
+    .interval    = fi->interval,
+    .latency     = fi->latency,
+    .type        = fi->type,
+    .width       = fi->width,
+    .height      = fi->height,
+    .frameWidth  = fi->frameWidth,
+    .frameHeight = fi->frameHeight,
+    .pitch       = fi->pitch,
+    .damageCount = fi->rectCount
+  };
+
+  if (fwrite(&rf, sizeof(rf), 1, state.record) != 1 ||
+      fwrite(fi->rects, sizeof(*fi->rects), fi->rectCount, state.record) !=
+        fi->rectCount ||
+      fwrite(state.dst, fi->pitch, fi->height, state.record) != fi->height)
+  {
+    DEBUG_ERROR("Failed to write the recording, recording stopped");
+    fclose(state.record);
+    state.record = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+static void reportLive(uint64_t now)
+{
+  if (!state.reportTime)
+  {
+    state.reportTime = now;
+    return;
+  }
+
+  const uint64_t elapsed = now - state.reportTime;
+  if (elapsed < 1000000000ULL)
+    return;
+
+  fprintf(state.out, "%8.2f fps %10.2f MB/s linear\n",
+      state.reportFrames * 1e9 / elapsed,
+      state.reportBytes  * 1e3 / elapsed);
+
+  state.reportTime   = now;
+  state.reportFrames = 0;
+  state.reportBytes  = 0;
+}
+
+static void processFrame(const struct FrameInfo * fi)
+{
+  const size_t size     = (size_t)fi->height * fi->pitch;
+  const size_t rowBytes = min((size_t)fi->width * frameTypeBpp(fi->type),
+      (size_t)fi->pitch);
+
+  if (!ensureDst(size))
+  {
+    state.running = false;
+    return;
+  }
+
+  if (!state.frames)
+    state.startTime = nanotime();
+  else
+    histogram_record(&state.interval, fi->interval);
+
+  ++state.frames;
+  if (fi->latency)
+    histogram_record(&state.latency, fi->latency);
+
+  uint64_t readNs[READ_MAX] = { 0 };
+  uint64_t waitUs = 0;
+
+  if (fi->compressed)
+  {
+    ++state.compressed;
+    readNs[READ_DECODE] = timeRead(READ_DECODE, fi, rowBytes);
+  }
+  else
+  {
+    // wait for all the data so the reads only measure the copy
+    const uint64_t waitStart = nanotime();
+    if (!framebuffer_wait(fi->fb, size))
+    {
+      DEBUG_WARN("Timed out waiting for the frame data");
+      return;
+    }
+    waitUs = (nanotime() - waitStart) / 1000;
+    histogram_record(&state.wait, waitUs);
+
+    /* only the first read of a frame pays for the cold cache, rotate the
+     * order each frame so every variant pays it equally often */
+    static const int order[] = { READ_PITCHED, READ_FN, READ_LINEAR };
+    const unsigned int first = state.frames % ARRAY_LENGTH(order);
+    int variant = 0;
+    for(unsigned int i = 0; i < ARRAY_LENGTH(order); ++i)
+    {
+      variant = order[(first + i) % ARRAY_LENGTH(order)];
+      readNs[variant] = timeRead(variant, fi, rowBytes);
+    }
+
+    // the recording needs the destination to hold the frame as sent
+    if (state.record && variant != READ_LINEAR &&
+        !framebuffer_read_linear(fi->fb, state.dst, size))
+      DEBUG_WARN("Failed to read the frame for recording");
+  }
+
+  // damage coverage of the frame, overlapping rects are counted twice
+  const uint64_t total = (uint64_t)fi->frameWidth * fi->frameHeight;
+  uint64_t damaged = 0;
+  if (fi->rectCount == 0)
+  {
+    damaged = total;
+    ++state.fullDamage;
+  }
+  else
+    for(unsigned int i = 0; i < fi->rectCount; ++i)
+      damaged += (uint64_t)fi->rects[i].width * fi->rects[i].height;
+  damaged = min(damaged, total);
+
+  state.damageRects   += fi->rectCount;
+  state.pixelsDamaged += damaged;
+  state.pixelsTotal   += total;
+
+  if (state.record)
+    recordFrame(fi);
+
+  switch(state.format)
+  {
+    case OUTPUT_TEXT:
+      ++state.reportFrames;
+      state.reportBytes += fi->compressed ? 0 : size;
+      reportLive(nanotime());
+      break;
+
+    case OUTPUT_CSV:
+      fprintf(state.out,
+          "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%u,%zu,%d,%u,%.2f,%" PRIu64,
+          state.frames, fi->interval, fi->latency, fi->width, fi->height,
+          size, fi->compressed ? 1 : 0, fi->rectCount,
+          total ? damaged * 100.0 / total : 0.0, waitUs);
+      for(int i = 0; i < READ_MAX; ++i)
+        fprintf(state.out, ",%.1f", readNs[i] / 1e3);
+      fputc('\n', state.out);
+      break;
+
+    case OUTPUT_JSON:
+      break;
+  }
+
+  if (state.maxFrames && state.frames >= state.maxFrames)
+    state.running = false;
+}
+
+static void reportHistogram(const char * name, const KVMFRHistogram * hist,
+    bool last)
+{
+  const double avg = hist->count ? (double)hist->sum / hist->count : 0.0;
+
+  if (state.format == OUTPUT_JSON)
+  {
+    fprintf(state.out,
+        "    \"%s\": { \"count\": %" PRIu64 ", \"avg\": %.1f, \"p50\": %" PRIu64
+        ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %u }%s\n",
+        name, hist->count, avg,
+        histogram_percentile(hist, 50.0),
+        histogram_percentile(hist, 90.0),
+        histogram_percentile(hist, 99.0),
+        hist->max, last ? "" : ",");
+    return;
+  }
+
+  fprintf(state.out,
+      "%-10s %8" PRIu64 " %10.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+      " %10u\n",
+      name, hist->count, avg,
+      histogram_percentile(hist, 50.0),
+      histogram_percentile(hist, 90.0),
+      histogram_percentile(hist, 99.0),
+      hist->max);
+}
+
+static void reportSummary(void)
+{
+  if (state.format == OUTPUT_CSV || !state.frames)
+    return;
+
+  const double seconds  = (nanotime() - state.startTime) / 1e9;
+  const double coverage = state.pixelsTotal ?
+    state.pixelsDamaged * 100.0 / state.pixelsTotal : 0.0;
+  const double avgRects = (double)state.damageRects / state.frames;
+
+  if (state.format == OUTPUT_JSON)
+  {
+    fprintf(state.out,
+        "{\n"
+        "  \"frames\": %" PRIu64 ",\n"
+        "  \"compressed\": %" PRIu64 ",\n"
+        "  \"seconds\": %.3f,\n"
+        "  \"damage\": { \"coverage\": %.2f, \"fullFrames\": %" PRIu64
+        ", \"avgRects\": %.2f },\n"
+        "  \"throughput\": {\n",
+        state.frames, state.compressed, seconds,
+        coverage, state.fullDamage, avgRects);
+
+    for(int i = 0; i < READ_MAX; ++i)
+    {
+      const struct ReadStats * rs = &state.reads[i];
+      fprintf(state.out, "    \"%s\": %.2f%s\n", readNames[i],
+          rs->ns ? rs->bytes * 1e3 / rs->ns : 0.0,
+          i == READ_MAX - 1 ? "" : ",");
+    }
+
+    fprintf(state.out, "  },\n  \"us\": {\n");
+    reportHistogram("interval", &state.interval, false);
+    reportHistogram("latency" , &state.latency , false);
+    reportHistogram("wait"    , &state.wait    , false);
+    for(int i = 0; i < READ_MAX; ++i)
+      reportHistogram(readNames[i], &state.reads[i].cost, i == READ_MAX - 1);
+    fprintf(state.out, "  }\n}\n");
+    return;
+  }
+
+  fprintf(state.out,
+      "\n%" PRIu64 " frames (%" PRIu64 " compressed) in %.2fs\n"
+      "damage: %.2f%% coverage, %" PRIu64 " full frames, %.2f rects/frame\n\n",
+      state.frames, state.compressed, seconds,
+      coverage, state.fullDamage, avgRects);
+
+  fprintf(state.out, "%-10s %10s\n", "read", "MB/s");
+  for(int i = 0; i < READ_MAX; ++i)
+  {
+    const struct ReadStats * rs = &state.reads[i];
+    if (rs->ns)
+      fprintf(state.out, "%-10s %10.2f\n", readNames[i],
+          rs->bytes * 1e3 / rs->ns);
+  }
+
+  fprintf(state.out, "\n%-10s %8s %10s %10s %10s %10s %10s\n",
+      "us", "count", "avg", "p50", "p90", "p99", "max");
+  reportHistogram("interval", &state.interval, false);
+  reportHistogram("latency" , &state.latency , false);
+  reportHistogram("wait"    , &state.wait    , false);
+  for(int i = 0; i < READ_MAX; ++i)
+    if (state.reads[i].cost.count)
+      reportHistogram(readNames[i], &state.reads[i].cost, false);
+}
+
+static int runLive(void)
 {
   PLGMPClient      lgmp;
   PLGMPClientQueue frameQueue;
@@ -119,7 +645,7 @@ static int run(void)
     return -1;
   }
 
-  if (udataSize != sizeof(KVMFR) ||
+  if (udataSize < sizeof(KVMFR) ||
       memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
       udata->version != KVMFR_VERSION)
   {
@@ -130,24 +656,40 @@ static int run(void)
     return -1;
   }
 
+  // the host's clock record seeds the timestamp offset
+  ClockSync clock;
+  clockSync_init(&clock, NULL);
+  {
+    uint8_t * p    = (uint8_t *)(udata + 1);
+    uint32_t  size = udataSize - sizeof(*udata);
+    while(size >= sizeof(KVMFRRecord))
+    {
+      KVMFRRecord * record = (KVMFRRecord *)p;
+      p    += sizeof(*record);
+      size -= sizeof(*record);
+      if (record->size > size)
+        break;
+
+      if (record->type == KVMFR_RECORD_CLOCK &&
+          record->size >= sizeof(KVMFRRecord_Clock))
+        clockSync_init(&clock, (KVMFRRecord_Clock *)p);
+
+      p    += record->size;
+      size -= record->size;
+    }
+  }
+
   if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_FRAME, &frameQueue) != LGMP_OK))
   {
     DEBUG_ERROR("lgmpClientSubscribe: %s", lgmpStatusString(status));
     return -1;
   }
 
-  struct perf
-  {
-    uint64_t min, max, ttl;
-    unsigned int count;
-  };
+  // too large for the stack
+  static FrameDamageRect rects[FRAMEDAMAGE_MAX_RECTS];
 
-  unsigned int frameCount    = 0;
-  uint64_t     lastFrameTime = 0;
-  struct perf  p1  = {};
-  struct perf  p5  = {};
-  struct perf  p10 = {};
-  struct perf  p30 = {};
+  uint32_t frameSerial   = 0;
+  uint64_t lastFrameTime = 0;
 
   // start accepting frames
   while(state.running)
@@ -162,54 +704,175 @@ static int run(void)
       return -1;
     }
 
+    const KVMFRFrame * frame = (const KVMFRFrame *)msg.mem;
+    const uint64_t receiveTime = microtime();
+
+    // repeated frames are sent when a new client connects
+    if (state.frames && frame->frameSerial == frameSerial)
+    {
+      lgmpClientMessageDone(frameQueue);
+      continue;
+    }
+    frameSerial = frame->frameSerial;
+
+    if (frame->postTime)
+      clockSync_sample(&clock, frame->postTime, receiveTime);
+
+    const FrameBuffer * fb =
+      (const FrameBuffer *)(((const uint8_t *)frame) + frame->offset);
+
+    struct FrameInfo fi =
+    {
+      .type        = frame->type,
+      .width       = frame->dataWidth,
+      .height      = frame->dataHeight,
+      .frameWidth  = frame->frameWidth,
+      .frameHeight = frame->frameHeight,
+      .pitch       = frame->pitch,
+      .compressed  = frame->flags & FRAME_FLAG_COMPRESSED,
+      .fb          = fb,
+      .maxSize     = state.shmDev.size - sizeof(*fb) -
+        ((const uint8_t *)fb - (const uint8_t *)state.shmDev.mem),
+      .rects       = rects,
+      .rectCount   = frameDamage_decode(frame, rects, ARRAY_LENGTH(rects)),
+      .interval    = lastFrameTime ? receiveTime - lastFrameTime : 0
+    };
+    lastFrameTime = receiveTime;
+
+    if (frame->captureTime && clock.valid)
+    {
+      const uint64_t local = clockSync_toLocal(&clock, frame->captureTime);
+      if (local < receiveTime)
+        fi.latency = receiveTime - local;
+    }
+
+    // hold the message until the frame has been read so it is not replaced
+    processFrame(&fi);
     lgmpClientMessageDone(frameQueue);
+  }
 
-    uint64_t frameTime = nanotime();
-    uint64_t diff = frameTime - lastFrameTime;
+  lgmpClientUnsubscribe(&frameQueue);
+  lgmpClientFree(&lgmp);
+  return 0;
+}
+
+static int runReplay(const char * path)
+{
+  FILE * fp = fopen(path, "rb");
+  if (!fp)
+  {
+    DEBUG_ERROR("Failed to open the recording: %s", path);
+    return -1;
+  }
+
+  int ret = -1;
+  char magic[sizeof(RECORD_MAGIC) - 1];
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0)
+  {
+    DEBUG_ERROR("%s is not a recording", path);
+    goto err_file;
+  }
 
-    if (frameCount++ == 0)
+  static FrameDamageRect rects[FRAMEDAMAGE_MAX_RECTS];
+  FrameBuffer * fb     = NULL;
+  size_t        fbSize = 0;
+
+  RecordFrame rf;
+  while(state.running && fread(&rf, sizeof(rf), 1, fp) == 1)
+  {
+    const size_t size = (size_t)rf.height * rf.pitch;
+    if (rf.damageCount > ARRAY_LENGTH(rects) ||
+        rf.height == 0 || rf.pitch == 0)
     {
-      lastFrameTime = frameTime;
-      p1.min = p5.min = p10.min = p30.min = diff;
-      continue;
+      DEBUG_ERROR("The recording is corrupt");
+      goto err_fb;
     }
 
-    ++p1 .count;
-    ++p5 .count;
-    ++p10.count;
-    ++p30.count;
-
-#define UPDATE(p, interval) \
-    if (p.ttl + diff >= (1e9 * interval)) \
-    { \
-      fprintf(stdout, "%02d, min:%9lu ns (%5.2f ms) max:%9lu ns (%5.2f ms) avg:%9lu ns (%5.2f ms)\n", \
-          interval, \
-          p.min          , ((float)p.min / 1e6f), \
-          p.max          , ((float)p.max / 1e6f), \
-          p.ttl / p.count, (((float)p.ttl / p.count) / 1e6f)\
-      ); \
-      p.min = p.max = p.ttl = diff; p.count = 1; \
-    } \
-    else \
-    { \
-      p.min = min(p.min, diff); \
-      p.max = max(p.max, diff); \
-      p.ttl += diff; \
+    if (size > fbSize)
+    {
+      free(fb);
+      fbSize = size;
+      fb     = aligned_alloc(FB_ALIGN, ALIGN_TO(sizeof(*fb) + size, FB_ALIGN));
+      if (!fb)
+      {
+        DEBUG_ERROR("Failed to allocate %zu bytes", size);
+        goto err_file;
+      }
     }
 
-    UPDATE(p1 , 1 );
-    UPDATE(p5 , 5 );
-    UPDATE(p10, 10);
-    UPDATE(p30, 30);
+    if (fread(rects, sizeof(*rects), rf.damageCount, fp) != rf.damageCount ||
+        fread(framebuffer_get_data(fb), size, 1, fp) != 1)
+    {
+      DEBUG_ERROR("The recording is truncated");
+      goto err_fb;
+    }
+    framebuffer_set_write_ptr(fb, size);
 
-    lastFrameTime = frameTime;
+    const struct FrameInfo fi =
+    {
+      .type        = rf.type,
+      .width       = rf.width,
+      .height      = rf.height,
+      .frameWidth  = rf.frameWidth,
+      .frameHeight = rf.frameHeight,
+      .pitch       = rf.pitch,
+      .fb          = fb,
+      .maxSize     = size,
+      .rects       = rects,
+      .rectCount   = rf.damageCount,
+      .interval    = rf.interval,
+      .latency     = rf.latency
+    };
+
+    processFrame(&fi);
   }
 
-  return 0;
+  ret = 0;
+
+err_fb:
+  free(fb);
+err_file:
+  fclose(fp);
+  return ret;
+}
+
+static bool setReadMethod(void)
+{
+  static const struct
+  {
+    const char *          name;
+    FrameBufferReadMethod method;
+  }
+  methods[] =
+  {
+    { "memcpy", FB_READ_MEMCPY },
+    { "stream", FB_READ_STREAM },
+    { "sse4.1", FB_READ_SSE4_1 },
+    { "avx2"  , FB_READ_AVX2   },
+    { "avx512", FB_READ_AVX512 }
+  };
+
+  const char * name = option_get_string("profile", "readMethod");
+  for(int i = 0; i < ARRAY_LENGTH(methods); ++i)
+  {
+    if (strcasecmp(name, methods[i].name) != 0)
+      continue;
+
+    if (!framebuffer_set_read_method(methods[i].method))
+    {
+      DEBUG_ERROR("The %s read method is not supported by this CPU", name);
+      return false;
+    }
+    return true;
+  }
+
+  return false;
 }
 
 int main(int argc, char * argv[])
 {
+  debug_init();
   DEBUG_INFO("Looking Glass (" BUILD_VERSION ") - Client Profiler");
 
   if (!installCrashHandler("/proc/self/exe"))
@@ -225,13 +888,71 @@ int main(int argc, char * argv[])
   }
 
   // init the global state vars
-  state.running = true;
+  state.running   = true;
+  state.out       = stdout;
+  state.maxFrames = max(option_get_int("profile", "frames"), 0);
+
+  const char * format = option_get_string("profile", "format");
+  if (!strcasecmp(format, "csv"))
+    state.format = OUTPUT_CSV;
+  else if (!strcasecmp(format, "json"))
+    state.format = OUTPUT_JSON;
+  else
+    state.format = OUTPUT_TEXT;
 
   int ret = -1;
-  if (ivshmemOpen(&state.shmDev))
-    ret = run();
+  if (!setReadMethod())
+    goto out;
+
+  const char * output = option_get_string("profile", "output");
+  if (output && !(state.out = fopen(output, "w")))
+  {
+    DEBUG_ERROR("Failed to open %s for writing", output);
+    state.out = stdout;
+    goto out;
+  }
+
+  const char * record = option_get_string("profile", "record");
+  if (record)
+  {
+    if (!(state.record = fopen(record, "wb")) ||
+        fwrite(RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1, 1, state.record) != 1)
+    {
+      DEBUG_ERROR("Failed to open %s for recording", record);
+      goto out;
+    }
+  }
+
+  signal(SIGINT , signalHandler);
+  signal(SIGTERM, signalHandler);
+
+  if (state.format == OUTPUT_CSV)
+  {
+    fprintf(state.out, "frame,interval_us,latency_us,width,height,bytes,"
+        "compressed,damage_rects,damage_pct,wait_us");
+    for(int i = 0; i < READ_MAX; ++i)
+      fprintf(state.out, ",%s_us", readNames[i]);
+    fputc('\n', state.out);
+  }
+
+  const char * replay = option_get_string("profile", "replay");
+  if (replay)
+    ret = runReplay(replay);
+  else
+  {
+    if (ivshmemOpen(&state.shmDev))
+      ret = runLive();
+    ivshmemClose(&state.shmDev);
+  }
+
+  reportSummary();
 
-  ivshmemClose(&state.shmDev);
+out:
+  if (state.record)
+    fclose(state.record);
+  if (state.out != stdout)
+    fclose(state.out);
+  free(state.dst);
   option_free();
   return ret;
 }
@@ -0,0 +1,677 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2024 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/framebuffer.h"
+#include "common/rects.h"
+#include "common/ivshmem.h"
+#include "common/cpuinfo.h"
+#include "common/time.h"
+#include "common/util.h"
+#include "common/array.h"
+#include "common/version.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FB_ALIGN 4096
+
+struct state
+{
+  bool           useShm;
+  struct IVSHMEM shmDev;
+
+  size_t         size;
+  unsigned int   iterations;
+  int            width, height, bpp;
+
+  uint8_t      * src;
+  uint8_t      * dst;
+  void         * fbAlloc;
+  FrameBuffer  * frame;
+};
+
+static struct state state = { 0 };
+
+static struct Option options[] =
+{
+  {
+    .module         = "bench",
+    .name           = "width",
+    .description    = "The width of the frame to copy",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 3840
+  },
+  {
+    .module         = "bench",
+    .name           = "height",
+    .description    = "The height of the frame to copy",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2160
+  },
+  {
+    .module         = "bench",
+    .name           = "bpp",
+    .description    = "The bytes per pixel of the frame to copy",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 8
+  },
+  {
+    .module         = "bench",
+    .name           = "iterations",
+    .description    = "The number of frames to copy per test",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 100
+  },
+  {
+    .module         = "bench",
+    .name           = "maxThreads",
+    .description    = "The maximum number of write threads to test (0 = CPU count)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "bench",
+    .name           = "shmFile",
+    .description    = "Place the framebuffer in this shared memory file or kvmfr device",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {0}
+};
+
+static void report(const char * name, uint64_t ns)
+{
+  const double bytes = (double)state.size * state.iterations;
+  fprintf(stdout, "%-24s %8.2f GB/s %8.3f ms/frame\n",
+      name,
+      bytes / (double)ns,
+      ((double)ns / state.iterations) / 1e6);
+}
+
+static void benchWrite(void)
+{
+  int maxThreads = option_get_int("bench", "maxThreads");
+  if (maxThreads <= 0 && !cpuInfo_get(NULL, 0, &maxThreads, NULL, NULL))
+    maxThreads = 1;
+  maxThreads = min(maxThreads, FB_MAX_WRITE_THREADS);
+
+  fprintf(stdout, "== framebuffer_write ==\n");
+  for(int threads = 1; threads <= maxThreads; ++threads)
+  {
+    if (!framebuffer_set_write_threads(threads))
+    {
+      DEBUG_ERROR("Failed to set the write threads to %d", threads);
+      break;
+    }
+
+    // warm up
+    framebuffer_prepare(state.frame);
+    framebuffer_write(state.frame, state.src, state.size);
+
+    const uint64_t start = nanotime();
+    for(unsigned int i = 0; i < state.iterations; ++i)
+    {
+      framebuffer_prepare(state.frame);
+      framebuffer_write(state.frame, state.src, state.size);
+    }
+    const uint64_t ns = nanotime() - start;
+
+    if (!framebuffer_wait(state.frame, state.size) ||
+        memcmp(framebuffer_get_buffer(state.frame), state.src, state.size) != 0)
+    {
+      DEBUG_ERROR("Frame data mismatch with %d threads", threads);
+      break;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "threads: %2d", threads);
+    report(name, ns);
+  }
+
+  framebuffer_set_write_threads(0);
+}
+
+static void benchRead(void)
+{
+  static const struct
+  {
+    const char *          name;
+    FrameBufferReadMethod method;
+  }
+  methods[] =
+  {
+    { "memcpy", FB_READ_MEMCPY },
+    { "stream", FB_READ_STREAM },
+    { "sse4.1", FB_READ_SSE4_1 },
+    { "avx2"  , FB_READ_AVX2   },
+    { "avx512", FB_READ_AVX512 }
+  };
+
+  // fill the framebuffer so the reads never need to wait
+  framebuffer_prepare(state.frame);
+  framebuffer_write(state.frame, state.src, state.size);
+
+  fprintf(stdout, "== framebuffer_read_linear ==\n");
+  for(int i = 0; i < ARRAY_LENGTH(methods); ++i)
+  {
+    if (!framebuffer_set_read_method(methods[i].method))
+    {
+      fprintf(stdout, "%-24s unsupported\n", methods[i].name);
+      continue;
+    }
+
+    memset(state.dst, 0, state.size);
+    framebuffer_read_linear(state.frame, state.dst, state.size);
+
+    const uint64_t start = nanotime();
+    for(unsigned int n = 0; n < state.iterations; ++n)
+      framebuffer_read_linear(state.frame, state.dst, state.size);
+    const uint64_t ns = nanotime() - start;
+
+    if (memcmp(state.dst, state.src, state.size) != 0)
+    {
+      DEBUG_ERROR("Frame data mismatch reading with %s", methods[i].name);
+      break;
+    }
+
+    report(methods[i].name, ns);
+  }
+
+  framebuffer_set_read_method(FB_READ_MEMCPY);
+}
+
+#define MAX_BENCH_RECTS 64
+
+/* synthetic damage patterns, positions are clipped to the frame */
+static int damageTyping(FrameDamageRect * rects)
+{
+  // a line of glyphs being typed into an editor, plus the caret
+  int count = 0;
+  for(int i = 0; i < 48; ++i)
+    rects[count++] = (FrameDamageRect) {
+      .x = 200 + i * 9, .y = 600, .width = 9, .height = 18 };
+  rects[count++] = (FrameDamageRect) {
+    .x = 200 + 48 * 9, .y = 598, .width = 2, .height = 22 };
+  return count;
+}
+
+static int damageScrolling(FrameDamageRect * rects)
+{
+  // a scrolled browser window and its scroll bar
+  int count = 0;
+  rects[count++] = (FrameDamageRect) {
+    .x = 100, .y = 150, .width = 1700, .height = 1200 };
+  rects[count++] = (FrameDamageRect) {
+    .x = 1800, .y = 150, .width = 16, .height = 1200 };
+  return count;
+}
+
+static int damageVideo(FrameDamageRect * rects)
+{
+  // a windowed video with its progress bar, clock and a notification icon
+  int count = 0;
+  rects[count++] = (FrameDamageRect) {
+    .x = 320, .y = 180, .width = 1280, .height = 720 };
+  rects[count++] = (FrameDamageRect) {
+    .x = 320, .y = 904, .width = 1280, .height = 4 };
+  rects[count++] = (FrameDamageRect) {
+    .x = 340, .y = 912, .width = 96, .height = 16 };
+  rects[count++] = (FrameDamageRect) {
+    .x = 3700, .y = 2120, .width = 64, .height = 24 };
+  return count;
+}
+
+static int damageScattered(FrameDamageRect * rects)
+{
+  // the maximum number of small rects spread over the frame
+  for(int i = 0; i < MAX_BENCH_RECTS; ++i)
+    rects[i] = (FrameDamageRect) {
+      .x = (i % 8) * 480 + (i * 37) % 200,
+      .y = (i / 8) * 270 + (i * 53) % 100,
+      .width = 64, .height = 48 };
+  return MAX_BENCH_RECTS;
+}
+
+static int clipRects(FrameDamageRect * rects, int count)
+{
+  int o = 0;
+  for(int i = 0; i < count; ++i)
+  {
+    FrameDamageRect r = rects[i];
+    if (r.x >= state.width || r.y >= state.height)
+      continue;
+
+    r.width  = min(r.width , state.width  - r.x);
+    r.height = min(r.height, state.height - r.y);
+    rects[o++] = r;
+  }
+  return o;
+}
+
+static bool verifyRects(const FrameDamageRect * rects, int count,
+    const uint8_t * dst)
+{
+  const size_t pitch = (size_t)state.width * state.bpp;
+  for(int i = 0; i < count; ++i)
+    for(unsigned int y = rects[i].y; y < rects[i].y + rects[i].height; ++y)
+    {
+      const size_t offset = y * pitch + rects[i].x * state.bpp;
+      if (memcmp(dst + offset, state.src + offset,
+            rects[i].width * state.bpp) != 0)
+        return false;
+    }
+  return true;
+}
+
+static void reportRects(const char * name, const FrameDamageRect * rects,
+    int count, uint64_t ns)
+{
+  size_t bytes = 0;
+  for(int i = 0; i < count; ++i)
+    bytes += (size_t)rects[i].width * rects[i].height * state.bpp;
+
+  fprintf(stdout, "%-24s %3d rects %8.2f MiB %8.3f ms/frame\n",
+      name, count, bytes / 1048576.0,
+      ((double)ns / state.iterations) / 1e6);
+}
+
+static void benchRects(void)
+{
+  static const struct
+  {
+    const char * name;
+    int (*fn)(FrameDamageRect * rects);
+  }
+  patterns[] =
+  {
+    { "typing"   , damageTyping    },
+    { "scrolling", damageScrolling },
+    { "video"    , damageVideo     },
+    { "scattered", damageScattered }
+  };
+
+  const int pitch = state.width * state.bpp;
+  FrameDamageRect rects[MAX_BENCH_RECTS];
+
+  fprintf(stdout, "== rectsBufferToFramebuffer ==\n");
+  for(int i = 0; i < ARRAY_LENGTH(patterns); ++i)
+  {
+    const int count = clipRects(rects, patterns[i].fn(rects));
+
+    framebuffer_prepare(state.frame);
+    memset(framebuffer_get_data(state.frame), 0, state.size);
+    rectsBufferToFramebuffer(rects, count, state.bpp, state.frame, pitch,
+        state.height, state.src, pitch);
+
+    if (!verifyRects(rects, count, framebuffer_get_buffer(state.frame)))
+    {
+      DEBUG_ERROR("Frame data mismatch copying %s", patterns[i].name);
+      break;
+    }
+
+    const uint64_t start = nanotime();
+    for(unsigned int n = 0; n < state.iterations; ++n)
+    {
+      framebuffer_prepare(state.frame);
+      rectsBufferToFramebuffer(rects, count, state.bpp, state.frame, pitch,
+          state.height, state.src, pitch);
+    }
+    reportRects(patterns[i].name, rects, count, nanotime() - start);
+  }
+
+  // the frame buffer now holds a complete frame for the reads
+  framebuffer_prepare(state.frame);
+  framebuffer_write(state.frame, state.src, state.size);
+
+  fprintf(stdout, "== rectsFramebufferToBuffer ==\n");
+  for(int i = 0; i < ARRAY_LENGTH(patterns); ++i)
+  {
+    const int count = clipRects(rects, patterns[i].fn(rects));
+
+    memset(state.dst, 0, state.size);
+    rectsFramebufferToBuffer(rects, count, state.bpp, state.dst, pitch,
+        state.height, state.frame, pitch);
+
+    if (!verifyRects(rects, count, state.dst))
+    {
+      DEBUG_ERROR("Frame data mismatch copying %s", patterns[i].name);
+      break;
+    }
+
+    const uint64_t start = nanotime();
+    for(unsigned int n = 0; n < state.iterations; ++n)
+      rectsFramebufferToBuffer(rects, count, state.bpp, state.dst, pitch,
+          state.height, state.frame, pitch);
+    reportRects(patterns[i].name, rects, count, nanotime() - start);
+  }
+}
+
+/* the previous quadratic implementation of rectsMergeOverlapping, kept here
+ * as a baseline for the region benchmark */
+static int mergeQuadratic(FrameDamageRect * rects, int count)
+{
+  bool removed[count];
+  bool changed;
+
+  memset(removed, 0, sizeof(removed));
+  do
+  {
+    changed = false;
+    for(int i = 0; i < count; ++i)
+    {
+      if (removed[i])
+        continue;
+
+      for(int j = i + 1; j < count; ++j)
+      {
+        FrameDamageRect * a = rects + i;
+        FrameDamageRect * b = rects + j;
+        if (removed[j] ||
+            a->x > b->x + b->width  || b->x > a->x + a->width ||
+            a->y > b->y + b->height || b->y > a->y + a->height)
+          continue;
+
+        const uint32_t x2 = max(a->x + a->width , b->x + b->width );
+        const uint32_t y2 = max(a->y + a->height, b->y + b->height);
+        a->x      = min(a->x, b->x);
+        a->y      = min(a->y, b->y);
+        a->width  = x2 - a->x;
+        a->height = y2 - a->y;
+
+        removed[j] = true;
+        changed    = true;
+      }
+    }
+  }
+  while(changed);
+
+  int o = 0;
+  for(int i = 0; i < count; ++i)
+    if (!removed[i])
+      rects[o++] = rects[i];
+  return o;
+}
+
+static void randomRects(FrameDamageRect * rects, int count, uint32_t seed)
+{
+  for(int i = 0; i < count; ++i)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    const uint32_t w = 4 + (seed >> 8) % 64;
+    seed = seed * 1664525u + 1013904223u;
+    const uint32_t h = 4 + (seed >> 8) % 64;
+    seed = seed * 1664525u + 1013904223u;
+    const uint32_t x = (seed >> 8) % (state.width  - min(w, state.width ) + 1);
+    seed = seed * 1664525u + 1013904223u;
+    const uint32_t y = (seed >> 8) % (state.height - min(h, state.height) + 1);
+
+    rects[i] = (FrameDamageRect) {
+      .x = x, .y = y,
+      .width  = min(w, state.width),
+      .height = min(h, state.height)
+    };
+  }
+}
+
+/* rasterise the rects into `map`, returning the number of pixels that were
+ * covered more than once */
+static size_t coverage(uint8_t * map, const FrameDamageRect * rects, int count)
+{
+  size_t overlap = 0;
+  memset(map, 0, (size_t)state.width * state.height);
+  for(int i = 0; i < count; ++i)
+    for(unsigned int y = rects[i].y; y < rects[i].y + rects[i].height; ++y)
+      for(unsigned int x = rects[i].x; x < rects[i].x + rects[i].width; ++x)
+        if (map[(size_t)y * state.width + x]++)
+          ++overlap;
+  return overlap;
+}
+
+static bool verifyRegion(const FrameDamageRect * in, int inCount,
+    const FrameDamageRect * sub, int subCount,
+    const FrameDamageRect * out, int outCount, bool exact, bool disjoint)
+{
+  const size_t pixels = (size_t)state.width * state.height;
+  uint8_t * want = malloc(pixels);
+  uint8_t * have = malloc(pixels);
+  uint8_t * mask = malloc(pixels);
+  bool ret = false;
+
+  if (!want || !have || !mask)
+  {
+    DEBUG_ERROR("Out of memory");
+    goto out;
+  }
+
+  coverage(want, in , inCount );
+  coverage(mask, sub, subCount);
+  if (coverage(have, out, outCount) > 0 && disjoint)
+    goto out;
+
+  for(size_t i = 0; i < pixels; ++i)
+  {
+    const bool w = want[i] && !mask[i];
+    if ((exact && w != !!have[i]) || (w && !have[i]))
+      goto out;
+  }
+
+  ret = true;
+
+out:
+  free(mask);
+  free(have);
+  free(want);
+  return ret;
+}
+
+static void benchRegion(void)
+{
+  static const int sizes[] = { 64, 256, 1024 };
+  const unsigned int iterations = max(1, state.iterations / 10);
+
+  fprintf(stdout, "== rects region (%u iterations) ==\n", iterations);
+  for(int s = 0; s < ARRAY_LENGTH(sizes); ++s)
+  {
+    const int count    = sizes[s];
+    const int maxOut   = count * count;
+    FrameDamageRect * in   = malloc(sizeof(*in ) * count * 2);
+    FrameDamageRect * work = malloc(sizeof(*work) * count);
+    FrameDamageRect * out  = malloc(sizeof(*out) * maxOut);
+    if (!in || !work || !out)
+    {
+      DEBUG_ERROR("Out of memory");
+      free(out);
+      free(work);
+      free(in);
+      return;
+    }
+
+    randomRects(in, count * 2, 0x1234 + count);
+    const FrameDamageRect * sub = in + count;
+    const int subCount = count / 4;
+
+    static const char * names[] =
+      { "quadratic", "merge", "union", "subtract", "coalesce" };
+
+    for(int op = 0; op < ARRAY_LENGTH(names); ++op)
+    {
+      int result = 0;
+      uint64_t ns = 0;
+      for(unsigned int n = 0; n < iterations; ++n)
+      {
+        memcpy(work, in, sizeof(*work) * count);
+        const uint64_t start = nanotime();
+        switch(op)
+        {
+          case 0: result = mergeQuadratic(work, count); break;
+          case 1: result = rectsMergeOverlapping(work, count); break;
+          case 2: result = rectsUnion(work, count, out, maxOut); break;
+          case 3:
+            result = rectsSubtract(work, count, sub, subCount, out, maxOut);
+            break;
+          case 4: result = rectsCoalesce(work, count, 64); break;
+        }
+        ns += nanotime() - start;
+      }
+
+      bool ok;
+      switch(op)
+      {
+        case 2:
+          ok = verifyRegion(in, count, NULL, 0, out, result, true, true);
+          break;
+
+        case 3:
+          ok = verifyRegion(in, count, sub, subCount, out, result, true,
+              true);
+          break;
+
+        default:
+          ok = (op != 4 || result <= 64) &&
+            verifyRegion(in, count, NULL, 0, work, result, false, op != 4);
+          break;
+      }
+
+      char name[32];
+      snprintf(name, sizeof(name), "%s %d", names[op], count);
+      fprintf(stdout, "%-24s %5d rects %10.3f us/call%s\n",
+          name, result, (double)ns / iterations / 1e3,
+          ok ? "" : " COVERAGE MISMATCH");
+    }
+
+    free(out);
+    free(work);
+    free(in);
+  }
+}
+
+static bool setup(void)
+{
+  const int width  = option_get_int("bench", "width" );
+  const int height = option_get_int("bench", "height");
+  const int bpp    = option_get_int("bench", "bpp"   );
+
+  if (width <= 0 || height <= 0 || bpp <= 0)
+  {
+    DEBUG_ERROR("Invalid frame dimensions");
+    return false;
+  }
+
+  state.width      = width;
+  state.height     = height;
+  state.bpp        = bpp;
+  state.size       = (size_t)width * height * bpp;
+  state.iterations = max(1, option_get_int("bench", "iterations"));
+
+  const char * shmFile = option_get_string("bench", "shmFile");
+  state.useShm = shmFile && *shmFile;
+
+  const size_t allocSize = ALIGN_TO(state.size, FB_ALIGN);
+  state.src = aligned_alloc(FB_ALIGN, allocSize);
+  state.dst = aligned_alloc(FB_ALIGN, allocSize);
+  if (!state.src || !state.dst)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  for(size_t i = 0; i < state.size; ++i)
+    state.src[i] = (uint8_t)i;
+  memset(state.dst, 0, state.size);
+
+  /* put the framebuffer on the border of the next page, as the host does, so
+   * that the data is page aligned */
+  const size_t fbSize = FB_ALIGN + allocSize;
+  uint8_t * fbMem;
+  if (state.useShm)
+  {
+    if (!ivshmemOpenDev(&state.shmDev, shmFile))
+      return false;
+
+    if (state.shmDev.size < fbSize)
+    {
+      DEBUG_ERROR("The shared memory is too small for the frame");
+      return false;
+    }
+
+    fbMem = state.shmDev.mem;
+  }
+  else
+  {
+    if (!(state.fbAlloc = aligned_alloc(FB_ALIGN, fbSize)))
+    {
+      DEBUG_ERROR("Out of memory");
+      return false;
+    }
+    fbMem = state.fbAlloc;
+  }
+
+  state.frame = (FrameBuffer *)(fbMem + FB_ALIGN - sizeof(FrameBuffer));
+  atomic_store(&state.frame->waiters, 0);
+  framebuffer_prepare(state.frame);
+  return true;
+}
+
+static void cleanup(void)
+{
+  if (state.useShm)
+    ivshmemClose(&state.shmDev);
+
+  free(state.fbAlloc);
+  free(state.dst);
+  free(state.src);
+}
+
+int main(int argc, char * argv[])
+{
+  debug_init();
+  DEBUG_INFO("Looking Glass (%s) - Framebuffer Profiler", BUILD_VERSION);
+
+  option_register(options);
+
+  if (!option_parse(argc, argv) || !option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  cpuInfo_log();
+
+  int ret = -1;
+  if (setup())
+  {
+    fprintf(stdout, "Frame size: %.2f MiB, %u iterations%s\n",
+        state.size / 1048576.0, state.iterations,
+        state.useShm ? ", shared memory" : "");
+
+    benchWrite();
+    benchRead();
+    benchRects();
+    benchRegion();
+    ret = 0;
+  }
+
+  cleanup();
+  option_free();
+  return ret;
+}